@@ -0,0 +1,456 @@
+
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013-2024 Karl Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file bench.c
+ * \brief Benchmark of the NSS entry points and the libhosts write path
+ *
+ * For each table size a db is generated from hosts.sql, the NSS module
+ * is dlopen()ed and gethostbyname2_r and gethostbyaddr_r are driven
+ * from N threads for a fixed time, first from SQL and then from a
+ * compiled snapshot.  gethostent_r walks the table from one thread,
+ * as glibc only keeps one enumeration per process.  Last the write
+ * path is timed: Hosts_add_zoned_host (a connection per call),
+ * Hosts_add on a handle, and Hosts_add batched in a transaction.
+ *
+ * Every result is a line of JSON on stdout, progress goes to stderr.
+ *
+ * Usage: hosts_bench [--rows N,N...] [--threads N] [--seconds N]
+ *                    [--cache N] [--schema hosts.sql] [module]
+ * with HOSTSDB naming the scratch db, which is overwritten.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <netdb.h>
+#include <nss.h>
+#include <pthread.h>
+
+#include <sqlite3.h>
+
+#include "hosts.h"
+
+typedef enum nss_status (*byname2_fn)( const char *, int, struct hostent *,
+                                       char *, size_t, int *, int * );
+typedef enum nss_status (*byaddr_fn)( const void *, socklen_t, int, struct hostent *,
+                                      char *, size_t, int *, int * );
+typedef enum nss_status (*sethostent_fn)( int );
+typedef enum nss_status (*endhostent_fn)( void );
+typedef enum nss_status (*gethostent_fn)( struct hostent *, char *, size_t, int *, int * );
+
+static byname2_fn byname2;
+static byaddr_fn byaddr;
+static sethostent_fn set_hostent;
+static endhostent_fn end_hostent;
+static gethostent_fn get_hostent;
+
+/*
+ * Log-linear latency histogram: 16 buckets per power of two, so any
+ * value is reported to within about 6%.
+ */
+#define SUB_BITS 4
+#define BUCKETS  (64 << SUB_BITS)
+
+struct histogram {
+    uint64_t count[BUCKETS];
+    uint64_t total;
+};
+
+static int
+bucket( uint64_t ns ) {
+    int msb;
+
+    if ( ns < (1 << SUB_BITS) ) return ns;
+    msb = 63 - __builtin_clzll( ns );
+    return ((msb - SUB_BITS + 1) << SUB_BITS) +
+           ((ns >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+static uint64_t
+bucket_value( int b ) {
+    if ( b < (1 << SUB_BITS) ) return b;
+    return (uint64_t)((b & ((1 << SUB_BITS) - 1)) | (1 << SUB_BITS)) << ((b >> SUB_BITS) - 1);
+}
+
+static void
+record( struct histogram *h, uint64_t ns ) {
+    h->count[bucket(ns)]++;
+    h->total++;
+}
+
+static void
+merge( struct histogram *into, const struct histogram *h ) {
+    int i;
+
+    for ( i = 0 ; i < BUCKETS ; i++ ) into->count[i] += h->count[i];
+    into->total += h->total;
+}
+
+static uint64_t
+percentile( const struct histogram *h, double p ) {
+    uint64_t target = (uint64_t)(h->total * p), seen = 0;
+    int i;
+
+    for ( i = 0 ; i < BUCKETS ; i++ ) {
+        seen += h->count[i];
+        if ( seen > target ) return bucket_value( i );
+    }
+    return 0;
+}
+
+static uint64_t
+now() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ */
+static void
+report( const char *bench, long rows, const char *source, int threads,
+        const struct histogram *h, uint64_t errors, uint64_t elapsed ) {
+    double seconds = elapsed / 1e9;
+
+    printf( "{\"bench\":\"%s\",\"rows\":%ld,\"source\":\"%s\",\"threads\":%d,"
+            "\"ops\":%llu,\"errors\":%llu,\"seconds\":%.3f,\"ops_per_sec\":%.0f,"
+            "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}\n",
+            bench, rows, source, threads,
+            (unsigned long long)h->total, (unsigned long long)errors, seconds,
+            seconds > 0 ? h->total / seconds : 0.0,
+            (unsigned long long)percentile(h, 0.50),
+            (unsigned long long)percentile(h, 0.99),
+            (unsigned long long)percentile(h, 0.999) );
+    fflush( stdout );
+}
+
+/*
+ * Row i of a generated table is host<i> at 10.x.y.z, i in the low 24
+ * bits, so every lookup can be checked and a hit is always expected.
+ */
+static void
+generated_host( long i, char *name, size_t length, struct in_addr *addr ) {
+    snprintf( name, length, "host%ld", i );
+    addr->s_addr = htonl( 0x0a000000 | (uint32_t)i );
+}
+
+#define LOOKUP_BYNAME 1
+#define LOOKUP_BYADDR 2
+
+struct worker {
+    pthread_t thread;
+    int op;
+    long rows;
+    uint64_t deadline;
+    unsigned int seed;
+    struct histogram h;
+    uint64_t errors;
+};
+
+/** Look up random generated hosts until the deadline
+ */
+static void *
+lookup_worker( void *arg ) {
+    struct worker *w = (struct worker *)arg;
+    char buffer[1024];
+    char name[32];
+    struct hostent result;
+    struct in_addr addr;
+    enum nss_status status;
+    int errnop, h_errnop;
+    uint64_t start, end;
+
+    do {
+        generated_host( rand_r(&w->seed) % w->rows, name, sizeof(name), &addr );
+
+        start = now();
+        if ( w->op == LOOKUP_BYADDR ) {
+            status = byaddr( &addr, sizeof(addr), AF_INET, &result,
+                             buffer, sizeof(buffer), &errnop, &h_errnop );
+        } else {
+            status = byname2( name, AF_INET, &result,
+                              buffer, sizeof(buffer), &errnop, &h_errnop );
+        }
+        end = now();
+
+        record( &w->h, end - start );
+        if ( status != NSS_STATUS_SUCCESS ) w->errors++;
+    } while ( end < w->deadline );
+
+    return NULL;
+}
+
+/**
+ */
+static void
+bench_lookup( const char *bench, int op, long rows, const char *source,
+              int nthreads, int seconds ) {
+    struct worker *workers = calloc( nthreads, sizeof(*workers) );
+    struct histogram *total = calloc( 1, sizeof(*total) );
+    uint64_t errors = 0, start;
+    int i;
+
+    start = now();
+    for ( i = 0 ; i < nthreads ; i++ ) {
+        workers[i].op = op;
+        workers[i].rows = rows;
+        workers[i].deadline = start + seconds * 1000000000ull;
+        workers[i].seed = i + 1;
+        pthread_create( &workers[i].thread, NULL, lookup_worker, &workers[i] );
+    }
+    for ( i = 0 ; i < nthreads ; i++ ) {
+        pthread_join( workers[i].thread, NULL );
+        merge( total, &workers[i].h );
+        errors += workers[i].errors;
+    }
+
+    report( bench, rows, source, nthreads, total, errors, now() - start );
+    free( total );
+    free( workers );
+}
+
+/** Walk the table with gethostent_r, starting over until the deadline
+ */
+static void
+bench_gethostent( long rows, int seconds ) {
+    struct histogram *h = calloc( 1, sizeof(*h) );
+    char buffer[1024];
+    struct hostent result;
+    enum nss_status status;
+    int errnop, h_errnop;
+    uint64_t errors = 0, start, deadline, before, after;
+
+    start = now();
+    deadline = start + seconds * 1000000000ull;
+    do {
+        set_hostent( 0 );
+        do {
+            before = now();
+            status = get_hostent( &result, buffer, sizeof(buffer), &errnop, &h_errnop );
+            after = now();
+            if ( status == NSS_STATUS_SUCCESS ) {
+                record( h, after - before );
+            } else if ( status != NSS_STATUS_NOTFOUND ) {
+                errors++;
+                break;
+            }
+        } while ( status == NSS_STATUS_SUCCESS && after < deadline );
+        end_hostent();
+    } while ( after < deadline );
+
+    report( "gethostent_r", rows, "sql", 1, h, errors, now() - start );
+    free( h );
+}
+
+/** Time count adds of new hosts, one at a time or in one transaction
+ */
+static void
+bench_write( const char *bench, long rows, long count, int how ) {
+    struct histogram *h = calloc( 1, sizeof(*h) );
+    Hosts_handle *handle = NULL;
+    char name[32], address[32];
+    uint64_t errors = 0, start, before, after;
+    long i;
+
+    start = now();
+    if ( how > 0 ) handle = Hosts_open( NULL );
+    if ( how > 1 ) Hosts_begin( handle );
+    for ( i = 0 ; i < count ; i++ ) {
+        snprintf( name, sizeof(name), "%s%ld", bench, i );
+        snprintf( address, sizeof(address), "10.%ld.%ld.%ld",
+                  128L + how, (i >> 8) & 0xff, i & 0xff );
+        before = now();
+        if ( handle == NULL ) {
+            if ( Hosts_add_zoned_host(name, address, NULL) < 0 ) errors++;
+        } else {
+            if ( Hosts_add(handle, name, address, NULL) < 0 ) errors++;
+        }
+        after = now();
+        record( h, after - before );
+    }
+    if ( how > 1 && Hosts_commit(handle) < 0 ) errors++;
+    Hosts_close( handle );
+
+    report( bench, rows, "sql", 1, h, errors, now() - start );
+    free( h );
+}
+
+/** Create a db of hosts.sql plus rows generated hosts
+ */
+static int
+generate( const char *dbfile, const char *schema, long rows ) {
+    char path[4096];
+    char *sql = NULL;
+    size_t length = 0;
+    sqlite3 *db = NULL;
+    Hosts_handle *h;
+    char name[32], address[32];
+    struct in_addr addr;
+    FILE *f;
+    long i;
+    int result = -1;
+
+    unlink( dbfile );
+    snprintf( path, sizeof(path), "%s-wal", dbfile ); unlink( path );
+    snprintf( path, sizeof(path), "%s-shm", dbfile ); unlink( path );
+    snprintf( path, sizeof(path), "%s.snap", dbfile ); unlink( path );
+
+    if ( (f = fopen(schema, "r")) == NULL ) {
+        perror( schema );
+        return -1;
+    }
+    if ( getdelim(&sql, &length, '\0', f) < 0 ) goto close;
+    if ( sqlite3_open(dbfile, &db) != SQLITE_OK ) goto close;
+    if ( sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK ) {
+        fprintf( stderr, "%s: %s\n", schema, sqlite3_errmsg(db) );
+        goto close;
+    }
+    sqlite3_close( db );
+    db = NULL;
+
+    if ( (h = Hosts_open(NULL)) == NULL ) goto close;
+    Hosts_begin( h );
+    for ( i = 0 ; i < rows ; i++ ) {
+        generated_host( i, name, sizeof(name), &addr );
+        inet_ntop( AF_INET, &addr, address, sizeof(address) );
+        if ( Hosts_add(h, name, address, NULL) < 0 ) break;
+    }
+    if ( i == rows && Hosts_commit(h) == 0 ) result = 0;
+    Hosts_close( h );
+
+close:
+    sqlite3_close( db );
+    free( sql );
+    fclose( f );
+    return result;
+}
+
+static void
+usage() {
+    fprintf( stderr, "Usage: hosts_bench [--rows N,N...] [--threads N] [--seconds N]\n" );
+    fprintf( stderr, "                   [--cache N] [--schema hosts.sql] [module]\n" );
+    exit( EINVAL );
+}
+
+static struct option options[] = {
+    { "rows",    required_argument, NULL, 'n' },
+    { "threads", required_argument, NULL, 't' },
+    { "seconds", required_argument, NULL, 's' },
+    { "cache",   required_argument, NULL, 'c' },
+    { "schema",  required_argument, NULL, 'S' },
+    { 0, 0, 0, 0 },
+};
+
+int
+main( int argc, char **argv ) {
+    char *module = "./libnss_sqlite.so";
+    char *schema = "hosts.sql";
+    char *sizes = "10,1000,100000,1000000";
+    char *cache = "0";
+    char *size, *save = NULL;
+    char *dbfile = getenv( "HOSTSDB" );
+    int threads = 4, seconds = 2;
+    void *handle;
+    int c;
+
+    while ( (c = getopt_long(argc, argv, "", options, NULL)) != -1 ) {
+        switch ( c ) {
+        case 'n': sizes = optarg; break;
+        case 't': threads = atoi( optarg ); break;
+        case 's': seconds = atoi( optarg ); break;
+        case 'c': cache = optarg; break;
+        case 'S': schema = optarg; break;
+        default: usage();
+        }
+    }
+    if ( optind < argc ) module = argv[optind];
+    if ( dbfile == NULL ) {
+        fprintf( stderr, "set HOSTSDB to a scratch db, it is overwritten\n" );
+        return 1;
+    }
+
+    /* the cache is off by default so the backing store is measured */
+    setenv( "NSS_SQLITE_LOOKUP_CACHE", cache, 1 );
+
+    if ( (handle = dlopen(module, RTLD_NOW)) == NULL ) {
+        fprintf( stderr, "%s\n", dlerror() );
+        return 1;
+    }
+    byname2 = (byname2_fn)dlsym( handle, "_nss_sqlite_gethostbyname2_r" );
+    byaddr = (byaddr_fn)dlsym( handle, "_nss_sqlite_gethostbyaddr_r" );
+    set_hostent = (sethostent_fn)dlsym( handle, "_nss_sqlite_sethostent" );
+    end_hostent = (endhostent_fn)dlsym( handle, "_nss_sqlite_endhostent" );
+    get_hostent = (gethostent_fn)dlsym( handle, "_nss_sqlite_gethostent_r" );
+    if ( !byname2 || !byaddr || !set_hostent || !end_hostent || !get_hostent ) {
+        fprintf( stderr, "%s is not the sqlite NSS module\n", module );
+        return 1;
+    }
+
+    for ( size = strtok_r(sizes, ",", &save) ; size != NULL ; size = strtok_r(NULL, ",", &save) ) {
+        long rows = atol( size );
+
+        fprintf( stderr, "generating %ld rows\n", rows );
+        if ( rows < 1 || generate(dbfile, schema, rows) < 0 ) {
+            fprintf( stderr, "could not generate a db of %s rows\n", size );
+            return 1;
+        }
+
+        fprintf( stderr, "reading %ld rows\n", rows );
+        bench_lookup( "gethostbyname2_r", LOOKUP_BYNAME, rows, "sql", threads, seconds );
+        bench_lookup( "gethostbyaddr_r", LOOKUP_BYADDR, rows, "sql", threads, seconds );
+        bench_gethostent( rows, seconds );
+
+        if ( Hosts_compile(NULL) < 0 ) {
+            fprintf( stderr, "could not compile a snapshot\n" );
+            return 1;
+        }
+        bench_lookup( "gethostbyname2_r", LOOKUP_BYNAME, rows, "snapshot", threads, seconds );
+        bench_lookup( "gethostbyaddr_r", LOOKUP_BYADDR, rows, "snapshot", threads, seconds );
+
+        fprintf( stderr, "writing to %ld rows\n", rows );
+        bench_write( "Hosts_add_zoned_host", rows, 100, 0 );
+        bench_write( "Hosts_add", rows, 1000, 1 );
+        bench_write( "Hosts_add_batch", rows, 10000, 2 );
+    }
+
+    return 0;
+}
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
@@ -31,16 +31,96 @@
 #define _HOSTS_H_
 
 #include <stdint.h>
+#include <stdio.h>
 
 #define HOSTSDB "/var/db/hosts.db"
+#define HOSTSSNAP HOSTSDB ".snap"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * A handle keeps one connection and its prepared statements open for
+ * any number of operations.  Calls on one handle are serialized, so a
+ * handle may be shared between threads.
+ */
+typedef struct Hosts_handle Hosts_handle;
+
+/* hostname, address, zone (may be NULL); return non-zero to stop */
+typedef int (*Hosts_visitor)( void *arg, const char *hostname, const char *address, const char *zone );
+
+/*
+ * The index of a name (or address) in a batch and a row found for it,
+ * all NULL if there was none; return non-zero to stop.
+ */
+typedef int (*Hosts_batch_visitor)( void *arg, int index, const char *hostname,
+                                    const char *address, const char *zone );
+
+/* uuid, status, peer name (NULL unless a peer); return non-zero to stop */
+typedef int (*Hosts_node_visitor)( void *arg, const char *uuid, const char *status, const char *peer );
+
+/*
+ * One change to the host table.  op is "insert", "update" or "delete";
+ * the old fields are NULL for an insert and the new ones for a delete.
+ * An insert replaces any row with the same hostname and address.
+ * origin is the node a pulled change was made on, NULL if here.
+ * new_expires is when the new row expires, 0 for never.
+ */
+typedef struct Hosts_change {
+    int64_t seq;
+    const char *op;
+    const char *time;
+    const char *old_hostname;
+    const char *old_address;
+    const char *old_zone;
+    const char *new_hostname;
+    const char *new_address;
+    const char *new_zone;
+    const char *origin;
+    int64_t new_expires;
+} Hosts_change;
+
+/* return non-zero to stop */
+typedef int (*Hosts_change_visitor)( void *arg, const Hosts_change * );
+
+/* Hosts_changes when the changes asked for have been compacted */
+#define HOSTS_RESCAN (-2)
+
 void Hosts_setdebug( int value );
+
+Hosts_handle *Hosts_open( char *path );
+void Hosts_close( Hosts_handle * );
+int Hosts_begin( Hosts_handle * );
+int Hosts_commit( Hosts_handle * );
+int Hosts_rollback( Hosts_handle * );
+int Hosts_add( Hosts_handle *, char *hostname, char *address, char *zone );
+int Hosts_add_ttl( Hosts_handle *, char *hostname, char *address, char *zone, int ttl );
+int Hosts_delete( Hosts_handle *, char *hostname, char *address, char *zone );
+int Hosts_lookup( Hosts_handle *, char *hostname, Hosts_visitor, void *arg );
+int Hosts_iterate( Hosts_handle *, Hosts_visitor, void *arg );
+int Hosts_subtree( Hosts_handle *, char *domain, Hosts_visitor, void *arg );
+int Hosts_resolve_many( Hosts_handle *, char **names, int n, int family, Hosts_batch_visitor, void *arg );
+int Hosts_reverse_many( Hosts_handle *, char **addresses, int n, Hosts_batch_visitor, void *arg );
+int Hosts_import( Hosts_handle *, FILE *in, int replace, int *rejected );
+int Hosts_add_node( Hosts_handle *, char *uuid, char *status );
+int Hosts_delete_node( Hosts_handle *, char *uuid );
+int Hosts_nodes( Hosts_handle *, Hosts_node_visitor, void *arg );
+int64_t Hosts_change_seq( Hosts_handle * );
+int Hosts_changes( Hosts_handle *, int64_t since, Hosts_change_visitor, void *arg );
+int Hosts_compact( Hosts_handle *, int64_t upto );
+int Hosts_expire( Hosts_handle *, int batch );
+int Hosts_watch( Hosts_handle * );
+int64_t Hosts_data_version( Hosts_handle * );
+int Hosts_sync_serve( Hosts_handle *, int in, int out );
+int Hosts_sync_pull( Hosts_handle *, int in, int out );
+
+int Hosts_add_host( char *hostname, char *address );
 int Hosts_add_zoned_host( char *hostname, char *address, char *zone );
 int Hosts_del_zoned_host( char *hostname, char *address, char *zone );
+int Hosts_compile( char *path );
+int Hosts_migrate();
+int Hosts_stats( FILE *out, int json, int reset );
 
 #ifdef __cplusplus
 }
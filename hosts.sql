@@ -1,18 +1,62 @@
 --
 -- SQLite Hosts database
 --
+-- Schema version 10: addresses are stored in binary (4 or 16 bytes) in
+-- addr with their family, and lookups are answered from the indexes
+-- alone.  address keeps the canonical text form for people reading
+-- the table.  zone names the interface of a link-local address and is
+-- returned as its scope id.  The names of cluster nodes are kept in
+-- node_name, and every change to host is journaled in host_change.
+-- rname is the hostname with its labels reversed, for listing a
+-- domain and everything under it, and name_hash and name_key are what
+-- lookups by name search.  A row with expires set stops answering
+-- lookups at that time and is deleted by "hosts --expire", and the
+-- journal carries it as new_expires.
+-- Upgrade an older db with "hosts --migrate".
+--
+-- The db is kept in WAL mode so lookups read a consistent snapshot
+-- while a writer commits, instead of waiting for it.
+--
+
+PRAGMA journal_mode = WAL;
 
 CREATE TABLE host(      id INTEGER PRIMARY KEY,
                    address STRING COLLATE NOCASE,
+                    family INTEGER,
+                      addr BLOB,
                   hostname STRING COLLATE NOCASE,
                       zone STRING COLLATE NOCASE,
                      ctime DATE,
                      mtime DATE,
-              CONSTRAINT pairUnique UNIQUE (address,hostname)
+                     rname TEXT,
+                  name_key TEXT,
+                 name_hash INTEGER,
+                   expires INTEGER,
+              CONSTRAINT pairUnique UNIQUE (addr,hostname)
                );
 
-CREATE INDEX by_address ON host(address);
-CREATE INDEX by_name ON host(hostname);
+-- pairUnique is the covering (addr,hostname) index for reverse lookups
+CREATE INDEX by_name ON host(hostname,family,addr,zone);
+
+-- rname is web3.rack12.dc1 as dc1.rack12.web3, folded to lower case,
+-- so the names under rack12.dc1 are one range of by_rname.  It is
+-- set by the library when a row is added (SQL has no way to reverse
+-- labels), and is TEXT so that a numeric label still compares as text.
+CREATE INDEX by_rname ON host(rname);
+
+-- name_key is the hostname in lower case without a trailing dot, and
+-- name_hash a 64-bit hash of it (see hosts_db.h).  The library sets
+-- both, and stores hostnames without the trailing dot so "web3." and
+-- "web3" are one host to pairUnique.  A lookup by name probes by_hash
+-- on the integer and confirms it with a bytewise compare of the key,
+-- instead of folding the case of every name it passes in by_name.
+-- expires is in it so expired rows are passed over in the index too.
+CREATE INDEX by_hash ON host(name_hash,name_key,family,addr,zone,expires);
+
+-- expires is the time, in seconds since the epoch, a row stops being
+-- returned, NULL (most rows) for never.  Only rows that expire are in
+-- by_expires, which "hosts --expire" sweeps.
+CREATE INDEX by_expires ON host(expires) WHERE expires IS NOT NULL;
 
 CREATE TRIGGER create_host AFTER INSERT ON host
 BEGIN
@@ -24,20 +68,74 @@ BEGIN
     UPDATE host SET mtime = DATETIME('NOW') WHERE rowid = new.rowid;
 END;
 
-insert into host (address, hostname) values ('127.0.0.1', 'localhost');
-insert into host (address, hostname) values ('::1', 'localhost');
-insert into host (address, hostname) values ('::1', 'ip6-localhost');
-insert into host (address, hostname) values ('::1', 'ip6-loopback');
-insert into host (address, hostname) values ('fe00::0', 'ip6-localnet');
-insert into host (address, hostname) values ('ff00::0', 'ip6-mcastprefix');
-insert into host (address, hostname) values ('ff02::1', 'ip6-allnodes');
-insert into host (address, hostname) values ('ff02::2', 'ip6-allrouters');
+-- host_change journals every insert, update and delete of a host so
+-- a mirror can apply the changes since the seq it last saw instead of
+-- reading the whole table.  seq only grows, AUTOINCREMENT keeps it
+-- from being reused once the journal is compacted.  The ctime and
+-- mtime updates are not changes.  INSERT OR REPLACE journals only
+-- the insert, so a mirror applies inserts the same way, replacing
+-- any row with that address and hostname.
+--
+-- A change pulled from a peer ("hosts --sync-pull") is journaled with
+-- the node it was first made on as origin, and the time it was made
+-- there; origin is NULL for a change made here.  The indexes find the
+-- newest change to a hostname and address, to resolve conflicts.
+
+CREATE TABLE host_change(  seq INTEGER PRIMARY KEY AUTOINCREMENT,
+                            op STRING,
+                            id INTEGER,
+                  old_hostname STRING,
+                   old_address STRING,
+                      old_zone STRING,
+                  new_hostname STRING,
+                   new_address STRING,
+                      new_zone STRING,
+                          time DATE,
+                        origin STRING,
+                   new_expires INTEGER
+                         );
+
+CREATE INDEX host_change_by_new ON host_change(new_hostname COLLATE NOCASE, new_address);
+CREATE INDEX host_change_by_old ON host_change(old_hostname COLLATE NOCASE, old_address);
+
+CREATE TRIGGER journal_insert_host AFTER INSERT ON host
+BEGIN
+    INSERT INTO host_change (op, id, new_hostname, new_address, new_zone, new_expires, time)
+    VALUES ('insert', new.id, new.hostname, new.address, new.zone, new.expires,
+            STRFTIME('%Y-%m-%d %H:%M:%f', 'NOW'));
+END;
+
+CREATE TRIGGER journal_update_host AFTER UPDATE OF hostname, address, family, addr, zone, expires ON host
+BEGIN
+    INSERT INTO host_change (op, id, old_hostname, old_address, old_zone,
+                             new_hostname, new_address, new_zone, new_expires, time)
+    VALUES ('update', new.id, old.hostname, old.address, old.zone,
+            new.hostname, new.address, new.zone, new.expires, STRFTIME('%Y-%m-%d %H:%M:%f', 'NOW'));
+END;
 
--- foreign is a node that is not part of this cluster
+CREATE TRIGGER journal_delete_host AFTER DELETE ON host
+BEGIN
+    INSERT INTO host_change (op, id, old_hostname, old_address, old_zone, time)
+    VALUES ('delete', old.id, old.hostname, old.address, old.zone,
+            STRFTIME('%Y-%m-%d %H:%M:%f', 'NOW'));
+END;
+
+insert into host (address, family, addr, hostname, rname, name_key, name_hash) values ('127.0.0.1', 2, X'7f000001', 'localhost', 'localhost', 'localhost', -2648392334912416902);
+insert into host (address, family, addr, hostname, rname, name_key, name_hash) values ('::1', 10, X'00000000000000000000000000000001', 'localhost', 'localhost', 'localhost', -2648392334912416902);
+insert into host (address, family, addr, hostname, rname, name_key, name_hash) values ('::1', 10, X'00000000000000000000000000000001', 'ip6-localhost', 'ip6-localhost', 'ip6-localhost', -5170599690206084306);
+insert into host (address, family, addr, hostname, rname, name_key, name_hash) values ('::1', 10, X'00000000000000000000000000000001', 'ip6-loopback', 'ip6-loopback', 'ip6-loopback', 3575336302261545008);
+insert into host (address, family, addr, hostname, rname, name_key, name_hash) values ('fe00::', 10, X'fe000000000000000000000000000000', 'ip6-localnet', 'ip6-localnet', 'ip6-localnet', 8238276266231066919);
+insert into host (address, family, addr, hostname, rname, name_key, name_hash) values ('ff00::', 10, X'ff000000000000000000000000000000', 'ip6-mcastprefix', 'ip6-mcastprefix', 'ip6-mcastprefix', 8830947524822545431);
+insert into host (address, family, addr, hostname, rname, name_key, name_hash) values ('ff02::1', 10, X'ff020000000000000000000000000001', 'ip6-allnodes', 'ip6-allnodes', 'ip6-allnodes', 6092768826620089213);
+insert into host (address, family, addr, hostname, rname, name_key, name_hash) values ('ff02::2', 10, X'ff020000000000000000000000000002', 'ip6-allrouters', 'ip6-allrouters', 'ip6-allrouters', -8188300420028040950);
+
+-- foreign is a node that is not part of this cluster, self is this
+-- node.  synced is the seq of the last change pulled from a peer.
 
 CREATE TABLE node(  id INTEGER PRIMARY KEY,
                   uuid STRING COLLATE NOCASE,
                 status STRING DEFAULT 'foreign',
+                synced INTEGER DEFAULT 0,
                  ctime DATE,
                  mtime DATE,
                  CONSTRAINT uniqueUUID UNIQUE (uuid)
@@ -55,9 +153,76 @@ END;
 
 insert into node (uuid,status) values ('00000000-0000-0000-0000-000000000000','peer');
 
+-- node_name maps the names a node is known by, <uuid>.node and for a
+-- peer peer<id>, to the addresses of the host rows named by its uuid,
+-- so the NSS module resolves them with one index probe instead of a
+-- join.  node_map is the same mapping computed, and the triggers keep
+-- node_name equal to it.  INSERT OR REPLACE does not fire delete
+-- triggers, so an insert first drops what a replaced row mapped.
+
+CREATE TABLE node_name( name STRING COLLATE NOCASE,
+                      family INTEGER,
+                        addr BLOB,
+                        zone STRING COLLATE NOCASE,
+                        node INTEGER,
+                        host INTEGER
+                      );
+
+CREATE INDEX node_name_by_name ON node_name(name,family,addr,zone);
+CREATE INDEX node_name_by_node ON node_name(node);
+CREATE INDEX node_name_by_host ON node_name(host);
+
+CREATE VIEW node_map AS
+    SELECT n.uuid || '.node' AS name, h.family, h.addr, h.zone, n.id AS node, h.id AS host
+      FROM node n JOIN host h ON h.hostname = n.uuid
+    UNION ALL
+    SELECT 'peer' || n.id, h.family, h.addr, h.zone, n.id, h.id
+      FROM node n JOIN host h ON h.hostname = n.uuid
+     WHERE n.status = 'peer';
+
+CREATE TRIGGER name_host AFTER INSERT ON host
+WHEN EXISTS (SELECT 1 FROM node WHERE uuid = new.hostname)
+BEGIN
+    DELETE FROM node_name WHERE host NOT IN (SELECT id FROM host)
+       AND node IN (SELECT id FROM node WHERE uuid = new.hostname);
+    INSERT INTO node_name SELECT * FROM node_map WHERE host = new.id;
+END;
+
+CREATE TRIGGER rename_host AFTER UPDATE OF hostname, family, addr, zone ON host
+BEGIN
+    DELETE FROM node_name WHERE host = old.id;
+    INSERT INTO node_name SELECT * FROM node_map WHERE host = new.id;
+END;
+
+CREATE TRIGGER unname_host AFTER DELETE ON host
+BEGIN
+    DELETE FROM node_name WHERE host = old.id;
+END;
+
+CREATE TRIGGER name_node AFTER INSERT ON node
+BEGIN
+    DELETE FROM node_name WHERE node NOT IN (SELECT id FROM node);
+    INSERT INTO node_name SELECT * FROM node_map WHERE node = new.id;
+END;
+
+CREATE TRIGGER rename_node AFTER UPDATE OF uuid, status ON node
+BEGIN
+    DELETE FROM node_name WHERE node = old.id;
+    INSERT INTO node_name SELECT * FROM node_map WHERE node = new.id;
+END;
+
+CREATE TRIGGER unname_node AFTER DELETE ON node
+BEGIN
+    DELETE FROM node_name WHERE node = old.id;
+END;
+
+INSERT INTO node_name SELECT * FROM node_map;
+
 CREATE TABLE lan(  id INTEGER PRIMARY KEY,
                   uuid STRING COLLATE NOCASE,
                  ctime DATE,
                  mtime DATE,
                  CONSTRAINT uniqueUUID UNIQUE (uuid)
                   );
+
+PRAGMA user_version = 10;
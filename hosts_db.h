@@ -0,0 +1,252 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file hosts_db.h
+ * \brief Schema details shared by the library, the tool and the NSS module
+ *
+ * The schema version is kept in PRAGMA user_version.  Version 1 (the
+ * original hosts.sql, user_version 0) stored addresses as text only.
+ * Version 2 adds the binary addr and family columns that lookups use.
+ * Version 3 adds zone to the by_name index, for link-local lookups.
+ * Version 4 adds node_name, the names of cluster nodes.
+ * Version 5 adds host_change, a journal of every change to host.
+ * Version 6 adds what replication between peers needs to host_change
+ * and node.
+ * Version 7 adds rname, the hostname with its labels reversed, and
+ * its index by_rname.
+ * Version 8 adds name_key and name_hash, and the integer index
+ * by_hash that forward lookups probe instead of comparing NOCASE text.
+ * Version 9 adds expires, the time a row stops answering lookups, and
+ * the index by_expires.
+ * Version 10 journals expires in host_change as new_expires, so that
+ * replication carries it.
+ */
+
+#ifndef _HOSTS_DB_H_
+#define _HOSTS_DB_H_
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "hosts.h"
+
+#define HOSTS_SCHEMA_VERSION 10
+
+/** The db file, $HOSTSDB or the default
+ *
+ * The environment is not trusted in setuid or setgid programs.
+ */
+static inline const char *
+hosts_dbfile( void ) {
+    const char *dbfile = NULL;
+
+    if ( getuid() == geteuid() && getgid() == getegid() ) {
+        dbfile = getenv( "HOSTSDB" );
+    }
+    return dbfile != NULL ? dbfile : HOSTSDB;
+}
+
+/** Parse a text address into its binary form
+ *
+ * Returns the family, or 0 if it is not an address.
+ */
+static inline int
+hosts_parse_address( const char *text, void *addr ) {
+    if ( text == NULL ) return 0;
+    if ( inet_pton(AF_INET6, text, addr) > 0 ) return AF_INET6;
+    if ( inet_pton(AF_INET, text, addr) > 0 ) return AF_INET;
+    return 0;
+}
+
+/** Length of the binary form of an address
+ */
+static inline int
+hosts_address_length( int family ) {
+    switch ( family ) {
+    case AF_INET6: return sizeof(struct in6_addr);
+    case AF_INET:  return sizeof(struct in_addr);
+    }
+    return 0;
+}
+
+/** Read an address column, binary in v2 or text in v1
+ *
+ * Returns the family, or 0 if the column holds no address.
+ */
+static inline int
+hosts_column_address( sqlite3_stmt *stmt, int column, void *addr ) {
+    switch ( sqlite3_column_type(stmt, column) ) {
+    case SQLITE_BLOB:
+        switch ( sqlite3_column_bytes(stmt, column) ) {
+        case sizeof(struct in6_addr):
+            memcpy( addr, sqlite3_column_blob(stmt, column), sizeof(struct in6_addr) );
+            return AF_INET6;
+        case sizeof(struct in_addr):
+            memcpy( addr, sqlite3_column_blob(stmt, column), sizeof(struct in_addr) );
+            return AF_INET;
+        }
+        break;
+    case SQLITE_TEXT:
+        return hosts_parse_address( (const char *)sqlite3_column_text(stmt, column), addr );
+    }
+    return 0;
+}
+
+/** The key a hostname is looked up by
+ *
+ * Lower case (ASCII only, as NOCASE) and without the trailing dot of a
+ * fully qualified name, so "Web3.Example." and "web3.example" are the
+ * same host and keys compare bytewise.  Returns the length of the key,
+ * or -1 if it does not fit in size.
+ */
+static inline int
+hosts_name_key( const char *name, char *key, size_t size ) {
+    size_t length = strlen( name );
+    size_t i;
+
+    while ( length > 1 && name[length - 1] == '.' ) length--;
+    if ( length >= size ) return -1;
+    for ( i = 0 ; i < length ; i++ ) {
+        key[i] = (name[i] >= 'A' && name[i] <= 'Z') ? name[i] - 'A' + 'a' : name[i];
+    }
+    key[length] = '\0';
+    return length;
+}
+
+/** Do two hostnames have the same key?
+ */
+static inline int
+hosts_same_name( const char *a, const char *b ) {
+    size_t la = strlen( a ), lb = strlen( b );
+    size_t i;
+
+    while ( la > 1 && a[la - 1] == '.' ) la--;
+    while ( lb > 1 && b[lb - 1] == '.' ) lb--;
+    if ( la != lb ) return 0;
+    for ( i = 0 ; i < la ; i++ ) {
+        char ca = (a[i] >= 'A' && a[i] <= 'Z') ? a[i] - 'A' + 'a' : a[i];
+        char cb = (b[i] >= 'A' && b[i] <= 'Z') ? b[i] - 'A' + 'a' : b[i];
+        if ( ca != cb ) return 0;
+    }
+    return 1;
+}
+
+/** The hash of a key, as name_hash holds it
+ *
+ * 64-bit FNV-1a.  It is stored in the db, so it can never change.
+ */
+static inline int64_t
+hosts_name_hash( const char *key ) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while ( *key != '\0' ) {
+        hash ^= (unsigned char)*key++;
+        hash *= 0x100000001b3ULL;
+    }
+    return (int64_t)hash;
+}
+
+/** The rname of a hostname, web3.rack12.dc1 as dc1.rack12.web3
+ *
+ * Folded to lower case, as NOCASE would, so rnames compare bytewise.
+ * Returns -1 if it does not fit in size.
+ */
+static inline int
+hosts_reverse_labels( const char *name, char *rname, size_t size ) {
+    size_t length = strlen( name );
+    const char *end = name + length;
+    const char *start, *p;
+
+    if ( length >= size ) return -1;
+    while (1) {
+        for ( start = end ; start > name && start[-1] != '.' ; start-- ) ;
+        for ( p = start ; p < end ; p++ ) {
+            *rname++ = (*p >= 'A' && *p <= 'Z') ? *p - 'A' + 'a' : *p;
+        }
+        if ( start == name ) break;
+        *rname++ = '.';
+        end = start - 1;
+    }
+    *rname = '\0';
+    return 0;
+}
+
+/** Is this hostname a wildcard, "*.svc.cluster"?
+ */
+static inline int
+hosts_wildcard( const char *name ) {
+    return name[0] == '*' && name[1] == '.';
+}
+
+/** The next wildcard that could answer a name, longest suffix first
+ *
+ * For a.b.svc.cluster these are *.b.svc.cluster, *.svc.cluster and
+ * *.cluster.  suffix starts at the name (past the "*." of a wildcard)
+ * and is advanced by each call.  Returns 0 when there are no more.
+ */
+static inline int
+hosts_wildcard_next( const char **suffix, char *wild, size_t size ) {
+    const char *dot;
+
+    while ( (dot = strchr(*suffix, '.')) != NULL ) {
+        *suffix = dot + 1;
+        if ( dot[1] == '\0' ) break;
+        if ( strlen(dot) + 2 > size ) continue;
+        wild[0] = '*';
+        strcpy( wild + 1, dot );
+        return 1;
+    }
+    return 0;
+}
+
+/** Read the schema version of an open db
+ */
+static inline int
+hosts_schema_version( sqlite3 *db ) {
+    sqlite3_stmt *stmt = NULL;
+    int version = -1;
+
+    if ( sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, NULL) != SQLITE_OK ) {
+        return -1;
+    }
+    if ( sqlite3_step(stmt) == SQLITE_ROW ) {
+        version = sqlite3_column_int( stmt, 0 );
+        if ( version < 1 ) version = 1;
+    }
+    sqlite3_finalize( stmt );
+    return version;
+}
+
+#endif
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
@@ -0,0 +1,104 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file hosts_resolver.h
+ * \brief Protocol of hosts-resolverd
+ *
+ * hosts-resolverd holds the host table in memory and answers lookups
+ * over a SOCK_SEQPACKET Unix socket, so a process resolving a name
+ * needs no sqlite connection of its own.  A request packet holds up to
+ * RESOLVER_BATCH queries and the reply holds an answer to each, in
+ * order.  Both ends are on one host, so everything is in host byte
+ * order and a packet is never larger than RESOLVER_PACKET.
+ *
+ * Request: resolver_header, then per query a resolver_query followed
+ * by its key, padded to 4 bytes.  Reply: resolver_header, then per
+ * query a resolver_answer followed by size bytes: naddrs addresses,
+ * then nnames names back to back.
+ */
+
+#ifndef _HOSTS_RESOLVER_H_
+#define _HOSTS_RESOLVER_H_
+
+#include <stdint.h>
+#include <net/if.h>
+
+#define RESOLVER_SOCKET  "/run/hosts-resolverd.sock"
+#define RESOLVER_MAGIC   0x56525348     /* "HSRV" */
+#define RESOLVER_PACKET  65536
+#define RESOLVER_BATCH   64
+#define RESOLVER_ROWS    64             /* rows per enumerate answer */
+
+/*
+ * Queries.  A name may be "name%zone" and family 0 asks for every
+ * address of the name, as gethostbyname4_r does.  An enumerate key is
+ * the uint64_t position from the last answer, 0 to start, and the
+ * answer holds up to RESOLVER_ROWS rows, name i with address i.  The
+ * database query answers with the path of the db being served.
+ */
+#define RESOLVER_BYNAME    1
+#define RESOLVER_BYADDR    2
+#define RESOLVER_ENUMERATE 3
+#define RESOLVER_DATABASE  4
+
+/*
+ * Answers.  UNAVAIL means ask the db: the answer did not fit, or the
+ * query was not understood.
+ */
+#define RESOLVER_FOUND     0
+#define RESOLVER_NOTFOUND  1
+#define RESOLVER_UNAVAIL   2
+
+struct resolver_header {
+    uint32_t magic;
+    uint32_t count;
+};
+
+struct resolver_query {
+    uint16_t op;
+    uint16_t family;
+    uint32_t length;            /* of the key */
+};
+
+struct resolver_answer {
+    uint16_t status;
+    uint16_t family;
+    uint16_t nnames;
+    uint16_t naddrs;
+    uint32_t size;              /* of what follows, a multiple of 4 */
+    uint32_t expires;           /* when the answer expires, 0 for never */
+    uint64_t next;              /* enumerate position to ask for next */
+};
+
+struct resolver_address {
+    uint32_t family;
+    uint8_t  addr[16];
+    char     zone[IF_NAMESIZE]; /* "" for none */
+};
+
+#endif
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
@@ -0,0 +1,785 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file hosts_resolverd.c
+ * \brief Answer host lookups from memory over a Unix socket
+ *
+ * The host table is built into a snapshot in memory, the same image
+ * "hosts --compile" writes, and lookups are answered from it without
+ * any SQL.  It is rebuilt when the db changes: a watch on it (see
+ * hosts_watch.h) reports writes, and PRAGMA data_version says whether
+ * they were commits.  SIGHUP rebuilds it as well, and so does a timer
+ * set for when the first row in it expires.
+ *
+ * Every thread runs the same loop on one epoll instance.  Each file
+ * descriptor is armed EPOLLONESHOT, so one thread at a time serves a
+ * client, accepts or rebuilds, and clients are spread over the threads
+ * and so over the cores.  A rebuild runs on one thread while the
+ * others keep answering from the old table, which is swapped under a
+ * read-write lock held only for the length of one packet.
+ *
+ * Usage: hosts-resolverd [--socket path] [--threads N] [--debug]
+ * with the db from HOSTSDB or the default.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sqlite3.h>
+
+#include "hosts_db.h"
+#include "hosts_snapshot.h"
+#include "hosts_resolver.h"
+#include "hosts_watch.h"
+
+#define WORKER_TURN 16          /* packets served before another client's turn */
+
+static int debug = 0;
+
+static const char *dbfile;
+static char dbpath[PATH_MAX];
+
+static int epfd = -1;
+static int listener = -1;
+static struct watch changes = { .fd = -1 };
+static int signals = -1;
+static int expiry = -1;
+static int stopping = -1;
+
+/*
+ * The table being served.  Only the thread rebuilding it uses db.
+ */
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snapshot table;
+static sqlite3 *db = NULL;
+static sqlite3_int64 data_version = -1;
+static dev_t db_dev;
+static ino_t db_ino;
+
+static void usage() {
+    fprintf( stderr, "Usage: hosts-resolverd [--socket path] [--threads N] [--debug]\n" );
+    exit( EINVAL );
+}
+
+/**
+ */
+static sqlite3_int64
+table_version() {
+    sqlite3_stmt *stmt;
+    sqlite3_int64 version = -1;
+
+    if ( sqlite3_prepare_v2(db, "PRAGMA data_version", -1, &stmt, NULL) != SQLITE_OK ) {
+        return -1;
+    }
+    if ( sqlite3_step(stmt) == SQLITE_ROW ) version = sqlite3_column_int64( stmt, 0 );
+    sqlite3_finalize( stmt );
+    return version;
+}
+
+/** Set the timer for when the first row in a table expires
+ */
+static void
+expiry_set( const struct snapshot *s ) {
+    const struct snapshot_header *h = (const struct snapshot_header *)s->base;
+    struct itimerspec when;
+
+    if ( expiry < 0 || h == NULL ) return;
+    memset( &when, 0, sizeof(when) );
+    when.it_value.tv_sec = h->expires;  /* 0 disarms it */
+    timerfd_settime( expiry, TFD_TIMER_ABSTIME, &when, NULL );
+}
+
+/** Rebuild the table if the db has changed, or if forced
+ *
+ * A db file that has been replaced is opened again.  Returns -1 if
+ * the table could not be built, and the old one is kept.
+ */
+static int
+table_reload( int force ) {
+    struct snapshot built, old;
+    sqlite3_int64 version;
+    struct stat s;
+    int count, result = -1;
+
+    pthread_mutex_lock( &reload_lock );
+
+    if ( stat(dbfile, &s) < 0 ) goto unlock;
+    if ( db != NULL && (s.st_dev != db_dev || s.st_ino != db_ino) ) {
+        sqlite3_close( db );
+        db = NULL;
+    }
+    if ( db == NULL ) {
+        if ( sqlite3_open_v2(dbfile, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ) {
+            fprintf( stderr, "could not open %s: %s\n", dbfile, sqlite3_errmsg(db) );
+            sqlite3_close( db );
+            db = NULL;
+            goto unlock;
+        }
+        sqlite3_busy_timeout( db, 1000 );
+        db_dev = s.st_dev;
+        db_ino = s.st_ino;
+        force = 1;
+    }
+
+    version = table_version();
+    if ( force == 0 && version == data_version ) {
+        result = 0;
+        goto unlock;
+    }
+
+    if ( (count = snapshot_build(db, dbfile, &built)) < 0 ) {
+        fprintf( stderr, "could not read %s: %s\n", dbfile, sqlite3_errmsg(db) );
+        goto unlock;
+    }
+    data_version = version;
+
+    pthread_rwlock_wrlock( &table_lock );
+    old = table;
+    table = built;
+    pthread_rwlock_unlock( &table_lock );
+    snapshot_free( &old );
+    expiry_set( &built );
+
+    if ( debug ) fprintf( stderr, "loaded %d names, %zu bytes\n", count, built.size );
+    result = 0;
+
+unlock:
+    pthread_mutex_unlock( &reload_lock );
+    return result;
+}
+
+/*
+ * A reply being written, with room kept for the answers still to come
+ * so that every query gets at least its resolver_answer.
+ */
+struct reply {
+    char *data;
+    size_t length;
+    size_t reserved;
+};
+
+/**
+ */
+static struct resolver_answer *
+reply_answer( struct reply *r, int status, int family ) {
+    struct resolver_answer *a = (struct resolver_answer *)(r->data + r->length);
+
+    memset( a, 0, sizeof(*a) );
+    a->status = status;
+    a->family = family;
+    r->length += sizeof(*a);
+    r->reserved -= sizeof(*a);
+    return a;
+}
+
+/** Room for length more bytes of the current answer?
+ */
+static int
+reply_room( const struct reply *r, size_t length ) {
+    return r->length + length + r->reserved <= RESOLVER_PACKET;
+}
+
+/**
+ */
+static int
+reply_address( struct reply *r, struct resolver_answer *a, int family,
+               const void *addr, const char *zone ) {
+    struct resolver_address *ra = (struct resolver_address *)(r->data + r->length);
+
+    if ( a->nnames > 0 ) return -1;     /* addresses come first */
+    if ( reply_room(r, sizeof(*ra)) == 0 ) return -1;
+    memset( ra, 0, sizeof(*ra) );
+    ra->family = family;
+    memcpy( ra->addr, addr, hosts_address_length(family) );
+    if ( zone != NULL ) snprintf( ra->zone, sizeof(ra->zone), "%s", zone );
+    r->length += sizeof(*ra);
+    a->size += sizeof(*ra);
+    a->naddrs++;
+    return 0;
+}
+
+/**
+ */
+static int
+reply_name( struct reply *r, struct resolver_answer *a, const char *name ) {
+    size_t length = strlen( name ) + 1;
+
+    if ( reply_room(r, length + 3) == 0 ) return -1;
+    memcpy( r->data + r->length, name, length );
+    r->length += length;
+    a->size += length;
+    a->nnames++;
+    return 0;
+}
+
+/** Add a name found in the table; wildcards are never returned
+ */
+static int
+reply_alias( struct reply *r, struct resolver_answer *a, const char *name ) {
+    if ( hosts_wildcard(name) ) return 0;
+    return reply_name( r, a, name );
+}
+
+/** Pad the current answer, or if it failed to fit, drop it for UNAVAIL
+ */
+static void
+reply_done( struct reply *r, struct resolver_answer *a, int fitted ) {
+    if ( fitted == 0 ) {
+        r->length = (char *)(a + 1) - r->data;
+        a->status = RESOLVER_UNAVAIL;
+        a->nnames = a->naddrs = 0;
+        a->size = 0;
+        return;
+    }
+    while ( a->size % 4 != 0 ) {
+        r->data[r->length++] = '\0';
+        a->size++;
+    }
+}
+
+/** Does an address of the given zone answer a lookup for want?
+ */
+static int
+zone_matches( const char *zone, const char *want ) {
+    if ( want == NULL ) return 1;
+    return zone != NULL && strcasecmp( zone, want ) == 0;
+}
+
+/** The answer expires with the first record in it that does
+ */
+static void
+answer_expires( struct resolver_answer *a, const struct snapshot_record *record ) {
+    if ( record->expires == 0 ) return;
+    if ( a->expires == 0 || record->expires < a->expires ) a->expires = record->expires;
+}
+
+/** Add the addresses of a record in zone (or any) to an answer
+ */
+static int
+answer_record( struct reply *r, struct resolver_answer *a,
+               const struct snapshot_record *record, const char *zone ) {
+    int i;
+
+    if ( record == NULL ) return 0;
+    answer_expires( a, record );
+    for ( i = 0 ; i < record->naddrs ; i++ ) {
+        const char *z = snapshot_zone( &table, record, i );
+
+        if ( zone_matches(z, zone) == 0 ) continue;
+        if ( reply_address(r, a, record->family, snapshot_address(record, i), z) < 0 ) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** Has the record an address in zone, or any address with no zone?
+ */
+static int
+record_known( const struct snapshot_record *record, const char *zone ) {
+    int i;
+
+    if ( record == NULL ) return 0;
+    for ( i = 0 ; i < record->naddrs ; i++ ) {
+        if ( zone_matches(snapshot_zone(&table, record, i), zone) ) return 1;
+    }
+    return 0;
+}
+
+/** Forward lookup, of one family or of both
+ *
+ * Called with the table locked.  Only a lookup of one family answers
+ * with names, the aliases of the name; h_name is the name asked for.
+ * A name with no addresses of any family is answered by the longest
+ * wildcard above it, as the NSS module does when it reads the db
+ * itself; one with only addresses of the other family is not found.
+ */
+static void
+answer_byname( struct reply *r, const char *key, size_t length, int family ) {
+    struct resolver_answer *a = reply_answer( r, RESOLVER_NOTFOUND, family );
+    const struct snapshot_record *records[2] = { NULL, NULL };
+    char name[NI_MAXHOST], wild[NI_MAXHOST];
+    const char *query, *suffix;
+    char *zone;
+    int fitted = 0, known;
+    int i;
+
+    if ( family != 0 && family != AF_INET && family != AF_INET6 ) goto done;
+    if ( length >= sizeof(name) || memchr(key, '\0', length) != NULL ) goto done;
+    memcpy( name, key, length );
+    name[length] = '\0';
+    if ( (zone = strchr(name, '%')) != NULL ) *zone++ = '\0';
+
+    query = name;
+    suffix = hosts_wildcard( name ) ? name + 2 : name;
+    do {
+        records[0] = snapshot_by_name( &table, query, AF_INET );
+        records[1] = snapshot_by_name( &table, query, AF_INET6 );
+        known = record_known( records[0], zone ) || record_known( records[1], zone );
+
+        if ( family == AF_INET6 ) records[0] = NULL;
+        if ( family == AF_INET ) records[1] = NULL;
+        for ( i = 0 ; i < 2 ; i++ ) {
+            if ( answer_record(r, a, records[i], zone) < 0 ) goto done;
+        }
+        query = wild;
+    } while ( known == 0 && hosts_wildcard_next(&suffix, wild, sizeof(wild)) );
+
+    if ( a->naddrs > 0 ) {
+        a->status = RESOLVER_FOUND;
+        if ( family != 0 ) {
+            const struct snapshot_record *record = records[family == AF_INET ? 0 : 1];
+            for ( i = 0 ; i < record->nnames ; i++ ) {
+                if ( reply_alias(r, a, snapshot_string(&table, record->names[i])) < 0 ) goto done;
+            }
+        }
+    }
+    fitted = 1;
+
+done:
+    reply_done( r, a, fitted );
+}
+
+/**
+ * Called with the table locked.
+ */
+static void
+answer_byaddr( struct reply *r, const void *key, size_t length, int family ) {
+    struct resolver_answer *a = reply_answer( r, RESOLVER_NOTFOUND, family );
+    const struct snapshot_record *record;
+    int fitted = 0;
+    int i;
+
+    if ( length != (size_t)hosts_address_length(family) ) goto done;
+    if ( (record = snapshot_by_addr(&table, key, family)) == NULL ) {
+        fitted = 1;
+        goto done;
+    }
+
+    if ( reply_address(r, a, family, key, NULL) < 0 ) goto done;
+    answer_expires( a, record );
+    for ( i = 0 ; i < record->nnames ; i++ ) {
+        if ( reply_alias(r, a, snapshot_string(&table, record->names[i])) < 0 ) goto done;
+    }
+    if ( a->nnames == 0 ) {
+        /* only wildcards have this address */
+        reply_done( r, a, 0 );
+        a->status = RESOLVER_NOTFOUND;
+        return;
+    }
+    a->status = RESOLVER_FOUND;
+    fitted = 1;
+
+done:
+    reply_done( r, a, fitted );
+}
+
+/** The next rows of the table for gethostent
+ *
+ * Called with the table locked.  A row is a name and an address, and
+ * the position is the index of the address and of the name in its
+ * record.  The rows of a rebuilt table are in a different order, so a
+ * walk that spans a rebuild may see rows twice or not at all.
+ */
+static void
+answer_enumerate( struct reply *r, const void *key, size_t length ) {
+    struct resolver_answer *a = reply_answer( r, RESOLVER_NOTFOUND, 0 );
+    const struct snapshot_header *h = (const struct snapshot_header *)table.base;
+    const struct snapshot_addr *index;
+    uint64_t position, i, j;
+    size_t names = 0;
+    int fitted = 1;
+    int rows;
+
+    if ( length != sizeof(position) || h == NULL ) {
+        fitted = 0;
+        goto done;
+    }
+    memcpy( &position, key, sizeof(position) );
+    index = (const struct snapshot_addr *)(table.base + h->addrs);
+    i = position >> 16;
+    j = position & 0xffff;
+
+    /* the addresses of the rows first, then come back for the names */
+    for ( rows = 0 ; rows < RESOLVER_ROWS && i < h->naddrs ; ) {
+        const struct snapshot_record *record =
+            (const struct snapshot_record *)(table.base + h->records + index[i].record);
+        size_t length;
+
+        if ( j >= record->nnames ) {
+            i++;
+            j = 0;
+            continue;
+        }
+        length = strlen( snapshot_string(&table, record->names[j]) ) + 1;
+        if ( reply_room(r, sizeof(struct resolver_address) + names + length + 3) == 0 ) break;
+        if ( reply_address(r, a, record->family, snapshot_address(record, 0), NULL) < 0 ) break;
+        names += length;
+        rows++;
+        j++;
+    }
+    a->next = (i << 16) | j;
+
+    i = position >> 16;
+    j = position & 0xffff;
+    while ( a->nnames < a->naddrs ) {
+        const struct snapshot_record *record =
+            (const struct snapshot_record *)(table.base + h->records + index[i].record);
+
+        if ( j >= record->nnames ) {
+            i++;
+            j = 0;
+            continue;
+        }
+        if ( reply_name(r, a, snapshot_string(&table, record->names[j])) < 0 ) {
+            fitted = 0;
+            goto done;
+        }
+        j++;
+    }
+    if ( a->naddrs > 0 ) a->status = RESOLVER_FOUND;
+
+done:
+    reply_done( r, a, fitted );
+}
+
+/**
+ */
+static void
+answer_database( struct reply *r ) {
+    struct resolver_answer *a = reply_answer( r, RESOLVER_FOUND, 0 );
+    reply_done( r, a, reply_name(r, a, dbpath) == 0 );
+}
+
+/** Answer one request packet
+ *
+ * Returns the length of the reply, or -1 for a packet that is not a
+ * request.
+ */
+static ssize_t
+answer( const char *request, size_t length, char *data ) {
+    const struct resolver_header *header = (const struct resolver_header *)request;
+    struct resolver_header *out = (struct resolver_header *)data;
+    struct reply r = { data, sizeof(*out), 0 };
+    size_t offset = sizeof(*header);
+    uint32_t i;
+
+    if ( length < sizeof(*header) || header->magic != RESOLVER_MAGIC ) return -1;
+    if ( header->count > RESOLVER_BATCH ) return -1;
+
+    out->magic = RESOLVER_MAGIC;
+    out->count = header->count;
+    r.reserved = header->count * sizeof(struct resolver_answer);
+
+    pthread_rwlock_rdlock( &table_lock );
+    for ( i = 0 ; i < header->count ; i++ ) {
+        const struct resolver_query *q = (const struct resolver_query *)(request + offset);
+        const char *key = (const char *)(q + 1);
+
+        if ( offset + sizeof(*q) > length || q->length > length - offset - sizeof(*q) ) {
+            pthread_rwlock_unlock( &table_lock );
+            return -1;
+        }
+        offset += sizeof(*q) + q->length + (-q->length % 4);
+
+        switch ( q->op ) {
+        case RESOLVER_BYNAME:    answer_byname( &r, key, q->length, q->family ); break;
+        case RESOLVER_BYADDR:    answer_byaddr( &r, key, q->length, q->family ); break;
+        case RESOLVER_ENUMERATE: answer_enumerate( &r, key, q->length ); break;
+        case RESOLVER_DATABASE:  answer_database( &r ); break;
+        default:
+            reply_done( &r, reply_answer(&r, RESOLVER_UNAVAIL, q->family), 0 );
+            break;
+        }
+    }
+    pthread_rwlock_unlock( &table_lock );
+
+    return r.length;
+}
+
+/**
+ */
+static int
+arm( int fd, int op ) {
+    struct epoll_event event;
+
+    memset( &event, 0, sizeof(event) );
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = fd;
+    return epoll_ctl( epfd, op, fd, &event );
+}
+
+/** Serve a few packets from a client
+ *
+ * The client is armed again when it has nothing more to read, or it
+ * has had its turn, and closed when it hangs up or errs.
+ */
+static void
+serve( int fd, char *request, char *reply ) {
+    ssize_t n, length;
+    int turn;
+
+    for ( turn = 0 ; turn < WORKER_TURN ; turn++ ) {
+        n = recv( fd, request, RESOLVER_PACKET, MSG_DONTWAIT );
+        if ( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) break;
+        if ( n <= 0 ) goto hangup;
+        if ( (length = answer(request, n, reply)) < 0 ) {
+            if ( debug ) fprintf( stderr, "bad request on %d\n", fd );
+            goto hangup;
+        }
+        if ( send(fd, reply, length, MSG_NOSIGNAL) != length ) goto hangup;
+    }
+    if ( arm(fd, EPOLL_CTL_MOD) == 0 ) return;
+
+hangup:
+    close( fd );
+}
+
+/**
+ */
+static void
+accept_clients() {
+    int fd;
+
+    while ( (fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0 ) {
+        if ( arm(fd, EPOLL_CTL_ADD) < 0 ) close( fd );
+    }
+    arm( listener, EPOLL_CTL_MOD );
+}
+
+/** Rebuild if the db may have changed
+ */
+static void
+watch_db() {
+    if ( watch_changed(&changes) ) table_reload( 0 );
+    arm( changes.fd, EPOLL_CTL_MOD );
+}
+
+/** Rebuild without the rows that have just expired
+ */
+static void
+expire_table() {
+    uint64_t ticks;
+
+    if ( read(expiry, &ticks, sizeof(ticks)) == sizeof(ticks) ) {
+        if ( debug ) fprintf( stderr, "rows expired, reloading\n" );
+        table_reload( 1 );
+    }
+    arm( expiry, EPOLL_CTL_MOD );
+}
+
+/**
+ */
+static void
+take_signal() {
+    struct signalfd_siginfo info;
+    uint64_t one = 1;
+
+    while ( read(signals, &info, sizeof(info)) == sizeof(info) ) {
+        if ( info.ssi_signo == SIGHUP ) {
+            if ( debug ) fprintf( stderr, "reloading\n" );
+            table_reload( 1 );
+            continue;
+        }
+        /* stopping stays readable, so every thread sees it */
+        if ( write(stopping, &one, sizeof(one)) < 0 ) {
+            fprintf( stderr, "could not stop: %s\n", strerror(errno) );
+        }
+    }
+    arm( signals, EPOLL_CTL_MOD );
+}
+
+/**
+ */
+static void *
+worker( void *arg ) {
+    char *request = (char *)malloc( RESOLVER_PACKET );
+    char *reply = (char *)malloc( RESOLVER_PACKET );
+    struct epoll_event event;
+
+    if ( request == NULL || reply == NULL ) {
+        fprintf( stderr, "out of memory\n" );
+        exit( 1 );
+    }
+
+    while ( 1 ) {
+        int fd;
+
+        if ( epoll_wait(epfd, &event, 1, -1) < 1 ) continue;
+        fd = event.data.fd;
+
+        if ( fd == stopping ) break;
+        if ( fd == listener ) {
+            accept_clients();
+        } else if ( fd == changes.fd ) {
+            watch_db();
+        } else if ( fd == signals ) {
+            take_signal();
+        } else if ( fd == expiry ) {
+            expire_table();
+        } else {
+            serve( fd, request, reply );
+        }
+    }
+
+    free( request );
+    free( reply );
+    return NULL;
+}
+
+/**
+ */
+static int
+listen_on( const char *path ) {
+    struct sockaddr_un sun;
+    int fd;
+
+    memset( &sun, 0, sizeof(sun) );
+    sun.sun_family = AF_UNIX;
+    if ( strlen(path) >= sizeof(sun.sun_path) ) return -1;
+    strcpy( sun.sun_path, path );
+
+    fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( fd < 0 ) return -1;
+    unlink( path );
+    if ( bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ) goto fail;
+    /* lookups run as any user */
+    if ( chmod(path, 0666) < 0 ) goto fail;
+    if ( listen(fd, SOMAXCONN) < 0 ) goto fail;
+    return fd;
+
+fail:
+    close( fd );
+    return -1;
+}
+
+static struct option options[] = {
+    { "socket",  required_argument, NULL, 's' },
+    { "threads", required_argument, NULL, 't' },
+    { "debug",   no_argument, &debug, 1 },
+    { 0, 0, 0, 0 },
+};
+
+/**
+ */
+int
+main( int argc, char **argv ) {
+    const char *path = RESOLVER_SOCKET;
+    long threads = sysconf( _SC_NPROCESSORS_ONLN );
+    pthread_t *pool;
+    sigset_t mask;
+    long i;
+
+    while ( 1 ) {
+        int c = getopt_long( argc, argv, "", options, NULL );
+        if ( c == -1 ) break;
+        switch ( c ) {
+        case 0: break;
+        case 's': path = optarg; break;
+        case 't': threads = atol( optarg ); break;
+        default: usage();
+        }
+    }
+    if ( optind != argc ) usage();
+    if ( threads < 1 ) threads = 1;
+
+    dbfile = hosts_dbfile();
+    if ( realpath(dbfile, dbpath) == NULL ) snprintf( dbpath, sizeof(dbpath), "%s", dbfile );
+
+    /* the signals are read from signals, in whichever thread */
+    sigemptyset( &mask );
+    sigaddset( &mask, SIGHUP );
+    sigaddset( &mask, SIGINT );
+    sigaddset( &mask, SIGTERM );
+    pthread_sigmask( SIG_BLOCK, &mask, NULL );
+    signal( SIGPIPE, SIG_IGN );
+
+    /* watched first, so a commit while the table is built is not missed */
+    if ( watch_open(&changes, dbfile) < 0 ) goto fail;
+    if ( table_reload(1) < 0 ) return 1;
+
+    if ( (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) goto fail;
+    if ( (listener = listen_on(path)) < 0 ) {
+        fprintf( stderr, "could not listen on %s: %s\n", path, strerror(errno) );
+        return 1;
+    }
+    if ( (signals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ) goto fail;
+    if ( (stopping = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ) goto fail;
+    if ( (expiry = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ) goto fail;
+    expiry_set( &table );
+
+    if ( arm(listener, EPOLL_CTL_ADD) < 0 || arm(changes.fd, EPOLL_CTL_ADD) < 0 ||
+         arm(signals, EPOLL_CTL_ADD) < 0 || arm(expiry, EPOLL_CTL_ADD) < 0 ) goto fail;
+    {
+        struct epoll_event event = { .events = EPOLLIN, .data.fd = stopping };
+        if ( epoll_ctl(epfd, EPOLL_CTL_ADD, stopping, &event) < 0 ) goto fail;
+    }
+
+    if ( debug ) fprintf( stderr, "serving %s on %s with %ld threads\n", dbfile, path, threads );
+
+    if ( (pool = (pthread_t *)calloc(threads, sizeof(*pool))) == NULL ) goto fail;
+    for ( i = 1 ; i < threads ; i++ ) {
+        if ( pthread_create(&pool[i], NULL, worker, NULL) != 0 ) goto fail;
+    }
+    worker( NULL );
+    for ( i = 1 ; i < threads ; i++ ) {
+        pthread_join( pool[i], NULL );
+    }
+
+    unlink( path );
+    snapshot_free( &table );
+    sqlite3_close( db );
+    return 0;
+
+fail:
+    fprintf( stderr, "hosts-resolverd: %s\n", strerror(errno) );
+    return 1;
+}
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
@@ -0,0 +1,641 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file hosts_snapshot.c
+ * \brief Compile and map the read-only host table snapshot
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+#include "hosts_db.h"
+#include "hosts_snapshot.h"
+
+/*
+ * A WAL is started again from the top, with new salts in its header,
+ * once it has all been checkpointed, and is otherwise only appended
+ * to.  So the salts and the number of valid frames, mxFrame in the
+ * wal-index header at the start of the -shm file, name what it holds
+ * even when a frame is rewritten in place within one mtime tick.
+ * sqlite keeps two copies of that header, which differ only while it
+ * is being written.
+ */
+#define WAL_SALT    16          /* offset of the salts in the -wal header */
+#define SHM_HEADER  48          /* size of one copy of the wal-index header */
+#define SHM_FRAMES  16          /* offset of mxFrame in it */
+
+/** Read the salts and frame count of the WAL of dbfile
+ *
+ * Returns -1 if either file cannot be read or the -shm is being
+ * written.
+ */
+static int
+snapshot_wal( const char *dbfile, uint8_t salt[8], uint32_t *frames ) {
+    uint8_t shm[2 * SHM_HEADER];
+    char path[4096];
+    int fd, result = -1;
+
+    snprintf( path, sizeof(path), "%s-wal", dbfile );
+    if ( (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 ) return -1;
+    if ( pread(fd, salt, 8, WAL_SALT) != 8 ) goto close;
+    close( fd );
+
+    snprintf( path, sizeof(path), "%s-shm", dbfile );
+    if ( (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 ) return -1;
+    if ( pread(fd, shm, sizeof(shm), 0) != (ssize_t)sizeof(shm) ) goto close;
+    if ( memcmp(shm, shm + SHM_HEADER, SHM_HEADER) != 0 ) goto close;
+    memcpy( frames, shm + SHM_FRAMES, sizeof(*frames) );
+    result = 0;
+
+close:
+    close( fd );
+    return result;
+}
+
+/**
+ */
+int
+snapshot_map( struct snapshot *s, const char *path, const struct stat *st ) {
+    const struct snapshot_header *h;
+    void *base;
+    int fd;
+
+    if ( st->st_size < (off_t)sizeof(*h) ) return -1;
+
+    fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 ) return -1;
+    base = mmap( NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( base == MAP_FAILED ) return -1;
+
+    h = (const struct snapshot_header *)base;
+    if ( h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION ||
+         h->size != (uint64_t)st->st_size || h->strings > h->size ||
+         h->names + h->nnames * sizeof(struct snapshot_name) > h->size ||
+         h->addrs + h->naddrs * sizeof(struct snapshot_addr) > h->size ) {
+        munmap( base, st->st_size );
+        return -1;
+    }
+
+    s->base = (const char *)base;
+    s->size = st->st_size;
+    s->dev = st->st_dev;
+    s->ino = st->st_ino;
+    s->mtime = st->st_mtim;
+    return 0;
+}
+
+/**
+ */
+void
+snapshot_unmap( struct snapshot *s ) {
+    if ( s->base != NULL ) {
+        munmap( (void *)s->base, s->size );
+    }
+    memset( s, 0, sizeof(*s) );
+}
+
+/** Is the snapshot still a true copy of the db?
+ *
+ * In WAL mode a commit only touches the -wal file, so that has to be
+ * unchanged too.  wal is NULL if there is no -wal file; an empty one
+ * and a missing one both mean every commit is in the db file.  Once a
+ * row in it has expired it is stale whatever the files say.
+ */
+int
+snapshot_fresh( const struct snapshot *s, const char *dbfile,
+                const struct stat *db, const struct stat *wal )
+{
+    const struct snapshot_header *h = (const struct snapshot_header *)s->base;
+    uint8_t salt[8];
+    uint32_t frames;
+
+    if ( h == NULL ) return 0;
+    if ( h->expires != 0 && time(NULL) >= h->expires ) return 0;
+    if ( h->db_dev != (uint64_t)db->st_dev ||
+         h->db_ino != (uint64_t)db->st_ino ||
+         h->db_size != (uint64_t)db->st_size ||
+         h->db_mtime_sec != (int64_t)db->st_mtim.tv_sec ||
+         h->db_mtime_nsec != (int64_t)db->st_mtim.tv_nsec ) {
+        return 0;
+    }
+    if ( wal == NULL || wal->st_size == 0 ) return h->wal_size == 0;
+    if ( h->wal_size != (uint64_t)wal->st_size ||
+         h->wal_mtime_sec != (int64_t)wal->st_mtim.tv_sec ||
+         h->wal_mtime_nsec != (int64_t)wal->st_mtim.tv_nsec ) {
+        return 0;
+    }
+    if ( snapshot_wal(dbfile, salt, &frames) < 0 ) return 0;
+    return h->wal_frames == frames && memcmp(h->wal_salt, salt, sizeof(salt)) == 0;
+}
+
+/**
+ */
+const struct snapshot_record *
+snapshot_by_name( const struct snapshot *s, const char *name, int family ) {
+    const struct snapshot_header *h = (const struct snapshot_header *)s->base;
+    const struct snapshot_name *index = (const struct snapshot_name *)(s->base + h->names);
+    uint32_t low = 0, high = h->nnames;
+    char key[NI_MAXHOST];
+
+    if ( hosts_name_key(name, key, sizeof(key)) < 0 ) return NULL;
+    while ( low < high ) {
+        uint32_t middle = low + (high - low) / 2;
+        const struct snapshot_name *n = &index[middle];
+        int cmp = strcmp( key, snapshot_string(s, n->key) );
+
+        if ( cmp == 0 ) cmp = family - (int)n->family;
+        if ( cmp == 0 ) {
+            return (const struct snapshot_record *)(s->base + h->records + n->record);
+        }
+        if ( cmp < 0 ) high = middle; else low = middle + 1;
+    }
+
+    return NULL;
+}
+
+/**
+ */
+const struct snapshot_record *
+snapshot_by_addr( const struct snapshot *s, const void *addr, int family ) {
+    const struct snapshot_header *h = (const struct snapshot_header *)s->base;
+    const struct snapshot_addr *index = (const struct snapshot_addr *)(s->base + h->addrs);
+    uint32_t low = 0, high = h->naddrs;
+    int length = hosts_address_length( family );
+
+    while ( low < high ) {
+        uint32_t middle = low + (high - low) / 2;
+        const struct snapshot_addr *a = &index[middle];
+        int cmp = family - (int)a->family;
+
+        if ( cmp == 0 ) cmp = memcmp( addr, a->addr, length );
+        if ( cmp == 0 ) {
+            return (const struct snapshot_record *)(s->base + h->records + a->record);
+        }
+        if ( cmp < 0 ) high = middle; else low = middle + 1;
+    }
+
+    return NULL;
+}
+
+/*
+ * Compiling
+ */
+
+struct growbuf {
+    char *data;
+    size_t length;
+    size_t size;
+};
+
+static int
+grow( struct growbuf *b, size_t delta ) {
+    if ( b->length + delta > b->size ) {
+        size_t size = b->size ? b->size : 4096;
+        char *data;
+
+        while ( size < b->length + delta ) size *= 2;
+        data = (char *)realloc( b->data, size );
+        if ( data == NULL ) return -1;
+        b->data = data;
+        b->size = size;
+    }
+    return 0;
+}
+
+/** Append and return the offset of the data appended
+ */
+static int64_t
+append( struct growbuf *b, const void *data, size_t length ) {
+    size_t offset = b->length;
+    size_t pad = -length % 4;
+
+    if ( grow(b, length + pad) < 0 ) return -1;
+    memcpy( b->data + b->length, data, length );
+    memset( b->data + b->length + length, 0, pad );
+    b->length += length + pad;
+    return offset;
+}
+
+struct row {
+    sqlite3_int64 id;
+    char *name;
+    char *key;                  /* as name_key */
+    uint32_t string;
+    char *zone;
+    uint32_t zonestring;
+    uint32_t expires;
+    int family;
+    uint8_t addr[16];
+    size_t group;               /* first row of this address in byaddr */
+    size_t end;
+};
+
+static int
+byname_compare( const void *a, const void *b, void *arg ) {
+    const struct row *rows = (const struct row *)arg;
+    const struct row *x = &rows[*(const size_t *)a];
+    const struct row *y = &rows[*(const size_t *)b];
+    int cmp = strcmp( x->key, y->key );
+
+    if ( cmp == 0 ) cmp = x->family - y->family;
+    if ( cmp == 0 ) cmp = (x->id > y->id) - (x->id < y->id);
+    return cmp;
+}
+
+static int
+byaddr_compare( const void *a, const void *b, void *arg ) {
+    const struct row *rows = (const struct row *)arg;
+    const struct row *x = &rows[*(const size_t *)a];
+    const struct row *y = &rows[*(const size_t *)b];
+    int cmp = x->family - y->family;
+
+    if ( cmp == 0 ) cmp = memcmp( x->addr, y->addr, sizeof(x->addr) );
+    if ( cmp == 0 ) cmp = (x->id > y->id) - (x->id < y->id);
+    return cmp;
+}
+
+/*
+ * A record being assembled, names are row indexes until written.
+ */
+struct draft {
+    int family;
+    uint32_t expires;
+    size_t nnames;
+    size_t naddrs;
+    size_t *names;
+    const uint8_t **addrs;
+    uint32_t *zones;
+};
+
+/** The record expires with the first of the rows in it
+ */
+static void
+draft_expires( struct draft *d, uint32_t expires ) {
+    if ( expires != 0 && (d->expires == 0 || expires < d->expires) ) d->expires = expires;
+}
+
+static void
+draft_name( struct draft *d, struct row *rows, size_t row ) {
+    size_t i;
+
+    draft_expires( d, rows[row].expires );
+
+    if ( d->nnames == UINT16_MAX ) return;
+    for ( i = 0 ; i < d->nnames ; i++ ) {
+        if ( strcmp(rows[d->names[i]].key, rows[row].key) == 0 ) return;
+    }
+    d->names[d->nnames++] = row;
+}
+
+static void
+draft_address( struct draft *d, const uint8_t *addr, uint32_t zone ) {
+    size_t i;
+    int length = hosts_address_length( d->family );
+
+    if ( d->naddrs == UINT16_MAX ) return;
+    for ( i = 0 ; i < d->naddrs ; i++ ) {
+        if ( memcmp(d->addrs[i], addr, length) == 0 ) return;
+    }
+    d->zones[d->naddrs] = zone;
+    d->addrs[d->naddrs++] = addr;
+}
+
+static int64_t
+draft_write( struct draft *d, struct row *rows, struct growbuf *records ) {
+    struct snapshot_record r;
+    int64_t offset;
+    size_t i;
+
+    r.family = d->family;
+    r.length = hosts_address_length( d->family );
+    r.nnames = d->nnames;
+    r.naddrs = d->naddrs;
+    r.expires = d->expires;
+
+    if ( grow(records, sizeof(r) + r.nnames * 4 + r.naddrs * (r.length + 4) + 4) < 0 ) return -1;
+    offset = append( records, &r, sizeof(r) );
+    for ( i = 0 ; i < d->nnames ; i++ ) {
+        memcpy( records->data + records->length, &rows[d->names[i]].string, 4 );
+        records->length += 4;
+    }
+    for ( i = 0 ; i < d->naddrs ; i++ ) {
+        memcpy( records->data + records->length, d->addrs[i], r.length );
+        records->length += r.length;
+    }
+    memset( records->data + records->length, 0, -records->length % 4 );
+    records->length += -records->length % 4;
+    memcpy( records->data + records->length, d->zones, r.naddrs * 4 );
+    records->length += r.naddrs * 4;
+
+    return offset;
+}
+
+static char *all_hosts_v1 = "SELECT id, hostname, address, zone FROM host ORDER BY id";
+static char *all_hosts_v2 = "SELECT id, hostname, addr, zone FROM host ORDER BY id";
+static char *all_hosts_v9 = "SELECT id, hostname, addr, zone, expires FROM host"
+                            " WHERE expires IS NULL OR expires > ?1 ORDER BY id";
+
+/** Build a snapshot of the host table of db in memory
+ *
+ * The image is one malloc()ed block, released with snapshot_free().
+ * Returns the number of names indexed, or -1.
+ */
+int
+snapshot_build( sqlite3 *db, const char *dbfile, struct snapshot *s ) {
+    int result = -1;
+    struct stat st, wal;
+    struct snapshot_header header;
+    uint8_t wal_salt[8] = { 0 };
+    uint32_t wal_frames = 0;
+    struct timespec now;
+    int64_t expires = 0;
+    struct growbuf strings = { 0 }, records = { 0 };
+    struct growbuf names = { 0 }, addrs = { 0 };
+    struct row *rows = NULL;
+    size_t nrows = 0, maxrows = 0;
+    size_t *byname = NULL, *byaddr = NULL;
+    struct draft d = { 0 };
+    sqlite3_stmt *stmt = NULL;
+    char *all_hosts, *image;
+    char walfile[4096];
+    size_t i, j, k;
+    int version, step;
+
+    if ( stat(dbfile, &st) < 0 ) return -1;
+    snprintf( walfile, sizeof(walfile), "%s-wal", dbfile );
+    if ( stat(walfile, &wal) < 0 ) memset( &wal, 0, sizeof(wal) );
+    /* before the read, so a commit in between can only make it stale */
+    if ( wal.st_size > 0 ) snapshot_wal( dbfile, wal_salt, &wal_frames );
+
+    /*
+     * Read the whole table in one short read transaction.
+     */
+    version = hosts_schema_version( db );
+    all_hosts = version >= 9 ? all_hosts_v9 : version >= 2 ? all_hosts_v2 : all_hosts_v1;
+    if ( sqlite3_prepare_v2(db, all_hosts, -1, &stmt, NULL) != SQLITE_OK ) goto done;
+    /* not time(), which may lag the timer hosts-resolverd rebuilds on */
+    clock_gettime( CLOCK_REALTIME, &now );
+    if ( all_hosts == all_hosts_v9 ) sqlite3_bind_int64( stmt, 1, now.tv_sec );
+    while ( (step = sqlite3_step(stmt)) == SQLITE_ROW ) {
+        const char *name = (const char *)sqlite3_column_text( stmt, 1 );
+        const char *zone = (const char *)sqlite3_column_text( stmt, 3 );
+        char key[NI_MAXHOST];
+        struct row *r;
+
+        if ( name == NULL || hosts_name_key(name, key, sizeof(key)) < 0 ) continue;
+        if ( nrows == maxrows ) {
+            struct row *grown;
+            maxrows = maxrows ? maxrows * 2 : 1024;
+            grown = (struct row *)realloc( rows, maxrows * sizeof(*rows) );
+            if ( grown == NULL ) goto done;
+            rows = grown;
+        }
+
+        r = &rows[nrows];
+        memset( r, 0, sizeof(*r) );
+        if ( (r->family = hosts_column_address(stmt, 2, r->addr)) == 0 ) continue;
+        r->id = sqlite3_column_int64( stmt, 0 );
+        if ( sqlite3_column_count(stmt) > 4 ) r->expires = sqlite3_column_int64( stmt, 4 );
+        if ( r->expires != 0 && (expires == 0 || r->expires < expires) ) expires = r->expires;
+        if ( (r->name = strdup(name)) == NULL ) goto done;
+        nrows++;
+        if ( (r->key = strdup(key)) == NULL ) goto done;
+        if ( zone != NULL && zone[0] != '\0' ) {
+            if ( (r->zone = strdup(zone)) == NULL ) goto done;
+        }
+    }
+    if ( step != SQLITE_DONE ) goto done;
+    sqlite3_finalize( stmt );
+    stmt = NULL;
+
+    for ( i = 0 ; i < nrows ; i++ ) {
+        int64_t offset = append( &strings, rows[i].name, strlen(rows[i].name) + 1 );
+        if ( offset < 0 ) goto done;
+        rows[i].string = offset;
+        rows[i].zonestring = SNAPSHOT_NOZONE;
+        if ( rows[i].zone != NULL ) {
+            offset = append( &strings, rows[i].zone, strlen(rows[i].zone) + 1 );
+            if ( offset < 0 ) goto done;
+            rows[i].zonestring = offset;
+        }
+    }
+
+    byname = (size_t *)malloc( (nrows + 1) * sizeof(size_t) );
+    byaddr = (size_t *)malloc( (nrows + 1) * sizeof(size_t) );
+    d.names = (size_t *)malloc( (nrows + 1) * sizeof(size_t) );
+    d.addrs = (const uint8_t **)malloc( (nrows + 1) * sizeof(uint8_t *) );
+    d.zones = (uint32_t *)malloc( (nrows + 1) * sizeof(uint32_t) );
+    if ( byname == NULL || byaddr == NULL || d.names == NULL || d.addrs == NULL ||
+         d.zones == NULL ) goto done;
+
+    for ( i = 0 ; i < nrows ; i++ ) byname[i] = byaddr[i] = i;
+    qsort_r( byname, nrows, sizeof(size_t), byname_compare, rows );
+    qsort_r( byaddr, nrows, sizeof(size_t), byaddr_compare, rows );
+
+    /*
+     * Reverse records, one per address, holding every name of it.
+     */
+    for ( i = 0 ; i < nrows ; i = j ) {
+        struct row *first = &rows[byaddr[i]];
+        struct snapshot_addr entry;
+        int64_t offset;
+
+        d.family = first->family;
+        d.expires = 0;
+        d.nnames = d.naddrs = 0;
+        draft_address( &d, first->addr, first->zonestring );
+        for ( j = i ; j < nrows ; j++ ) {
+            struct row *r = &rows[byaddr[j]];
+            if ( r->family != first->family ) break;
+            if ( memcmp(r->addr, first->addr, sizeof(r->addr)) != 0 ) break;
+            draft_name( &d, rows, byaddr[j] );
+        }
+        for ( k = i ; k < j ; k++ ) {
+            rows[byaddr[k]].group = i;
+            rows[byaddr[k]].end = j;
+        }
+
+        if ( (offset = draft_write(&d, rows, &records)) < 0 ) goto done;
+        memset( &entry, 0, sizeof(entry) );
+        entry.family = first->family;
+        memcpy( entry.addr, first->addr, sizeof(entry.addr) );
+        entry.record = offset;
+        if ( append(&addrs, &entry, sizeof(entry)) < 0 ) goto done;
+    }
+
+    /*
+     * Forward records, one per name and family, holding every address
+     * and as aliases every other name on those addresses.
+     */
+    for ( i = 0 ; i < nrows ; i = j ) {
+        struct row *first = &rows[byname[i]];
+        struct snapshot_name entry;
+        int64_t offset;
+
+        d.family = first->family;
+        d.expires = 0;
+        d.nnames = d.naddrs = 0;
+        draft_name( &d, rows, byname[i] );
+        for ( j = i ; j < nrows ; j++ ) {
+            struct row *r = &rows[byname[j]];
+            if ( r->family != first->family ) break;
+            if ( strcmp(r->key, first->key) != 0 ) break;
+            draft_expires( &d, r->expires );
+            draft_address( &d, r->addr, r->zonestring );
+            for ( k = r->group ; k < r->end ; k++ ) {
+                draft_name( &d, rows, byaddr[k] );
+            }
+        }
+
+        if ( (offset = draft_write(&d, rows, &records)) < 0 ) goto done;
+
+        entry.key = append( &strings, first->key, strlen(first->key) + 1 );
+        entry.family = first->family;
+        entry.record = offset;
+        if ( append(&names, &entry, sizeof(entry)) < 0 ) goto done;
+    }
+
+    memset( &header, 0, sizeof(header) );
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.db_dev = st.st_dev;
+    header.db_ino = st.st_ino;
+    header.db_size = st.st_size;
+    header.db_mtime_sec = st.st_mtim.tv_sec;
+    header.db_mtime_nsec = st.st_mtim.tv_nsec;
+    header.wal_size = wal.st_size;
+    header.wal_mtime_sec = wal.st_mtim.tv_sec;
+    header.wal_mtime_nsec = wal.st_mtim.tv_nsec;
+    header.wal_frames = wal_frames;
+    memcpy( header.wal_salt, wal_salt, sizeof(header.wal_salt) );
+    header.nnames = names.length / sizeof(struct snapshot_name);
+    header.naddrs = addrs.length / sizeof(struct snapshot_addr);
+    header.names = sizeof(header);
+    header.addrs = header.names + names.length;
+    header.records = header.addrs + addrs.length;
+    header.strings = header.records + records.length;
+    header.size = header.strings + strings.length;
+    header.expires = expires;
+
+    if ( (image = (char *)malloc(header.size)) == NULL ) goto done;
+    memcpy( image, &header, sizeof(header) );
+    memcpy( image + header.names, names.data, names.length );
+    memcpy( image + header.addrs, addrs.data, addrs.length );
+    memcpy( image + header.records, records.data, records.length );
+    memcpy( image + header.strings, strings.data, strings.length );
+
+    memset( s, 0, sizeof(*s) );
+    s->base = image;
+    s->size = header.size;
+    result = header.nnames;
+
+done:
+    sqlite3_finalize( stmt );
+    for ( i = 0 ; i < nrows ; i++ ) {
+        free( rows[i].name );
+        free( rows[i].key );
+        free( rows[i].zone );
+    }
+    free( rows );
+    free( byname );
+    free( byaddr );
+    free( d.names );
+    free( d.addrs );
+    free( d.zones );
+    free( strings.data );
+    free( records.data );
+    free( names.data );
+    free( addrs.data );
+    return result;
+}
+
+/** Release a snapshot made by snapshot_build()
+ */
+void
+snapshot_free( struct snapshot *s ) {
+    free( (void *)s->base );
+    memset( s, 0, sizeof(*s) );
+}
+
+/** Compile the host table of db into a snapshot file at path
+ *
+ * The snapshot is written to a temporary file and renamed into place
+ * so a reader never maps a partial one.
+ */
+int
+snapshot_compile( sqlite3 *db, const char *dbfile, const char *path ) {
+    struct snapshot s;
+    char tmp[4096];
+    FILE *f = NULL;
+    int result;
+
+    /*
+     * Fold the log into the db first so the snapshot stays fresh once
+     * this connection closes and the empty log is removed.  If readers
+     * keep that from finishing the snapshot records the log as it is.
+     */
+    sqlite3_exec( db, "PRAGMA wal_checkpoint(TRUNCATE)", NULL, NULL, NULL );
+    if ( (result = snapshot_build(db, dbfile, &s)) < 0 ) return -1;
+
+    snprintf( tmp, sizeof(tmp), "%s.%d", path, (int)getpid() );
+    if ( (f = fopen(tmp, "w")) == NULL ) goto fail;
+    if ( fwrite(s.base, s.size, 1, f) != 1 ) goto fail;
+    if ( fflush(f) != 0 || fsync(fileno(f)) < 0 ) goto fail;
+    if ( fclose(f) != 0 ) {
+        f = NULL;
+        goto fail;
+    }
+    f = NULL;
+    if ( rename(tmp, path) < 0 ) goto fail;
+
+    snapshot_free( &s );
+    return result;
+
+fail:
+    if ( f != NULL ) fclose( f );
+    unlink( tmp );
+    snapshot_free( &s );
+    return -1;
+}
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
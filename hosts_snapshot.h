@@ -0,0 +1,166 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file hosts_snapshot.h
+ * \brief Compiled, read-only snapshot of the host table
+ *
+ * The snapshot is written by "hosts --compile" and mapped by the NSS
+ * module so lookups need no SQL, no allocation and no locks.  It is
+ * only used while the db file it was compiled from, and its write-ahead
+ * log, are unchanged: the stat of both, and what the log holds, as
+ * named by the salts in its header and the count of frames in it that
+ * the -shm file keeps.  hosts-resolverd builds the same image in memory
+ * and serves lookups from it.
+ *
+ * Layout: header, name index, address index, records, strings.  The
+ * indexes are sorted so lookups are a binary search.  Every record is
+ * a hostent ready to be copied out: a list of names (the first is
+ * h_name) and a list of addresses of one family, each with the zone
+ * (interface) of its row for link-local IPv6.
+ *
+ * Rows that have expired are left out, and each record carries the
+ * time the first of its rows expires.  The snapshot is stale from the
+ * time the first of all of them does.
+ */
+
+#ifndef _HOSTS_SNAPSHOT_H_
+#define _HOSTS_SNAPSHOT_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include <sqlite3.h>
+
+#define SNAPSHOT_MAGIC   0x504e5348     /* "HSNP" */
+#define SNAPSHOT_VERSION 6
+#define SNAPSHOT_NOZONE  0xffffffff
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    /* stat of the db file this was compiled from */
+    uint64_t db_dev;
+    uint64_t db_ino;
+    uint64_t db_size;
+    int64_t  db_mtime_sec;
+    int64_t  db_mtime_nsec;
+    /* and of its -wal file, size 0 if there was none */
+    uint64_t wal_size;
+    int64_t  wal_mtime_sec;
+    int64_t  wal_mtime_nsec;
+    uint32_t nnames;
+    uint32_t naddrs;
+    uint32_t names;             /* offset of the name index */
+    uint32_t addrs;             /* offset of the address index */
+    uint32_t records;           /* offset of the records */
+    uint32_t strings;           /* offset of the string table */
+    uint32_t wal_frames;        /* valid frames in the -wal file */
+    int64_t  expires;           /* when the first row expires, 0 for never */
+    uint8_t  wal_salt[8];       /* from the -wal header */
+};
+
+/* sorted by key (the name as name_key, see hosts_db.h) then family */
+struct snapshot_name {
+    uint32_t key;
+    uint32_t family;
+    uint32_t record;
+};
+
+/* sorted by family then address */
+struct snapshot_addr {
+    uint32_t family;
+    uint8_t  addr[16];
+    uint32_t record;
+};
+
+/*
+ * Followed by nnames string offsets, naddrs addresses of length bytes
+ * each and then, 4 byte aligned, naddrs zone string offsets (or
+ * SNAPSHOT_NOZONE).
+ */
+struct snapshot_record {
+    uint16_t family;
+    uint16_t length;
+    uint16_t nnames;
+    uint16_t naddrs;
+    uint32_t expires;           /* of its first row to expire, 0 for never */
+    uint32_t names[];
+};
+
+struct snapshot {
+    const char *base;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+};
+
+int snapshot_map( struct snapshot *, const char *path, const struct stat * );
+void snapshot_unmap( struct snapshot * );
+int snapshot_fresh( const struct snapshot *, const char *dbfile,
+                    const struct stat *db, const struct stat *wal );
+
+const struct snapshot_record *snapshot_by_name( const struct snapshot *, const char *name, int family );
+const struct snapshot_record *snapshot_by_addr( const struct snapshot *, const void *addr, int family );
+
+static inline const char *
+snapshot_string( const struct snapshot *s, uint32_t offset ) {
+    const struct snapshot_header *h = (const struct snapshot_header *)s->base;
+    return s->base + h->strings + offset;
+}
+
+static inline const char *
+snapshot_address( const struct snapshot_record *r, int i ) {
+    return (const char *)(r->names + r->nnames) + i * r->length;
+}
+
+/** The zone of address i of a record, NULL if it has none
+ */
+static inline const char *
+snapshot_zone( const struct snapshot *s, const struct snapshot_record *r, int i ) {
+    size_t length = r->naddrs * r->length;
+    const uint32_t *zones = (const uint32_t *)(snapshot_address(r, 0) + length + (-length % 4));
+
+    return zones[i] == SNAPSHOT_NOZONE ? NULL : snapshot_string(s, zones[i]);
+}
+
+int snapshot_build( sqlite3 *db, const char *dbfile, struct snapshot * );
+void snapshot_free( struct snapshot * );
+int snapshot_compile( sqlite3 *db, const char *dbfile, const char *path );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
@@ -0,0 +1,280 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/** \file hosts_stats.c
+ * \brief Lookup statistics shared by every process using the module
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "hosts_stats.h"
+
+struct stats_segment *stats = NULL;
+unsigned int stats_slots = 1;
+int stats_level = STATS_OFF;
+
+/** Map the segment, for reading, for writing or creating it
+ *
+ * Only root creates it.  Returns NULL if there is none, it is not one
+ * of ours, or anyone but root could have written it.  slots is set to
+ * the number of slots in use, bounded by the compiled in size.
+ */
+struct stats_segment *
+stats_map( int access, unsigned int *slots ) {
+    struct stats_segment *s;
+    struct timespec now;
+    struct stat st;
+    long cpus;
+    int flags = (access == STATS_READ) ? O_RDONLY : O_RDWR;
+    int prot = (access == STATS_READ) ? PROT_READ : PROT_READ | PROT_WRITE;
+    int fd, created = 0, replaced = 0;
+
+open:
+    fd = shm_open( STATS_SHM, flags | O_CLOEXEC, 0 );
+    if ( fd < 0 && access == STATS_CREATE && geteuid() == 0 ) {
+        fd = shm_open( STATS_SHM, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644 );
+        if ( fd >= 0 ) {
+            created = 1;
+            fchmod( fd, 0644 );
+            if ( ftruncate(fd, sizeof(*s)) < 0 ) {
+                close( fd );
+                shm_unlink( STATS_SHM );
+                return NULL;
+            }
+        } else {
+            /* lost the race to create it */
+            fd = shm_open( STATS_SHM, O_RDWR | O_CLOEXEC, 0 );
+        }
+    }
+    if ( fd < 0 ) return NULL;
+
+    if ( fstat(fd, &st) < 0 ) goto fail;
+    if ( st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ) {
+        /* left by an older module, or by someone else: root replaces it */
+        if ( access != STATS_CREATE || geteuid() != 0 || replaced ) goto fail;
+        close( fd );
+        shm_unlink( STATS_SHM );
+        replaced = 1;
+        goto open;
+    }
+    if ( st.st_size < (off_t)sizeof(*s) ) goto fail;
+    s = mmap( NULL, sizeof(*s), prot, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( s == MAP_FAILED ) return NULL;
+
+    if ( created ) {
+        cpus = sysconf( _SC_NPROCESSORS_CONF );
+        s->slots = (cpus < 1 || cpus > STATS_SLOTS) ? STATS_SLOTS : cpus;
+        s->version = STATS_VERSION;
+        clock_gettime( CLOCK_REALTIME, &now );
+        s->since = now.tv_sec;
+        __atomic_store_n( &s->magic, STATS_MAGIC, __ATOMIC_RELEASE );
+    }
+
+    if ( __atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+         s->version != STATS_VERSION ) {
+        munmap( s, sizeof(*s) );
+        return NULL;
+    }
+    *slots = __atomic_load_n( &s->slots, __ATOMIC_RELAXED );
+    if ( *slots < 1 || *slots > STATS_SLOTS ) *slots = STATS_SLOTS;
+    return s;
+
+fail:
+    close( fd );
+    return NULL;
+}
+
+/** Start keeping statistics in this process
+ */
+void
+stats_init( int level ) {
+    if ( level == STATS_OFF ) return;
+    if ( (stats = stats_map(STATS_CREATE, &stats_slots)) == NULL ) return;
+    stats_level = level;
+}
+
+/** Zero every counter
+ *
+ * Lookups running at the same time may lose a count or two.
+ */
+void
+stats_reset( struct stats_segment *s ) {
+    struct timespec now;
+
+    memset( s->slot, 0, sizeof(s->slot) );
+    clock_gettime( CLOCK_REALTIME, &now );
+    s->since = now.tv_sec;
+}
+
+static const char *entry_names[STATS_TIMERS] = {
+    [STATS_BYNAME]       = "gethostbyname_r",
+    [STATS_BYNAME2]      = "gethostbyname2_r",
+    [STATS_BYNAME3]      = "gethostbyname3_r",
+    [STATS_BYNAME4]      = "gethostbyname4_r",
+    [STATS_BYADDR]       = "gethostbyaddr_r",
+    [STATS_HOSTENT]      = "gethostent_r",
+    [STATS_TIME_OPEN]    = "open",
+    [STATS_TIME_PREPARE] = "prepare",
+    [STATS_TIME_STEP]    = "step",
+};
+
+static const char *outcome_names[STATS_OUTCOMES] = {
+    [STATS_FOUND]    = "found",
+    [STATS_NOTFOUND] = "notfound",
+    [STATS_TRYAGAIN] = "tryagain",
+    [STATS_ERANGE]   = "erange",
+    [STATS_UNAVAIL]  = "unavail",
+};
+
+static const char *event_names[STATS_EVENTS] = {
+    [STATS_CACHE_HIT]  = "cache_hit",
+    [STATS_CACHE_MISS] = "cache_miss",
+    [STATS_SNAPSHOT]   = "snapshot",
+    [STATS_RESOLVER]   = "resolver",
+    [STATS_OPEN]       = "open",
+    [STATS_PREPARE]    = "prepare",
+    [STATS_STEP]       = "step",
+};
+
+/*
+ * A histogram bucket is reported by its upper bound.
+ */
+static uint64_t
+percentile( const uint64_t *buckets, uint64_t count, double p ) {
+    uint64_t target = (uint64_t)(count * p), seen = 0;
+    int b;
+
+    for ( b = 0 ; b < STATS_BUCKETS ; b++ ) {
+        seen += buckets[b];
+        if ( seen > target ) return 2ull << b;
+    }
+    return 0;
+}
+
+/** Sum the first slots and print them, as a table or as JSON
+ */
+void
+stats_report( struct stats_segment *s, unsigned int slots, FILE *out, int json ) {
+    struct stats_slot sum;
+    uint64_t count[STATS_TIMERS];
+    unsigned int i, j, k;
+
+    memset( &sum, 0, sizeof(sum) );
+    for ( i = 0 ; i < slots ; i++ ) {
+        const struct stats_slot *slot = &s->slot[i];
+        for ( j = 0 ; j < STATS_ENTRIES ; j++ ) {
+            for ( k = 0 ; k < STATS_OUTCOMES ; k++ ) {
+                sum.outcomes[j][k] += __atomic_load_n( &slot->outcomes[j][k], __ATOMIC_RELAXED );
+            }
+        }
+        for ( j = 0 ; j < STATS_EVENTS ; j++ ) {
+            sum.events[j] += __atomic_load_n( &slot->events[j], __ATOMIC_RELAXED );
+        }
+        for ( j = 0 ; j < STATS_TIMERS ; j++ ) {
+            sum.total_ns[j] += __atomic_load_n( &slot->total_ns[j], __ATOMIC_RELAXED );
+            for ( k = 0 ; k < STATS_BUCKETS ; k++ ) {
+                sum.time[j][k] += __atomic_load_n( &slot->time[j][k], __ATOMIC_RELAXED );
+            }
+        }
+    }
+    for ( j = 0 ; j < STATS_TIMERS ; j++ ) {
+        count[j] = 0;
+        for ( k = 0 ; k < STATS_BUCKETS ; k++ ) count[j] += sum.time[j][k];
+    }
+
+    if ( json ) {
+        fprintf( out, "{\"since\":%llu,\"lookups\":{", (unsigned long long)s->since );
+        for ( j = 0 ; j < STATS_ENTRIES ; j++ ) {
+            fprintf( out, "%s\"%s\":{", j ? "," : "", entry_names[j] );
+            for ( k = 0 ; k < STATS_OUTCOMES ; k++ ) {
+                fprintf( out, "\"%s\":%llu,", outcome_names[k],
+                         (unsigned long long)sum.outcomes[j][k] );
+            }
+            fprintf( out, "\"timed\":%llu,\"mean_ns\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}",
+                     (unsigned long long)count[j],
+                     (unsigned long long)(count[j] ? sum.total_ns[j] / count[j] : 0),
+                     (unsigned long long)percentile(sum.time[j], count[j], 0.50),
+                     (unsigned long long)percentile(sum.time[j], count[j], 0.99),
+                     (unsigned long long)percentile(sum.time[j], count[j], 0.999) );
+        }
+        fprintf( out, "},\"events\":{" );
+        for ( j = 0 ; j < STATS_EVENTS ; j++ ) {
+            fprintf( out, "%s\"%s\":%llu", j ? "," : "", event_names[j],
+                     (unsigned long long)sum.events[j] );
+        }
+        fprintf( out, "},\"sqlite\":{" );
+        for ( j = STATS_ENTRIES ; j < STATS_TIMERS ; j++ ) {
+            fprintf( out, "%s\"%s\":{\"timed\":%llu,\"mean_ns\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}",
+                     j > STATS_ENTRIES ? "," : "", entry_names[j],
+                     (unsigned long long)count[j],
+                     (unsigned long long)(count[j] ? sum.total_ns[j] / count[j] : 0),
+                     (unsigned long long)percentile(sum.time[j], count[j], 0.50),
+                     (unsigned long long)percentile(sum.time[j], count[j], 0.99),
+                     (unsigned long long)percentile(sum.time[j], count[j], 0.999) );
+        }
+        fprintf( out, "}}\n" );
+        return;
+    }
+
+    fprintf( out, "%-18s", "lookup" );
+    for ( k = 0 ; k < STATS_OUTCOMES ; k++ ) fprintf( out, " %10s", outcome_names[k] );
+    fprintf( out, " %10s %10s %10s\n", "p50 ns", "p99 ns", "p999 ns" );
+    for ( j = 0 ; j < STATS_TIMERS ; j++ ) {
+        if ( j == STATS_ENTRIES ) {
+            fprintf( out, "\n%-18s %10s %10s %10s %10s\n", "sqlite", "calls", "p50 ns", "p99 ns", "p999 ns" );
+        }
+        if ( j < STATS_ENTRIES ) {
+            fprintf( out, "%-18s", entry_names[j] );
+            for ( k = 0 ; k < STATS_OUTCOMES ; k++ ) {
+                fprintf( out, " %10llu", (unsigned long long)sum.outcomes[j][k] );
+            }
+        } else {
+            fprintf( out, "%-18s %10llu", entry_names[j],
+                     (unsigned long long)sum.events[STATS_OPEN + j - STATS_TIME_OPEN] );
+        }
+        fprintf( out, " %10llu %10llu %10llu\n",
+                 (unsigned long long)percentile(sum.time[j], count[j], 0.50),
+                 (unsigned long long)percentile(sum.time[j], count[j], 0.99),
+                 (unsigned long long)percentile(sum.time[j], count[j], 0.999) );
+    }
+    fprintf( out, "\n%-18s %10llu\n%-18s %10llu\n%-18s %10llu\n%-18s %10llu\n",
+             "cache hits", (unsigned long long)sum.events[STATS_CACHE_HIT],
+             "cache misses", (unsigned long long)sum.events[STATS_CACHE_MISS],
+             "snapshot lookups", (unsigned long long)sum.events[STATS_SNAPSHOT],
+             "resolver lookups", (unsigned long long)sum.events[STATS_RESOLVER] );
+}
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
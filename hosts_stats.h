@@ -0,0 +1,206 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/** \file hosts_stats.h
+ * \brief Lookup statistics shared by every process using the module
+ *
+ * A small POSIX shared memory segment holds one slot of counters and
+ * latency histograms per CPU.  A lookup adds to the slot of the CPU it
+ * runs on with relaxed atomic adds, so there are no locks and almost
+ * never a contended cache line.  "hosts --stats" sums the slots.
+ *
+ * Only root creates the segment, 0644, and it is only used when root
+ * owns it and no one else can write it; lookups by other users keep
+ * no statistics.  The slot count is copied out and bounded when the
+ * segment is mapped, lookups never index by what is in it.  Its name
+ * carries the layout version, so modules of different versions keep
+ * separate segments.
+ */
+
+#ifndef _HOSTS_STATS_H_
+#define _HOSTS_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+
+#define STATS_SHM     "/nss-sqlite-stats.2"
+#define STATS_MAGIC   0x54534e48        /* "HNST" */
+#define STATS_VERSION 2
+#define STATS_SLOTS   64
+#define STATS_BUCKETS 32                /* bucket b counts [2^b, 2^(b+1)) ns */
+
+#define STATS_OFF      0
+#define STATS_COUNTERS 1                /* counts only, no clock reads */
+#define STATS_LATENCY  2
+
+#define STATS_READ     0                /* how stats_map opens the segment */
+#define STATS_WRITE    1
+#define STATS_CREATE   2
+
+enum stats_entry {
+    STATS_BYNAME,
+    STATS_BYNAME2,
+    STATS_BYNAME3,
+    STATS_BYNAME4,
+    STATS_BYADDR,
+    STATS_HOSTENT,
+    STATS_ENTRIES
+};
+
+enum stats_outcome {
+    STATS_FOUND,
+    STATS_NOTFOUND,
+    STATS_TRYAGAIN,
+    STATS_ERANGE,
+    STATS_UNAVAIL,
+    STATS_OUTCOMES
+};
+
+enum stats_event {
+    STATS_CACHE_HIT,
+    STATS_CACHE_MISS,
+    STATS_SNAPSHOT,
+    STATS_RESOLVER,
+    STATS_OPEN,
+    STATS_PREPARE,
+    STATS_STEP,
+    STATS_EVENTS
+};
+
+/* latency histograms: one per entry point, then the sqlite calls */
+enum stats_timer {
+    STATS_TIME_OPEN = STATS_ENTRIES,
+    STATS_TIME_PREPARE,
+    STATS_TIME_STEP,
+    STATS_TIMERS
+};
+
+struct stats_slot {
+    uint64_t outcomes[STATS_ENTRIES][STATS_OUTCOMES];
+    uint64_t events[STATS_EVENTS];
+    uint64_t total_ns[STATS_TIMERS];
+    uint64_t time[STATS_TIMERS][STATS_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct stats_segment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+    uint64_t since;                     /* CLOCK_REALTIME of the last reset */
+    struct stats_slot slot[STATS_SLOTS] __attribute__((aligned(64)));
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern struct stats_segment *stats __attribute__((visibility("hidden")));
+extern unsigned int stats_slots __attribute__((visibility("hidden")));
+extern int stats_level __attribute__((visibility("hidden")));
+
+void stats_init( int level ) __attribute__((visibility("hidden")));
+struct stats_segment *stats_map( int access, unsigned int *slots ) __attribute__((visibility("hidden")));
+void stats_reset( struct stats_segment * ) __attribute__((visibility("hidden")));
+void stats_report( struct stats_segment *, unsigned int slots, FILE *, int json ) __attribute__((visibility("hidden")));
+
+static inline struct stats_slot *
+stats_slot( void ) {
+    int cpu = sched_getcpu();
+    return &stats->slot[(cpu < 0 ? 0 : cpu) % stats_slots];
+}
+
+static inline void
+stats_add( uint64_t *counter, uint64_t value ) {
+    __atomic_fetch_add( counter, value, __ATOMIC_RELAXED );
+}
+
+/** Start timing, 0 if latency is not being kept
+ */
+static inline uint64_t
+stats_start( void ) {
+    struct timespec ts;
+
+    if ( stats_level < STATS_LATENCY ) return 0;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void
+stats_event( enum stats_event event ) {
+    if ( stats == NULL ) return;
+    stats_add( &stats_slot()->events[event], 1 );
+}
+
+static inline void
+stats_time( struct stats_slot *slot, int timer, uint64_t start ) {
+    struct timespec ts;
+    uint64_t ns;
+    int b;
+
+    if ( start == 0 ) return;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    ns = ts.tv_sec * 1000000000ull + ts.tv_nsec - start;
+    b = ns ? 63 - __builtin_clzll( ns ) : 0;
+    if ( b >= STATS_BUCKETS ) b = STATS_BUCKETS - 1;
+    stats_add( &slot->time[timer][b], 1 );
+    stats_add( &slot->total_ns[timer], ns );
+}
+
+/** Count a call to a sqlite function and how long it took
+ */
+static inline void
+stats_sqlite( enum stats_event event, int timer, uint64_t start ) {
+    struct stats_slot *slot;
+
+    if ( stats == NULL ) return;
+    slot = stats_slot();
+    stats_add( &slot->events[event], 1 );
+    stats_time( slot, timer, start );
+}
+
+/** Count the outcome of a lookup and how long it took
+ */
+static inline void
+stats_lookup( enum stats_entry entry, enum stats_outcome outcome, uint64_t start ) {
+    struct stats_slot *slot;
+
+    if ( stats == NULL ) return;
+    slot = stats_slot();
+    stats_add( &slot->outcomes[entry][outcome], 1 );
+    stats_time( slot, entry, start );
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
@@ -29,36 +29,555 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
 
+#include <poll.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <getopt.h>
+#include <time.h>
 #include <sqlite3.h>
 
 #include "hosts.h"
 
 static void usage() {
     fprintf( stderr, "Usage: hosts --add|--delete [--zone interface] hostname address\n" );
+    fprintf( stderr, "       hosts --add [--zone interface] --ttl seconds hostname address\n" );
+    fprintf( stderr, "       hosts --expire\n" );
+    fprintf( stderr, "       hosts --watch\n" );
+    fprintf( stderr, "       hosts --compile [snapshot]\n" );
+    fprintf( stderr, "       hosts --migrate\n" );
+    fprintf( stderr, "       hosts --import [--replace] [file|-]\n" );
+    fprintf( stderr, "       hosts --stats [--reset] [--json]\n" );
+    fprintf( stderr, "       hosts --node add uuid [peer|foreign|self]\n" );
+    fprintf( stderr, "       hosts --node delete uuid\n" );
+    fprintf( stderr, "       hosts --node list\n" );
+    fprintf( stderr, "       hosts --subtree domain\n" );
+    fprintf( stderr, "       hosts --resolve [--reverse] [name|address ...|-]\n" );
+    fprintf( stderr, "       hosts --changes [seq]\n" );
+    fprintf( stderr, "       hosts --compact seq\n" );
+    fprintf( stderr, "       hosts --sync-serve [--socket path]\n" );
+    fprintf( stderr, "       hosts --sync-pull [--socket path|--exec command]\n" );
     exit( EINVAL );
 }
 
 static int debug = 0;
 static int command = 0;
+static int replace = 0;
+static int reset = 0;
+static int json = 0;
+static int reverse = 0;
+static int ttl = -1;
 
 #define ADD_HOST 1
 #define DEL_HOST 2
+#define COMPILE  3
+#define MIGRATE  4
+#define IMPORT   5
+#define STATS    6
+#define NODE     7
+#define CHANGES  8
+#define COMPACT  9
+#define SERVE    10
+#define PULL     11
+#define SUBTREE  12
+#define RESOLVE  13
+#define EXPIRE   14
+#define WATCH    15
 
 static struct option options[] = {
     { "add",     no_argument, &command, ADD_HOST },
     { "delete",  no_argument, &command, DEL_HOST },
+    { "compile", no_argument, &command, COMPILE },
+    { "migrate", no_argument, &command, MIGRATE },
+    { "import",  no_argument, &command, IMPORT },
+    { "stats",   no_argument, &command, STATS },
+    { "node",    no_argument, &command, NODE },
+    { "changes", no_argument, &command, CHANGES },
+    { "compact", no_argument, &command, COMPACT },
+    { "sync-serve", no_argument, &command, SERVE },
+    { "sync-pull",  no_argument, &command, PULL },
+    { "subtree", no_argument, &command, SUBTREE },
+    { "resolve", no_argument, &command, RESOLVE },
+    { "expire",  no_argument, &command, EXPIRE },
+    { "watch",   no_argument, &command, WATCH },
+    { "replace", no_argument, &replace, 1 },
+    { "reset",   no_argument, &reset, 1 },
+    { "json",    no_argument, &json, 1 },
+    { "reverse", no_argument, &reverse, 1 },
     { "debug",   no_argument, &debug, 1 },
     { "zone",    required_argument, NULL, 'z' },
+    { "socket",  required_argument, NULL, 's' },
+    { "exec",    required_argument, NULL, 'e' },
+    { "ttl",     required_argument, NULL, 't' },
     { 0, 0, 0, 0 },
 };
 
+/** Load a hosts file into the db and report the rate
+ */
+static int
+import( char *file ) {
+    FILE *in = stdin;
+    Hosts_handle *h;
+    struct timespec start, end;
+    double seconds;
+    int added, rejected = 0;
+
+    if ( file != NULL && strcmp(file, "-") != 0 ) {
+        if ( (in = fopen(file, "r")) == NULL ) {
+            perror( file );
+            return 1;
+        }
+    }
+
+    if ( (h = Hosts_open(NULL)) == NULL ) {
+        printf( "could not open hosts db\n" );
+        if ( in != stdin ) fclose( in );
+        return 1;
+    }
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    added = Hosts_import( h, in, replace, &rejected );
+    clock_gettime( CLOCK_MONOTONIC, &end );
+
+    Hosts_close( h );
+    if ( in != stdin ) fclose( in );
+
+    if ( added < 0 ) {
+        printf( "failed to import hosts\n" );
+        return 1;
+    }
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf( "imported %d hosts in %.3f seconds (%.0f hosts/s), %d lines rejected\n",
+            added, seconds, seconds > 0 ? added / seconds : 0.0, rejected );
+    return rejected ? 2 : 0;
+}
+
+/**
+ */
+static int
+print_node( void *arg, const char *uuid, const char *status, const char *peer ) {
+    printf( "%s %s %s.node%s%s\n", uuid, status ? status : "foreign", uuid,
+            peer ? " " : "", peer ? peer : "" );
+    return 0;
+}
+
+/** Manage the cluster nodes
+ *
+ * A node resolves to the addresses of the hosts named by its uuid,
+ * so "hosts --add <uuid> <address>" gives it an address.
+ */
+static int
+node( int argc, char **argv ) {
+    Hosts_handle *h;
+    int result = 1;
+
+    if ( argc < 1 ) usage();
+    if ( strcmp(argv[0], "list") != 0 && argc < 2 ) usage();
+
+    if ( (h = Hosts_open(NULL)) == NULL ) {
+        printf( "could not open hosts db\n" );
+        return 1;
+    }
+
+    if ( strcmp(argv[0], "add") == 0 ) {
+        if ( Hosts_add_node(h, argv[1], argc > 2 ? argv[2] : NULL) < 0 ) {
+            printf( "failed to add node\n" );
+        } else {
+            result = 0;
+        }
+    } else if ( strcmp(argv[0], "delete") == 0 ) {
+        switch ( Hosts_delete_node(h, argv[1]) ) {
+        case -1: printf( "failed to delete node\n" ); break;
+        case 0:  printf( "no such node\n" ); break;
+        default: result = 0;
+        }
+    } else if ( strcmp(argv[0], "list") == 0 ) {
+        if ( Hosts_nodes(h, print_node, NULL) < 0 ) {
+            printf( "failed to list nodes\n" );
+        } else {
+            result = 0;
+        }
+    } else {
+        Hosts_close( h );
+        usage();
+    }
+
+    Hosts_close( h );
+    return result;
+}
+
+/** Print a row, or one side of a change, as "hostname address[%zone]"
+ */
+static void
+print_row( const char *hostname, const char *address, const char *zone ) {
+    printf( "%s %s%s%s", hostname ? hostname : "-", address ? address : "-",
+            zone ? "%" : "", zone ? zone : "" );
+}
+
+/**
+ */
+static int
+print_host( void *arg, const char *hostname, const char *address, const char *zone ) {
+    print_row( hostname, address, zone );
+    printf( "\n" );
+    return 0;
+}
+
+/** List the hosts in a domain and every domain under it
+ */
+static int
+subtree( char *domain ) {
+    Hosts_handle *h;
+    int result = 0;
+
+    if ( domain == NULL ) usage();
+    if ( (h = Hosts_open(NULL)) == NULL ) {
+        printf( "could not open hosts db\n" );
+        return 1;
+    }
+    if ( Hosts_subtree(h, domain, print_host, NULL) < 0 ) {
+        printf( "failed to list %s\n", domain );
+        result = 1;
+    }
+    Hosts_close( h );
+    return result;
+}
+
+/** Add a host that expires after ttl seconds
+ */
+static int
+add_ttl( char *hostname, char *address, char *zone ) {
+    Hosts_handle *h;
+    int result = 0;
+
+    if ( (h = Hosts_open(NULL)) == NULL ) {
+        printf( "could not open hosts db\n" );
+        return 1;
+    }
+    if ( Hosts_add_ttl(h, hostname, address, zone, ttl) < 0 ) {
+        printf( "failed to add host\n" );
+        result = 1;
+    }
+    Hosts_close( h );
+    return result;
+}
+
+/** Delete the hosts that have expired
+ */
+static int
+expire() {
+    Hosts_handle *h;
+    int count;
+
+    if ( (h = Hosts_open(NULL)) == NULL ) {
+        printf( "could not open hosts db\n" );
+        return 1;
+    }
+    if ( (count = Hosts_expire(h, 0)) < 0 ) {
+        printf( "failed to expire hosts\n" );
+    } else {
+        printf( "expired %d hosts\n", count );
+    }
+    Hosts_close( h );
+    return count < 0;
+}
+
+/** Print the data_version of the db each time another commit changes it
+ *
+ * Runs until killed, asleep while nothing is written.
+ */
+static int
+watch() {
+    Hosts_handle *h;
+    struct pollfd p = { .events = POLLIN };
+    int64_t version, last = -1;
+
+    if ( (h = Hosts_open(NULL)) == NULL ) {
+        printf( "could not open hosts db\n" );
+        return 1;
+    }
+    if ( (p.fd = Hosts_watch(h)) < 0 ) {
+        printf( "could not watch hosts db\n" );
+        Hosts_close( h );
+        return 1;
+    }
+    while (1) {
+        if ( (version = Hosts_data_version(h)) < 0 ) break;
+        if ( version != last ) {
+            printf( "data_version %lld\n", (long long)version );
+            fflush( stdout );
+            last = version;
+        }
+        if ( poll(&p, 1, -1) < 0 ) break;
+    }
+    printf( "failed to watch hosts db\n" );
+    Hosts_close( h );
+    return 1;
+}
+
+/** Read names (or addresses) to resolve, one per line
+ *
+ * Blank lines and comments are skipped.  Returns NULL if out of memory.
+ */
+static char **
+read_list( FILE *in, int *count ) {
+    char **list = NULL, **grown;
+    char *line = NULL, *start, *end;
+    size_t size = 0;
+    int max = 0;
+
+    *count = 0;
+    while ( getline(&line, &size, in) >= 0 ) {
+        for ( start = line ; *start == ' ' || *start == '\t' ; start++ ) ;
+        for ( end = start ; *end != '\0' && strchr(" \t\r\n#", *end) == NULL ; end++ ) ;
+        if ( end == start ) continue;
+        *end = '\0';
+        if ( *count == max ) {
+            max = max ? max * 2 : 256;
+            if ( (grown = realloc(list, max * sizeof(*list))) == NULL ) goto fail;
+            list = grown;
+        }
+        if ( (list[*count] = strdup(start)) == NULL ) goto fail;
+        (*count)++;
+    }
+    free( line );
+    if ( list == NULL ) list = malloc( sizeof(*list) );
+    return list;
+
+fail:
+    while ( *count > 0 ) free( list[--(*count)] );
+    free( list );
+    free( line );
+    return NULL;
+}
+
+/** Print "name address[%zone]", or "address hostname", for a batch row
+ */
+static int
+print_resolved( void *arg, int index, const char *hostname, const char *address, const char *zone ) {
+    char **asked = (char **)arg;
+
+    if ( reverse ) {
+        printf( "%s %s\n", asked[index], hostname ? hostname : "-" );
+    } else {
+        printf( "%s %s%s%s\n", asked[index], address ? address : "-",
+                zone ? "%" : "", zone ? zone : "" );
+    }
+    return 0;
+}
+
+/** Resolve the names (or addresses) given, or read from stdin, at once
+ */
+static int
+resolve( int argc, char **argv ) {
+    Hosts_handle *h;
+    char **list = argv;
+    int count = argc;
+    int result = 0;
+    int i;
+
+    if ( argc == 0 || (argc == 1 && strcmp(argv[0], "-") == 0) ) {
+        if ( (list = read_list(stdin, &count)) == NULL ) {
+            fprintf( stderr, "out of memory\n" );
+            return 1;
+        }
+    }
+
+    if ( (h = Hosts_open(NULL)) == NULL ) {
+        printf( "could not open hosts db\n" );
+        result = 1;
+        goto done;
+    }
+    if ( reverse ) {
+        i = Hosts_reverse_many( h, list, count, print_resolved, list );
+    } else {
+        i = Hosts_resolve_many( h, list, count, 0, print_resolved, list );
+    }
+    if ( i < 0 ) {
+        printf( "failed to resolve\n" );
+        result = 1;
+    } else if ( debug ) {
+        fprintf( stderr, "%d rows for %d %s\n", i, count, reverse ? "addresses" : "names" );
+    }
+    Hosts_close( h );
+
+done:
+    if ( list != argv ) {
+        for ( i = 0 ; i < count ; i++ ) free( list[i] );
+        free( list );
+    }
+    return result;
+}
+
+/**
+ */
+static int
+print_change( void *arg, const Hosts_change *change ) {
+    printf( "%lld %s %s ", (long long)change->seq, change->time ? change->time : "-", change->op );
+    if ( change->old_hostname != NULL ) {
+        print_row( change->old_hostname, change->old_address, change->old_zone );
+        if ( change->new_hostname != NULL ) printf( " -> " );
+    }
+    if ( change->new_hostname != NULL ) {
+        print_row( change->new_hostname, change->new_address, change->new_zone );
+        if ( change->new_expires > 0 ) printf( " until %lld", (long long)change->new_expires );
+    }
+    printf( "\n" );
+    return 0;
+}
+
+/** Print, or drop, the journal of changes to the host table
+ */
+static int
+changes( int compact, char *seq ) {
+    Hosts_handle *h;
+    int64_t since = 0;
+    int result = 1;
+    int count;
+
+    if ( seq != NULL ) since = strtoll( seq, NULL, 10 );
+    if ( compact && seq == NULL ) usage();
+
+    if ( (h = Hosts_open(NULL)) == NULL ) {
+        printf( "could not open hosts db\n" );
+        return 1;
+    }
+
+    if ( compact ) {
+        if ( (count = Hosts_compact(h, since)) < 0 ) {
+            printf( "failed to compact changes\n" );
+        } else {
+            printf( "%d changes compacted\n", count );
+            result = 0;
+        }
+    } else {
+        switch ( count = Hosts_changes(h, since, print_change, NULL) ) {
+        case -1: printf( "failed to read changes\n" ); break;
+        case HOSTS_RESCAN: printf( "changes since %lld have been compacted\n", (long long)since ); break;
+        default: result = 0;
+        }
+    }
+
+    Hosts_close( h );
+    return result;
+}
+
+/** Connect to, or listen on, a Unix socket
+ */
+static int
+unix_socket( const char *path, int listening ) {
+    struct sockaddr_un sun;
+    int fd;
+
+    memset( &sun, 0, sizeof(sun) );
+    sun.sun_family = AF_UNIX;
+    if ( strlen(path) >= sizeof(sun.sun_path) ) return -1;
+    strcpy( sun.sun_path, path );
+
+    if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) return -1;
+    if ( listening ) {
+        unlink( path );
+        if ( bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ) goto fail;
+        if ( listen(fd, 4) < 0 ) goto fail;
+    } else {
+        if ( connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ) goto fail;
+    }
+    return fd;
+
+fail:
+    close( fd );
+    return -1;
+}
+
+/** Run a command with a socket as its stdin and stdout
+ */
+static int
+spawn( const char *command, pid_t *pid ) {
+    int fds[2];
+
+    if ( socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 ) return -1;
+    if ( (*pid = fork()) < 0 ) {
+        close( fds[0] );
+        close( fds[1] );
+        return -1;
+    }
+    if ( *pid == 0 ) {
+        close( fds[0] );
+        dup2( fds[1], 0 );
+        dup2( fds[1], 1 );
+        if ( fds[1] > 1 ) close( fds[1] );
+        execl( "/bin/sh", "sh", "-c", command, (char *)NULL );
+        _exit( 127 );
+    }
+    close( fds[1] );
+    return fds[0];
+}
+
+/** Serve the db to peers, or pull from one
+ *
+ * Without --socket or --exec the peer is on stdin and stdout.
+ */
+static int
+replicate( int pull, const char *path, const char *command ) {
+    Hosts_handle *h;
+    pid_t pid = 0;
+    int fd = -1, peer, count;
+    int result = 1;
+
+    if ( (h = Hosts_open(NULL)) == NULL ) {
+        fprintf( stderr, "could not open hosts db\n" );
+        return 1;
+    }
+
+    if ( pull == 0 ) {
+        if ( path == NULL ) {
+            result = Hosts_sync_serve(h, 0, 1) < 0;
+            goto close;
+        }
+        if ( (fd = unix_socket(path, 1)) < 0 ) {
+            fprintf( stderr, "could not listen on %s\n", path );
+            goto close;
+        }
+        /* one peer at a time, until killed */
+        while ( (peer = accept(fd, NULL, NULL)) >= 0 ) {
+            count = Hosts_sync_serve( h, peer, peer );
+            if ( debug ) fprintf( stderr, "served %d changes\n", count );
+            close( peer );
+        }
+        goto close;
+    }
+
+    if ( command != NULL ) {
+        fd = spawn( command, &pid );
+    } else if ( path != NULL ) {
+        fd = unix_socket( path, 0 );
+    }
+    if ( (command != NULL || path != NULL) && fd < 0 ) {
+        fprintf( stderr, "could not reach peer\n" );
+        goto close;
+    }
+
+    if ( (count = Hosts_sync_pull(h, fd < 0 ? 0 : fd, fd < 0 ? 1 : fd)) < 0 ) {
+        fprintf( stderr, "failed to pull changes\n" );
+    } else {
+        fprintf( fd < 0 ? stderr : stdout, "pulled %d changes\n", count );
+        result = 0;
+    }
+
+close:
+    if ( fd >= 0 ) close( fd );
+    if ( pid > 0 ) waitpid( pid, NULL, 0 );
+    Hosts_close( h );
+    return result;
+}
+
 /** Locate interface for internal communications.
  * 
  * Glob the sysconfig dir to search each file for config.
@@ -69,6 +588,7 @@ main( int argc, char **argv ) {
     int result = 1;
 
     char *zone = NULL;
+    char *path = NULL, *exec = NULL;
     char *hostname, *address;
     int family;
     struct in6_addr a6;
@@ -82,13 +602,79 @@ main( int argc, char **argv ) {
 	case 'z':
 	    zone = optarg;
 	    break;
+	case 's':
+	    path = optarg;
+	    break;
+	case 'e':
+	    exec = optarg;
+	    break;
+	case 't':
+	    ttl = atoi( optarg );
+	    if ( ttl < 0 ) usage();
+	    break;
 	}
     }
 
-    if ( (argc - optind) < 2 )  usage();
-
     if ( debug ) Hosts_setdebug( debug );
 
+    if ( command == COMPILE ) {
+        if ( Hosts_compile(optind < argc ? argv[optind] : NULL) < 0 ) {
+            printf( "failed to compile hosts\n" );
+            return 1;
+        }
+        return 0;
+    }
+
+    if ( command == IMPORT ) {
+        return import( optind < argc ? argv[optind] : NULL );
+    }
+
+    if ( command == STATS ) {
+        if ( Hosts_stats(stdout, json, reset) < 0 ) {
+            printf( "no lookup statistics (is stats = off?)\n" );
+            return 1;
+        }
+        return 0;
+    }
+
+    if ( command == CHANGES || command == COMPACT ) {
+        return changes( command == COMPACT, optind < argc ? argv[optind] : NULL );
+    }
+
+    if ( command == RESOLVE ) {
+        return resolve( argc - optind, argv + optind );
+    }
+
+    if ( command == EXPIRE ) {
+        return expire();
+    }
+
+    if ( command == WATCH ) {
+        return watch();
+    }
+
+    if ( command == SUBTREE ) {
+        return subtree( optind < argc ? argv[optind] : NULL );
+    }
+
+    if ( command == SERVE || command == PULL ) {
+        return replicate( command == PULL, path, exec );
+    }
+
+    if ( command == NODE ) {
+        return node( argc - optind, argv + optind );
+    }
+
+    if ( command == MIGRATE ) {
+        if ( Hosts_migrate() < 0 ) {
+            printf( "failed to migrate hosts\n" );
+            return 1;
+        }
+        return 0;
+    }
+
+    if ( (argc - optind) < 2 )  usage();
+
     hostname = argv[optind];
     address = argv[optind+1];
 
@@ -105,7 +691,9 @@ main( int argc, char **argv ) {
 
     switch ( command ) {
     case ADD_HOST:
-	if ( zone == NULL ) {
+	if ( ttl >= 0 ) {
+	    result = add_ttl( hostname, address, zone );
+	} else if ( zone == NULL ) {
 	} else {
             if ( Hosts_add_zoned_host(hostname, address, zone) < 0 ) {
 	        printf( "failed to add host\n" );
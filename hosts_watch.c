@@ -0,0 +1,136 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/** \file hosts_watch.c
+ * \brief Notice changes to the hosts db without polling it
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+
+#include "hosts_watch.h"
+
+/** Start watching the db file
+ *
+ * The file need not exist yet, its directory must.  Returns -1, with
+ * the watch closed, if it cannot be watched (as when the per user
+ * limit on inotify instances has been reached).
+ */
+int
+watch_open( struct watch *w, const char *dbfile ) {
+    struct epoll_event event = { .events = EPOLLIN };
+    char dir[PATH_MAX], base[PATH_MAX];
+
+    w->fd = w->inotify = w->timer = -1;
+    w->settling = 0;
+    if ( snprintf(dir, sizeof(dir), "%s", dbfile) >= (int)sizeof(dir) ) return -1;
+    snprintf( base, sizeof(base), "%s", dbfile );
+    snprintf( w->dbname, sizeof(w->dbname), "%s", basename(base) );
+    snprintf( w->walname, sizeof(w->walname), "%s-wal", w->dbname );
+
+    if ( (w->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 ) goto fail;
+    if ( inotify_add_watch(w->inotify, dirname(dir),
+                           IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0 ) goto fail;
+    if ( (w->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ) goto fail;
+    if ( (w->fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) goto fail;
+
+    event.data.fd = w->inotify;
+    if ( epoll_ctl(w->fd, EPOLL_CTL_ADD, w->inotify, &event) < 0 ) goto fail;
+    event.data.fd = w->timer;
+    if ( epoll_ctl(w->fd, EPOLL_CTL_ADD, w->timer, &event) < 0 ) goto fail;
+    return 0;
+
+fail:
+    if ( w->fd >= 0 ) close( w->fd );
+    if ( w->inotify >= 0 ) close( w->inotify );
+    if ( w->timer >= 0 ) close( w->timer );
+    w->fd = w->inotify = w->timer = -1;
+    return -1;
+}
+
+/** Clear the watch, and say whether the db may have changed
+ *
+ * Returns 1 if it was written since the last call, or is still
+ * settling after a write, and 0 if it has been left alone.  A watch
+ * that is not open always says it may have changed.
+ */
+int
+watch_changed( struct watch *w ) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *e;
+    struct itimerspec settle;
+    uint64_t ticks;
+    int written = 0, changed;
+    ssize_t n;
+    char *p;
+
+    if ( w->fd < 0 ) return 1;
+
+    while ( (n = read(w->inotify, events, sizeof(events))) > 0 ) {
+        for ( p = events ; p < events + n ; p += sizeof(*e) + e->len ) {
+            e = (const struct inotify_event *)p;
+            if ( e->mask & IN_Q_OVERFLOW ) written = 1;
+            if ( e->len == 0 ) continue;
+            if ( strcmp(e->name, w->dbname) == 0 || strcmp(e->name, w->walname) == 0 ) written = 1;
+        }
+    }
+
+    changed = written || w->settling;
+    if ( w->settling && read(w->timer, &ticks, sizeof(ticks)) == sizeof(ticks) ) {
+        w->settling = 0;
+    }
+    if ( written ) {
+        memset( &settle, 0, sizeof(settle) );
+        settle.it_value.tv_nsec = WATCH_SETTLE * 1000000L;
+        timerfd_settime( w->timer, 0, &settle, NULL );
+        w->settling = 1;
+    }
+    return changed;
+}
+
+/**
+ */
+void
+watch_close( struct watch *w ) {
+    if ( w->fd < 0 ) return;
+    close( w->fd );
+    close( w->inotify );
+    close( w->timer );
+    w->fd = w->inotify = w->timer = -1;
+}
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
@@ -0,0 +1,76 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/** \file hosts_watch.h
+ * \brief Notice changes to the hosts db without polling it
+ *
+ * A watch is one pollable file descriptor that becomes readable soon
+ * after the db may have changed, and costs nothing while it has not.
+ * inotify on the directory of the db reports writes to the db and its
+ * -wal file, and a new db renamed over the old one.  A commit writes
+ * the -wal before readers can see it, so after each burst of writes a
+ * timer makes the watch readable once more, WATCH_SETTLE ms later.
+ *
+ * Whether anything was committed is for PRAGMA data_version to say,
+ * the watch only says when it is worth asking.
+ */
+
+#ifndef _HOSTS_WATCH_H_
+#define _HOSTS_WATCH_H_
+
+#include <sys/types.h>
+#include <limits.h>
+
+#define WATCH_SETTLE 20         /* ms */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * fd < 0 when the watch is not open, and then nothing else is used.
+ */
+struct watch {
+    int fd;                     /* epoll of the two below, the one to poll */
+    int inotify;
+    int timer;
+    int settling;               /* writes seen, the timer has not fired */
+    char dbname[NAME_MAX + 1];
+    char walname[NAME_MAX + sizeof("-wal")];
+};
+
+int watch_open( struct watch *, const char *dbfile );
+int watch_changed( struct watch * );
+void watch_close( struct watch * );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
@@ -27,16 +27,30 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <glob.h>
+#include <pthread.h>
 
 #include <sqlite3.h>
 
 #include "hosts.h"
+#include "hosts_db.h"
+#include "hosts_snapshot.h"
+#include "hosts_stats.h"
+#include "hosts_watch.h"
 
 static int debug = 0;
 
@@ -51,143 +65,2130 @@ Hosts_setdebug( int value ) {
 
 /**
  */
+static char *
+Hosts_dbfile() {
+    return (char *)hosts_dbfile();
+}
+
+/*
+ * How long (ms) a writer waits for another writer, or a checkpoint,
+ * before giving up.  Readers never block a writer in WAL mode.
+ */
+#define WRITER_BUSY_TIMEOUT 5000
+
+static void Hosts_functions( sqlite3 * );
+
+/**
+ * The -wal and -shm files are kept when the last writer closes.  A
+ * lookup opens the db read only, and in WAL mode that needs both to
+ * exist, which it cannot create itself without write access to the
+ * directory.  sqlite creates them with the mode of the db file, so
+ * they are as readable as it is.
+ */
 static int
-Hosts_opendb( sqlite3 **db ) {
-    char *dbfile = getenv("HOSTSDB");
-    if ( dbfile == NULL ) {
-        dbfile = HOSTSDB;
-    }
+Hosts_opendb( char *dbfile, sqlite3 **db ) {
+    int persist = 1;
+    int status;
+
+    if ( dbfile == NULL ) dbfile = Hosts_dbfile();
     if ( debug ) fprintf( stderr, "opening db file %s\n", dbfile );
-    return sqlite3_open(dbfile, db);
+    status = sqlite3_open( dbfile, db );
+    if ( status == SQLITE_OK ) {
+        sqlite3_busy_timeout( *db, WRITER_BUSY_TIMEOUT );
+        sqlite3_file_control( *db, "main", SQLITE_FCNTL_PERSIST_WAL, &persist );
+        Hosts_functions( *db );
+    }
+    return status;
+}
+
+/*
+ * An address in the forms the host table keeps it.
+ */
+struct address {
+    int family;
+    int length;
+    struct in6_addr addr;
+    char text[INET6_ADDRSTRLEN];
+};
+
+/**
+ */
+static int
+Hosts_address( struct address *a, char *address ) {
+    a->family = hosts_parse_address( address, &a->addr );
+    if ( a->family == 0 ) {
+        if ( debug ) fprintf( stderr, "invalid address '%s'\n", address );
+        return -1;
+    }
+    a->length = hosts_address_length( a->family );
+    inet_ntop( a->family, &a->addr, a->text, sizeof(a->text) );
+    return 0;
+}
+
+/*
+ * A hostname in the forms the host table keeps it.
+ */
+struct name {
+    char hostname[NI_MAXHOST];  /* as given, less any trailing dot */
+    char key[NI_MAXHOST];
+    char rname[NI_MAXHOST];
+    sqlite3_int64 hash;
+};
+
+/**
+ */
+static int
+Hosts_name( struct name *n, const char *hostname ) {
+    int length = hosts_name_key( hostname, n->key, sizeof(n->key) );
+
+    if ( length < 0 ) {
+        if ( debug ) fprintf( stderr, "hostname too long '%s'\n", hostname );
+        return -1;
+    }
+    memcpy( n->hostname, hostname, length );
+    n->hostname[length] = '\0';
+    hosts_reverse_labels( n->key, n->rname, sizeof(n->rname) );
+    n->hash = hosts_name_hash( n->key );
+    return 0;
 }
 
 /*
- * SQL statement to be used for adding to the hosts db.
+ * The statements a handle prepares once and then reuses.
  */
-static char *zoned_insert = "INSERT OR REPLACE INTO host (hostname,zone,address) VALUES (?,?,?)";
+enum {
+    HANDLE_INSERT,
+    HANDLE_DELETE,
+    HANDLE_LOOKUP,
+    HANDLE_ITERATE,
+    HANDLE_SUBTREE,
+    HANDLE_RESOLVE_MANY,
+    HANDLE_REVERSE_MANY,
+    HANDLE_NODE_ADD,
+    HANDLE_NODE_DELETE,
+    HANDLE_NODE_ITERATE,
+    HANDLE_CHANGES,
+    HANDLE_CHANGE_SEQ,
+    HANDLE_CHANGE_HORIZON,
+    HANDLE_COMPACT,
+    HANDLE_EXPIRE,
+    HANDLE_SELF,
+    HANDLE_PEER,
+    HANDLE_SYNCED,
+    HANDLE_LATEST,
+    HANDLE_SAME,
+    HANDLE_REMOVE,
+    HANDLE_STAMP,
+    HANDLE_DUMP,
+    HANDLE_SENT,
+    HANDLE_UNSENT,
+    HANDLE_ORIGIN,
+    HANDLE_DATA_VERSION,
+    HANDLE_STATEMENTS
+};
+
+static char *handle_sql[HANDLE_STATEMENTS] = {
+    [HANDLE_INSERT]  = "INSERT OR REPLACE INTO host (hostname,zone,address,family,addr,"
+                       "                             rname,name_key,name_hash,expires)"
+                       " VALUES (?,?,?,?,?,?,?,?,?)",
+    [HANDLE_DELETE]  = "DELETE FROM host WHERE name_hash=? and name_key=? and zone IS ? and addr=?",
+    [HANDLE_LOOKUP]  = "SELECT hostname,address,zone FROM host WHERE name_hash=? and name_key=?"
+                       " AND (expires IS NULL OR expires > unixepoch()) ORDER BY id",
+    [HANDLE_ITERATE] = "SELECT hostname,address,zone FROM host ORDER BY id",
+    [HANDLE_SUBTREE] = "SELECT hostname,address,zone FROM host"
+                       " WHERE rname = ?1 OR (rname > ?1 || '.' AND rname < ?1 || '/')"
+                       " ORDER BY rname, id",
+    [HANDLE_RESOLVE_MANY] = "SELECT j.key,h.hostname,h.address,h.zone FROM json_each(?1) j"
+                            " LEFT JOIN host h ON h.name_hash = name_hash(name_key(j.value))"
+                            "  AND h.name_key = name_key(j.value) AND (?2 = 0 OR h.family = ?2)"
+                            "  AND (h.expires IS NULL OR h.expires > unixepoch())"
+                            " ORDER BY j.key, h.id",
+    [HANDLE_REVERSE_MANY] = "SELECT j.key,h.hostname,h.address,h.zone FROM json_each(?1) j"
+                            " LEFT JOIN host h ON h.addr = inet_addr(j.value)"
+                            "  AND (h.expires IS NULL OR h.expires > unixepoch())"
+                            " ORDER BY j.key, h.id",
+    [HANDLE_NODE_ADD]     = "INSERT INTO node (uuid,status) VALUES (?1,?2)"
+                            " ON CONFLICT (uuid) DO UPDATE SET status = excluded.status",
+    [HANDLE_NODE_DELETE]  = "DELETE FROM node WHERE uuid=?",
+    [HANDLE_NODE_ITERATE] = "SELECT uuid,status,CASE status WHEN 'peer' THEN 'peer' || id END"
+                            " FROM node ORDER BY id",
+    [HANDLE_CHANGES]        = "SELECT seq,op,time,old_hostname,old_address,old_zone,"
+                              "       new_hostname,new_address,new_zone,origin,new_expires"
+                              " FROM host_change WHERE seq > ? ORDER BY seq",
+    [HANDLE_CHANGE_SEQ]     = "SELECT coalesce((SELECT seq FROM sqlite_sequence"
+                              "                  WHERE name = 'host_change'), 0)",
+    [HANDLE_CHANGE_HORIZON] = "SELECT coalesce((SELECT min(seq) - 1 FROM host_change),"
+                              "                (SELECT seq FROM sqlite_sequence"
+                              "                  WHERE name = 'host_change'), 0)",
+    [HANDLE_COMPACT]        = "DELETE FROM host_change WHERE seq <= ?",
+    [HANDLE_EXPIRE]         = "DELETE FROM host WHERE id IN"
+                              " (SELECT id FROM host WHERE expires <= ?1 LIMIT ?2)",
+    [HANDLE_SELF]   = "SELECT uuid FROM node WHERE status = 'self' ORDER BY id LIMIT 1",
+    [HANDLE_PEER]   = "SELECT synced FROM node WHERE uuid = ?1 AND status = 'peer'",
+    [HANDLE_SYNCED] = "UPDATE node SET synced = ?2 WHERE uuid = ?1",
+    [HANDLE_LATEST] = "SELECT max(t) > coalesce(unixepoch(?3,'subsec'), 0) FROM ("
+                      "  SELECT max(unixepoch(time,'subsec')) AS t FROM host_change"
+                      "   WHERE new_hostname = ?1 COLLATE NOCASE AND new_address = ?2"
+                      "  UNION ALL SELECT max(unixepoch(time,'subsec')) FROM host_change"
+                      "   WHERE old_hostname = ?1 COLLATE NOCASE AND old_address = ?2"
+                      "  UNION ALL SELECT unixepoch(coalesce(mtime,ctime),'subsec') FROM host"
+                      "   WHERE hostname = ?1 AND address = ?2)",
+    [HANDLE_SAME]   = "SELECT 1 FROM host WHERE hostname = ?1 AND address = ?2 AND zone IS ?3"
+                      " AND expires IS ?4",
+    [HANDLE_REMOVE] = "DELETE FROM host WHERE hostname = ?1 AND address = ?2",
+    [HANDLE_STAMP]  = "UPDATE host_change SET origin = ?1, time = ?2 WHERE seq > ?3",
+    [HANDLE_DUMP]   = "SELECT hostname,address,zone,coalesce(mtime,ctime),expires FROM host"
+                      " WHERE expires IS NULL OR expires > unixepoch() ORDER BY id",
+    [HANDLE_SENT]   = "INSERT OR IGNORE INTO temp.sync_sent (hostname,address) VALUES (?1,?2)",
+    [HANDLE_UNSENT] = "DELETE FROM host WHERE id IN (SELECT id FROM host h"
+                      "  WHERE (SELECT origin FROM host_change"
+                      "          WHERE new_hostname = h.hostname COLLATE NOCASE"
+                      "            AND new_address = h.address ORDER BY seq DESC LIMIT 1)"
+                      "        = ?1 COLLATE NOCASE"
+                      "    AND NOT EXISTS (SELECT 1 FROM temp.sync_sent s"
+                      "          WHERE s.hostname = h.hostname AND s.address = h.address))",
+    [HANDLE_ORIGIN] = "UPDATE host_change SET origin = ?1 WHERE seq > ?2",
+    [HANDLE_DATA_VERSION] = "PRAGMA data_version",
+};
+
+/*
+ * The lock is recursive so a visitor may add or delete through the
+ * handle it is visiting.
+ */
+struct Hosts_handle {
+    pthread_mutex_t lock;
+    sqlite3 *db;
+    sqlite3_stmt *stmt[HANDLE_STATEMENTS];
+    struct watch watch;
+};
+
+/** Open a handle on a hosts db
+ *
+ * With a NULL path the db is HOSTSDB from the environment, or the
+ * default.  Returns NULL if the db cannot be opened.
+ */
+Hosts_handle *
+Hosts_open( char *path ) {
+    Hosts_handle *h;
+    pthread_mutexattr_t attr;
+
+    if ( (h = calloc(1, sizeof(*h))) == NULL ) return NULL;
+
+    if ( Hosts_opendb(path, &h->db) != SQLITE_OK ) {
+        if ( debug ) fprintf( stderr, "could not open db\n" );
+        sqlite3_close( h->db );
+        free( h );
+        return NULL;
+    }
+    h->watch.fd = -1;
+
+    pthread_mutexattr_init( &attr );
+    pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+    pthread_mutex_init( &h->lock, &attr );
+    pthread_mutexattr_destroy( &attr );
+    return h;
+}
+
+/** Close a handle
+ *
+ * A transaction that is still open is rolled back.
+ */
+void
+Hosts_close( Hosts_handle *h ) {
+    int i;
+
+    if ( h == NULL ) return;
+    for ( i = 0 ; i < HANDLE_STATEMENTS ; i++ ) {
+        sqlite3_finalize( h->stmt[i] );
+    }
+    sqlite3_close( h->db );
+    watch_close( &h->watch );
+    pthread_mutex_destroy( &h->lock );
+    free( h );
+}
+
+/**
+ * Called with the handle locked.
+ */
+static sqlite3_stmt *
+Hosts_statement( Hosts_handle *h, int which ) {
+    if ( h->stmt[which] == NULL ) {
+        if ( sqlite3_prepare_v2(h->db, handle_sql[which], -1, &h->stmt[which], NULL) != SQLITE_OK ) {
+            if ( debug ) fprintf( stderr, "could not prepare: %s\n", sqlite3_errmsg(h->db) );
+            return NULL;
+        }
+    }
+    return h->stmt[which];
+}
 
 /**
+ * Called with the handle locked.
+ */
+static int
+Hosts_exec( Hosts_handle *h, char *sql ) {
+    if ( sqlite3_exec(h->db, sql, NULL, NULL, NULL) != SQLITE_OK ) {
+        if ( debug ) fprintf( stderr, "%s failed: %s\n", sql, sqlite3_errmsg(h->db) );
+        return -1;
+    }
+    return 0;
+}
+
+/** Start a transaction on the handle
+ *
+ * The write lock is taken now rather than at the first add.  Adds and
+ * deletes are not committed until Hosts_commit.  The transaction
+ * belongs to the handle, so threads sharing a handle share it too.
  */
 int
-Hosts_add_zoned_host( char *hostname, char *address, char *zone ) {
-    int result = -1;
-    sqlite3      *db = NULL;
-    sqlite3_stmt *stmt = NULL;
+Hosts_begin( Hosts_handle *h ) {
+    int result;
+
+    pthread_mutex_lock( &h->lock );
+    result = Hosts_exec( h, "BEGIN IMMEDIATE" );
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/**
+ */
+int
+Hosts_commit( Hosts_handle *h ) {
+    int result;
+
+    pthread_mutex_lock( &h->lock );
+    result = Hosts_exec( h, "COMMIT" );
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/**
+ */
+int
+Hosts_rollback( Hosts_handle *h ) {
+    int result;
+
+    pthread_mutex_lock( &h->lock );
+    result = Hosts_exec( h, "ROLLBACK" );
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/**
+ * Called with the handle locked.  expires is when the row stops
+ * answering lookups (seconds since the epoch), 0 for never.
+ */
+static int
+Hosts_insert( Hosts_handle *h, char *hostname, struct address *a, char *zone, int64_t expires ) {
+    sqlite3_stmt *stmt;
+    struct name n;
     int status;
 
-    /* if ( sqlite3_open(HOSTSDB, &db) != SQLITE_OK ) goto close; */
-    if ( Hosts_opendb(&db) != SQLITE_OK ) goto close;
-    if ( sqlite3_prepare(db, zoned_insert, strlen(zoned_insert), &stmt, NULL) != SQLITE_OK ) {
-	if ( debug ) fprintf( stderr, "could not prepare\n" );
-        goto close;
-    }
+    if ( Hosts_name(&n, hostname) < 0 ) return -1;
+    if ( (stmt = Hosts_statement(h, HANDLE_INSERT)) == NULL ) return -1;
 
-    if ( sqlite3_bind_text(stmt, 1, hostname, -1, SQLITE_STATIC) != SQLITE_OK ) {
-	if ( debug ) fprintf( stderr, "could not bind hostname\n" );
-        goto finalize;
+    if ( sqlite3_bind_text(stmt, 1, n.hostname, -1, SQLITE_STATIC) != SQLITE_OK ||
+         sqlite3_bind_text(stmt, 2, zone, -1, SQLITE_STATIC) != SQLITE_OK ||
+         sqlite3_bind_text(stmt, 3, a->text, -1, SQLITE_STATIC) != SQLITE_OK ||
+         sqlite3_bind_int(stmt, 4, a->family) != SQLITE_OK ||
+         sqlite3_bind_blob(stmt, 5, &a->addr, a->length, SQLITE_STATIC) != SQLITE_OK ||
+         sqlite3_bind_text(stmt, 6, n.rname, -1, SQLITE_STATIC) != SQLITE_OK ||
+         sqlite3_bind_text(stmt, 7, n.key, -1, SQLITE_STATIC) != SQLITE_OK ||
+         sqlite3_bind_int64(stmt, 8, n.hash) != SQLITE_OK ||
+         (expires > 0 && sqlite3_bind_int64(stmt, 9, expires) != SQLITE_OK) ) {
+        if ( debug ) fprintf( stderr, "could not bind %s\n", hostname );
+        status = SQLITE_ERROR;
+    } else {
+        status = sqlite3_step( stmt );
     }
-    if ( sqlite3_bind_text(stmt, 2, zone, -1, SQLITE_STATIC) != SQLITE_OK ) {
-	if ( debug ) fprintf( stderr, "could not bind zone\n" );
-        goto finalize;
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
+
+    if ( status != SQLITE_DONE ) {
+        if ( debug ) fprintf( stderr, "failed to add %s (step = %d)\n", hostname, status );
+        return -1;
     }
-    if ( sqlite3_bind_text(stmt, 3, address, -1, SQLITE_STATIC) != SQLITE_OK ) {
-	if ( debug ) fprintf( stderr, "could not bind address\n" );
-        goto finalize;
+    return 0;
+}
+
+/** Add (or replace) a host
+ *
+ * The zone may be NULL.
+ */
+int
+Hosts_add( Hosts_handle *h, char *hostname, char *address, char *zone ) {
+    return Hosts_add_ttl( h, hostname, address, zone, 0 );
+}
+
+/** Add (or replace) a host that lives for ttl seconds
+ *
+ * Lookups stop returning it once it has expired, and Hosts_expire()
+ * deletes it.  A ttl of 0 is forever, as Hosts_add(), and replacing
+ * a row sets or clears its expiry.
+ */
+int
+Hosts_add_ttl( Hosts_handle *h, char *hostname, char *address, char *zone, int ttl ) {
+    int64_t expires = ttl > 0 ? (int64_t)time(NULL) + ttl : 0;
+    struct address a;
+    int result;
+
+    if ( ttl < 0 ) return -1;
+    if ( Hosts_address(&a, address) < 0 ) return -1;
+
+    pthread_mutex_lock( &h->lock );
+    result = Hosts_insert( h, hostname, &a, zone, expires );
+    pthread_mutex_unlock( &h->lock );
+    if ( result == 0 && debug ) fprintf( stderr, "host added\n" );
+    return result;
+}
+
+/** Delete a host
+ *
+ * A NULL zone matches only rows without a zone.  Returns the number
+ * of rows deleted, or -1.
+ */
+int
+Hosts_delete( Hosts_handle *h, char *hostname, char *address, char *zone ) {
+    sqlite3_stmt *stmt;
+    struct address a;
+    struct name n;
+    int result = -1;
+    int status;
+
+    if ( Hosts_address(&a, address) < 0 ) return -1;
+    if ( Hosts_name(&n, hostname) < 0 ) return -1;
+
+    pthread_mutex_lock( &h->lock );
+    if ( (stmt = Hosts_statement(h, HANDLE_DELETE)) == NULL ) goto unlock;
+
+    if ( sqlite3_bind_int64(stmt, 1, n.hash) != SQLITE_OK ||
+         sqlite3_bind_text(stmt, 2, n.key, -1, SQLITE_STATIC) != SQLITE_OK ||
+         sqlite3_bind_text(stmt, 3, zone, -1, SQLITE_STATIC) != SQLITE_OK ||
+         sqlite3_bind_blob(stmt, 4, &a.addr, a.length, SQLITE_STATIC) != SQLITE_OK ) {
+        if ( debug ) fprintf( stderr, "could not bind %s\n", hostname );
+        status = SQLITE_ERROR;
+    } else {
+        status = sqlite3_step( stmt );
     }
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
 
-    status = sqlite3_step( stmt );
     if ( status == SQLITE_DONE ) {
-        result = 0;
-	if ( debug ) fprintf( stderr, "host added\n" );
+        result = sqlite3_changes( h->db );
+        if ( debug ) fprintf( stderr, "%d host deleted\n", result );
     } else {
-        if ( debug ) fprintf( stderr, "failed to add %s\n", hostname );
-	if ( debug ) fprintf( stderr, "step = %d\n", status );
+        if ( debug ) fprintf( stderr, "failed to delete %s (step = %d)\n", hostname, status );
     }
 
-finalize:
-    sqlite3_finalize( stmt );
-close:
-    sqlite3_close( db );
+unlock:
+    pthread_mutex_unlock( &h->lock );
     return result;
 }
 
-/*
- * SQL statement to be used for removing from the hosts db.
+/**
+ * Called with the handle locked.  A statement that is already being
+ * stepped belongs to a visitor further up the stack.
  */
-static char *zoned_delete = "DELETE FROM host WHERE hostname=? and zone=? and address=?";
+static int
+Hosts_visit( Hosts_handle *h, sqlite3_stmt *stmt, Hosts_visitor visit, void *arg ) {
+    int count = 0;
+    int status;
 
-/**
+    while ( (status = sqlite3_step(stmt)) == SQLITE_ROW ) {
+        count++;
+        if ( visit == NULL ) continue;
+        if ( visit(arg, (const char *)sqlite3_column_text(stmt, 0),
+                        (const char *)sqlite3_column_text(stmt, 1),
+                        (const char *)sqlite3_column_text(stmt, 2)) != 0 ) {
+            status = SQLITE_DONE;
+            break;
+        }
+    }
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
+
+    if ( status != SQLITE_DONE ) {
+        if ( debug ) fprintf( stderr, "query failed: %s\n", sqlite3_errmsg(h->db) );
+        return -1;
+    }
+    return count;
+}
+
+/** Visit every row for a hostname
+ *
+ * The hostname matches in any case, with or without a trailing dot.
+ * The visitor is called with the hostname, address and zone (which
+ * may be NULL) of each row, in the order they were added, and stops
+ * the walk by returning non-zero.  Returns the number of rows
+ * visited, or -1.
  */
 int
-Hosts_del_zoned_host( char *hostname, char *address, char *zone ) {
+Hosts_lookup( Hosts_handle *h, char *hostname, Hosts_visitor visit, void *arg ) {
+    sqlite3_stmt *stmt;
+    struct name n;
     int result = -1;
-    sqlite3      *db = NULL;
-    sqlite3_stmt *stmt = NULL;
+
+    if ( Hosts_name(&n, hostname) < 0 ) return 0;
+
+    pthread_mutex_lock( &h->lock );
+    if ( (stmt = Hosts_statement(h, HANDLE_LOOKUP)) == NULL ) goto unlock;
+    if ( sqlite3_stmt_busy(stmt) ) {
+        if ( debug ) fprintf( stderr, "lookup called from a lookup visitor\n" );
+        goto unlock;
+    }
+    if ( sqlite3_bind_int64(stmt, 1, n.hash) != SQLITE_OK ||
+         sqlite3_bind_text(stmt, 2, n.key, -1, SQLITE_STATIC) != SQLITE_OK ) goto unlock;
+    result = Hosts_visit( h, stmt, visit, arg );
+
+unlock:
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/** Visit every row in the table
+ *
+ * As Hosts_lookup, for the whole table.
+ */
+int
+Hosts_iterate( Hosts_handle *h, Hosts_visitor visit, void *arg ) {
+    sqlite3_stmt *stmt;
+    int result = -1;
+
+    pthread_mutex_lock( &h->lock );
+    if ( (stmt = Hosts_statement(h, HANDLE_ITERATE)) == NULL ) goto unlock;
+    if ( sqlite3_stmt_busy(stmt) ) {
+        if ( debug ) fprintf( stderr, "iterate called from an iterate visitor\n" );
+        goto unlock;
+    }
+    result = Hosts_visit( h, stmt, visit, arg );
+
+unlock:
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/** Visit every row for a domain and the names under it
+ *
+ * "rack12.dc1" visits rack12.dc1 and web3.rack12.dc1, but not
+ * xrack12.dc1, in name order and as Hosts_lookup otherwise.  The
+ * rows are one range of by_rname, however large the table.
+ */
+int
+Hosts_subtree( Hosts_handle *h, char *domain, Hosts_visitor visit, void *arg ) {
+    sqlite3_stmt *stmt;
+    struct name n;
+    int result = -1;
+
+    if ( Hosts_name(&n, domain) < 0 ) return 0;
+
+    pthread_mutex_lock( &h->lock );
+    if ( (stmt = Hosts_statement(h, HANDLE_SUBTREE)) == NULL ) goto unlock;
+    if ( sqlite3_stmt_busy(stmt) ) {
+        if ( debug ) fprintf( stderr, "subtree called from a subtree visitor\n" );
+        goto unlock;
+    }
+    if ( sqlite3_bind_text(stmt, 1, n.rname, -1, SQLITE_STATIC) != SQLITE_OK ) goto unlock;
+    result = Hosts_visit( h, stmt, visit, arg );
+
+unlock:
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/** A list of strings as a JSON array, for json_each()
+ *
+ * Returns NULL if out of memory; free with sqlite3_free().
+ */
+static char *
+Hosts_json_array( char **values, int n ) {
+    sqlite3_str *json = sqlite3_str_new( NULL );
+    const char *v;
+    int i;
+
+    sqlite3_str_appendchar( json, 1, '[' );
+    for ( i = 0 ; i < n ; i++ ) {
+        if ( i > 0 ) sqlite3_str_appendchar( json, 1, ',' );
+        sqlite3_str_appendchar( json, 1, '"' );
+        for ( v = values[i] ; *v != '\0' ; v++ ) {
+            if ( *v == '"' || *v == '\\' ) {
+                sqlite3_str_appendf( json, "\\%c", *v );
+            } else if ( (unsigned char)*v < 0x20 ) {
+                sqlite3_str_appendf( json, "\\u%04x", *v );
+            } else {
+                sqlite3_str_appendchar( json, 1, *v );
+            }
+        }
+        sqlite3_str_appendchar( json, 1, '"' );
+    }
+    sqlite3_str_appendchar( json, 1, ']' );
+    return sqlite3_str_finish( json );
+}
+
+/**
+ * Called with the handle locked.
+ */
+static int
+Hosts_visit_batch( Hosts_handle *h, int which, char **values, int n, int family,
+                   Hosts_batch_visitor visit, void *arg ) {
+    sqlite3_stmt *stmt;
+    char *json = NULL;
+    int count = -1;
     int status;
 
-    /* if ( sqlite3_open(HOSTSDB, &db) != SQLITE_OK ) goto close; */
-    if ( Hosts_opendb(&db) != SQLITE_OK ) goto close;
-    if ( sqlite3_prepare(db, zoned_delete, strlen(zoned_delete), &stmt, NULL) != SQLITE_OK ) {
-	if ( debug ) fprintf( stderr, "could not prepare\n" );
-        goto close;
+    if ( (stmt = Hosts_statement(h, which)) == NULL ) return -1;
+    if ( sqlite3_stmt_busy(stmt) ) {
+        if ( debug ) fprintf( stderr, "batch called from a batch visitor\n" );
+        return -1;
     }
+    if ( (json = Hosts_json_array(values, n)) == NULL ) return -1;
+    if ( sqlite3_bind_text(stmt, 1, json, -1, SQLITE_STATIC) != SQLITE_OK ) goto done;
+    if ( sqlite3_bind_parameter_count(stmt) > 1 &&
+         sqlite3_bind_int(stmt, 2, family) != SQLITE_OK ) goto done;
 
-    if ( sqlite3_bind_text(stmt, 1, hostname, -1, SQLITE_STATIC) != SQLITE_OK ) {
-	if ( debug ) fprintf( stderr, "could not bind hostname\n" );
-        goto finalize;
+    count = 0;
+    while ( (status = sqlite3_step(stmt)) == SQLITE_ROW ) {
+        const char *hostname = (const char *)sqlite3_column_text( stmt, 1 );
+
+        if ( hostname != NULL ) count++;
+        if ( visit == NULL ) continue;
+        if ( visit(arg, sqlite3_column_int(stmt, 0), hostname,
+                   (const char *)sqlite3_column_text(stmt, 2),
+                   (const char *)sqlite3_column_text(stmt, 3)) != 0 ) {
+            status = SQLITE_DONE;
+            break;
+        }
     }
-    if ( sqlite3_bind_text(stmt, 2, zone, -1, SQLITE_STATIC) != SQLITE_OK ) {
-	if ( debug ) fprintf( stderr, "could not bind zone\n" );
-        goto finalize;
+    if ( status != SQLITE_DONE ) {
+        if ( debug ) fprintf( stderr, "batch failed: %s\n", sqlite3_errmsg(h->db) );
+        count = -1;
     }
-    if ( sqlite3_bind_text(stmt, 3, address, -1, SQLITE_STATIC) != SQLITE_OK ) {
-	if ( debug ) fprintf( stderr, "could not bind address\n" );
-        goto finalize;
+
+done:
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
+    sqlite3_free( json );
+    return count;
+}
+
+/** Look up many hostnames in one query
+ *
+ * family is AF_INET, AF_INET6 or 0 for both.  The visitor is called
+ * with the index of each name and a row for it, in the order of the
+ * names and then as Hosts_lookup; a name with no row is visited once
+ * with NULL hostname, address and zone.  Names match as Hosts_lookup
+ * matches them, and wildcards are not applied.  Returns the number of
+ * rows found, or -1.
+ */
+int
+Hosts_resolve_many( Hosts_handle *h, char **names, int n, int family,
+                    Hosts_batch_visitor visit, void *arg ) {
+    int result;
+
+    pthread_mutex_lock( &h->lock );
+    result = Hosts_visit_batch( h, HANDLE_RESOLVE_MANY, names, n, family, visit, arg );
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/** Look up the names of many addresses in one query
+ *
+ * As Hosts_resolve_many, with an address (in any text form) for each
+ * name.
+ */
+int
+Hosts_reverse_many( Hosts_handle *h, char **addresses, int n,
+                    Hosts_batch_visitor visit, void *arg ) {
+    int result;
+
+    pthread_mutex_lock( &h->lock );
+    result = Hosts_visit_batch( h, HANDLE_REVERSE_MANY, addresses, n, 0, visit, arg );
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/** Add a cluster node, or change the status of one
+ *
+ * The status is "peer", "foreign" (NULL) or "self" for this node.  The node resolves as
+ * <uuid>.node, and a peer also as peer<N>, to the addresses of the
+ * hosts named by its uuid.  An upsert rather than a replace, so the
+ * node keeps its id and with it its peer<N> name.
+ */
+int
+Hosts_add_node( Hosts_handle *h, char *uuid, char *status ) {
+    sqlite3_stmt *stmt;
+    int result = -1;
+    int step;
+
+    if ( status == NULL ) status = "foreign";
+    if ( strcmp(status, "peer") != 0 && strcmp(status, "foreign") != 0 &&
+         strcmp(status, "self") != 0 ) {
+        if ( debug ) fprintf( stderr, "invalid node status '%s'\n", status );
+        return -1;
     }
 
-    status = sqlite3_step( stmt );
-    if ( status == SQLITE_DONE ) {
+    pthread_mutex_lock( &h->lock );
+    if ( (stmt = Hosts_statement(h, HANDLE_NODE_ADD)) == NULL ) goto unlock;
+
+    if ( sqlite3_bind_text(stmt, 1, uuid, -1, SQLITE_STATIC) != SQLITE_OK ||
+         sqlite3_bind_text(stmt, 2, status, -1, SQLITE_STATIC) != SQLITE_OK ) {
+        if ( debug ) fprintf( stderr, "could not bind %s\n", uuid );
+        step = SQLITE_ERROR;
+    } else {
+        step = sqlite3_step( stmt );
+    }
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
+
+    if ( step == SQLITE_DONE ) {
         result = 0;
-	if ( debug ) fprintf( stderr, "host deleted\n" );
+        if ( debug ) fprintf( stderr, "node added\n" );
     } else {
-        if ( debug ) fprintf( stderr, "failed to delete %s\n", hostname );
-	if ( debug ) fprintf( stderr, "step = %d\n", status );
+        if ( debug ) fprintf( stderr, "failed to add node %s (step = %d)\n", uuid, step );
     }
 
-finalize:
-    sqlite3_finalize( stmt );
-close:
-    sqlite3_close( db );
+unlock:
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/** Delete a cluster node
+ *
+ * Its hosts stay, only the node names go.  Returns the number of
+ * nodes deleted, or -1.
+ */
+int
+Hosts_delete_node( Hosts_handle *h, char *uuid ) {
+    sqlite3_stmt *stmt;
+    int result = -1;
+    int step;
+
+    pthread_mutex_lock( &h->lock );
+    if ( (stmt = Hosts_statement(h, HANDLE_NODE_DELETE)) == NULL ) goto unlock;
+
+    if ( sqlite3_bind_text(stmt, 1, uuid, -1, SQLITE_STATIC) != SQLITE_OK ) {
+        step = SQLITE_ERROR;
+    } else {
+        step = sqlite3_step( stmt );
+    }
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
+
+    if ( step == SQLITE_DONE ) {
+        result = sqlite3_changes( h->db );
+        if ( debug ) fprintf( stderr, "%d node deleted\n", result );
+    } else {
+        if ( debug ) fprintf( stderr, "failed to delete node %s (step = %d)\n", uuid, step );
+    }
+
+unlock:
+    pthread_mutex_unlock( &h->lock );
     return result;
 }
 
-static char *insertion = "INSERT INTO host (hostname,address) VALUES (?,?)";
+/** Visit every cluster node
+ *
+ * As Hosts_iterate, with the uuid, status and peer name (NULL if the
+ * node is not a peer) of each node.
+ */
+int
+Hosts_nodes( Hosts_handle *h, Hosts_node_visitor visit, void *arg ) {
+    sqlite3_stmt *stmt;
+    int result = -1;
+
+    pthread_mutex_lock( &h->lock );
+    if ( (stmt = Hosts_statement(h, HANDLE_NODE_ITERATE)) == NULL ) goto unlock;
+    if ( sqlite3_stmt_busy(stmt) ) {
+        if ( debug ) fprintf( stderr, "nodes called from a nodes visitor\n" );
+        goto unlock;
+    }
+    result = Hosts_visit( h, stmt, visit, arg );
+
+unlock:
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
 
 /**
+ * Called with the handle locked.
+ */
+static int64_t
+Hosts_scalar( Hosts_handle *h, int which ) {
+    sqlite3_stmt *stmt;
+    int64_t result = -1;
+
+    if ( (stmt = Hosts_statement(h, which)) == NULL ) return -1;
+    if ( sqlite3_step(stmt) == SQLITE_ROW ) result = sqlite3_column_int64( stmt, 0 );
+    sqlite3_reset( stmt );
+    return result;
+}
+
+/** The seq of the latest change to the host table
+ *
+ * A mirror reads this and then the whole table in one transaction,
+ * and from then on asks for the changes since it.  Returns 0 if there
+ * has been no change, or -1.
+ */
+int64_t
+Hosts_change_seq( Hosts_handle *h ) {
+    int64_t result;
+
+    pthread_mutex_lock( &h->lock );
+    result = Hosts_scalar( h, HANDLE_CHANGE_SEQ );
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/** A file descriptor that is readable when the db may have changed
+ *
+ * Poll it, but do not read or close it, and then call
+ * Hosts_data_version to clear it and see whether there was a commit.
+ * It is readable within milliseconds of a commit by any process and
+ * costs nothing while there is none.  It stays open until Hosts_close.
+ * Returns -1 if the db cannot be watched.
  */
 int
-Hosts_add_host( char *hostname, char *address ) {
-    int result = 0;
-    sqlite3      *db = NULL;
-    sqlite3_stmt *stmt = NULL;
+Hosts_watch( Hosts_handle *h ) {
+    const char *dbfile;
+    int result;
 
-    if ( sqlite3_open(HOSTSDB, &db) != SQLITE_OK ) goto close;
-    if ( sqlite3_prepare(db, insertion, strlen(insertion), &stmt, NULL) != SQLITE_OK ) {
-        goto close;
+    pthread_mutex_lock( &h->lock );
+    if ( h->watch.fd < 0 ) {
+        dbfile = sqlite3_db_filename( h->db, "main" );
+        if ( dbfile == NULL || watch_open(&h->watch, dbfile) < 0 ) {
+            if ( debug ) fprintf( stderr, "could not watch db\n" );
+        }
+    }
+    result = h->watch.fd;
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/** The data_version of the db, and clear the watch
+ *
+ * It is different after any commit made through another connection,
+ * not through this handle.  Returns -1 if it could not be read.
+ */
+int64_t
+Hosts_data_version( Hosts_handle *h ) {
+    int64_t result;
+
+    pthread_mutex_lock( &h->lock );
+    if ( h->watch.fd >= 0 ) watch_changed( &h->watch );
+    result = Hosts_scalar( h, HANDLE_DATA_VERSION );
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/** Visit every change to the host table after seq since, oldest first
+ *
+ * Returns the number of changes visited, -1, or HOSTS_RESCAN when
+ * changes after since have been compacted away and the mirror has to
+ * read the whole table again.  The journal is read in one transaction
+ * unless the handle already has one open.
+ */
+int
+Hosts_changes( Hosts_handle *h, int64_t since, Hosts_change_visitor visit, void *arg ) {
+    sqlite3_stmt *stmt;
+    Hosts_change change;
+    int64_t horizon;
+    int result = -1;
+    int began = 0;
+    int status;
+
+    pthread_mutex_lock( &h->lock );
+    if ( (stmt = Hosts_statement(h, HANDLE_CHANGES)) == NULL ) goto unlock;
+    if ( sqlite3_stmt_busy(stmt) ) {
+        if ( debug ) fprintf( stderr, "changes called from a changes visitor\n" );
+        goto unlock;
     }
 
-    if ( sqlite3_bind_text(stmt, 1, hostname, -1, SQLITE_STATIC) != SQLITE_OK ) {
-        goto finalize;
+    if ( sqlite3_get_autocommit(h->db) ) {
+        if ( Hosts_exec(h, "BEGIN") < 0 ) goto unlock;
+        began = 1;
     }
-    if ( sqlite3_bind_text(stmt, 2, address, -1, SQLITE_STATIC) != SQLITE_OK ) {
-        goto finalize;
+
+    if ( (horizon = Hosts_scalar(h, HANDLE_CHANGE_HORIZON)) < 0 ) goto done;
+    if ( since < horizon ) {
+        if ( debug ) fprintf( stderr, "changes up to %lld have been compacted\n", (long long)horizon );
+        result = HOSTS_RESCAN;
+        goto done;
     }
 
-finalize:
-    sqlite3_finalize( stmt );
-close:
-    sqlite3_close( db );
-    return result;
+    if ( sqlite3_bind_int64(stmt, 1, since) != SQLITE_OK ) goto done;
+    result = 0;
+    while ( (status = sqlite3_step(stmt)) == SQLITE_ROW ) {
+        result++;
+        if ( visit == NULL ) continue;
+        change.seq = sqlite3_column_int64( stmt, 0 );
+        change.op = (const char *)sqlite3_column_text( stmt, 1 );
+        change.time = (const char *)sqlite3_column_text( stmt, 2 );
+        change.old_hostname = (const char *)sqlite3_column_text( stmt, 3 );
+        change.old_address = (const char *)sqlite3_column_text( stmt, 4 );
+        change.old_zone = (const char *)sqlite3_column_text( stmt, 5 );
+        change.new_hostname = (const char *)sqlite3_column_text( stmt, 6 );
+        change.new_address = (const char *)sqlite3_column_text( stmt, 7 );
+        change.new_zone = (const char *)sqlite3_column_text( stmt, 8 );
+        change.origin = (const char *)sqlite3_column_text( stmt, 9 );
+        change.new_expires = sqlite3_column_int64( stmt, 10 );
+        if ( visit(arg, &change) != 0 ) {
+            status = SQLITE_DONE;
+            break;
+        }
+    }
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
+
+    if ( status != SQLITE_DONE ) {
+        if ( debug ) fprintf( stderr, "query failed: %s\n", sqlite3_errmsg(h->db) );
+        result = -1;
+    }
+
+done:
+    if ( began ) Hosts_exec( h, "COMMIT" );
+unlock:
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/** Drop the changes up to and including seq upto from the journal
+ *
+ * Call it with the oldest seq every mirror has applied.  Returns the
+ * number of changes dropped, or -1.
+ */
+int
+Hosts_compact( Hosts_handle *h, int64_t upto ) {
+    sqlite3_stmt *stmt;
+    int result = -1;
+    int status;
+
+    pthread_mutex_lock( &h->lock );
+    if ( (stmt = Hosts_statement(h, HANDLE_COMPACT)) == NULL ) goto unlock;
+
+    if ( sqlite3_bind_int64(stmt, 1, upto) != SQLITE_OK ) {
+        status = SQLITE_ERROR;
+    } else {
+        status = sqlite3_step( stmt );
+    }
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
+
+    if ( status == SQLITE_DONE ) {
+        result = sqlite3_changes( h->db );
+        if ( debug ) fprintf( stderr, "%d changes compacted\n", result );
+    } else {
+        if ( debug ) fprintf( stderr, "failed to compact (step = %d)\n", status );
+    }
+
+unlock:
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/** Delete the hosts that have expired, batch rows at a time
+ *
+ * They are found from by_expires.  Each batch is its own transaction
+ * (unless the caller has one open) and the handle is unlocked between
+ * them, so a large sweep does not hold off writers or other threads.
+ * The deletes are journaled like any other.  Returns the number of
+ * rows deleted, or -1.
+ */
+int
+Hosts_expire( Hosts_handle *h, int batch ) {
+    int64_t now = time( NULL );
+    sqlite3_stmt *stmt;
+    int result = 0;
+    int status, deleted;
+
+    if ( batch < 1 ) batch = 1000;
+
+    do {
+        pthread_mutex_lock( &h->lock );
+        if ( (stmt = Hosts_statement(h, HANDLE_EXPIRE)) == NULL ) {
+            status = SQLITE_ERROR;
+        } else if ( sqlite3_bind_int64(stmt, 1, now) != SQLITE_OK ||
+                    sqlite3_bind_int(stmt, 2, batch) != SQLITE_OK ) {
+            status = SQLITE_ERROR;
+        } else {
+            status = sqlite3_step( stmt );
+        }
+        if ( stmt != NULL ) {
+            sqlite3_reset( stmt );
+            sqlite3_clear_bindings( stmt );
+        }
+        deleted = (status == SQLITE_DONE) ? sqlite3_changes( h->db ) : 0;
+        pthread_mutex_unlock( &h->lock );
+
+        if ( status != SQLITE_DONE ) {
+            if ( debug ) fprintf( stderr, "failed to expire hosts (step = %d)\n", status );
+            return -1;
+        }
+        result += deleted;
+    } while ( deleted == batch );
+
+    if ( debug ) fprintf( stderr, "%d hosts expired\n", result );
+    return result;
+}
+
+/*
+ * Replication
+ *
+ * A peer pulls the changes another has journaled since it last pulled,
+ * over any stream: a pipe, a Unix socket or a socketpair.  Lines are
+ * tab separated fields:
+ *
+ *   puller  HELLO <uuid>
+ *   server  HELLO <uuid> <seq>              or ERROR <why>
+ *   puller  PULL <since>
+ *   server  [RESCAN]
+ *           CHANGE <seq> <op> <time> <origin> <old hostname> <old address>
+ *                  <old zone> <new hostname> <new address> <new zone>
+ *                  <new expires>
+ *           ...
+ *           END <seq>
+ *
+ * Each end must know itself as the self node and the other as a peer.
+ * Backslash, tab and newline in a field are escaped, and \N is NULL.
+ * new expires is seconds since the epoch, \N for never; a peer from
+ * before it was added sends one field less, and its rows never expire.
+ * RESCAN means the changes asked for have been compacted, and every
+ * row follows as an insert.  A row whose last change came from the
+ * server but that it no longer has is then deleted, once the END has
+ * been read, as if the delete had been pulled.
+ *
+ * The puller applies SYNC_BATCH changes per transaction, with the seq
+ * it has reached, so an interrupted pull starts again where it left
+ * off.  Of two changes to one hostname and address the newest wins,
+ * by the time the change was first made; a change that comes back to
+ * the node it was made on, or that changes nothing, is skipped, so
+ * changes do not circulate between peers pulling from each other.
+ */
+
+#define SYNC_FIELDS 12
+#define SYNC_BATCH  1000
+
+/**
+ */
+static void
+sync_send( FILE *out, const char **fields, int count ) {
+    const char *c;
+    int i;
+
+    for ( i = 0 ; i < count ; i++ ) {
+        if ( i > 0 ) fputc( '\t', out );
+        if ( fields[i] == NULL ) {
+            fputs( "\\N", out );
+            continue;
+        }
+        for ( c = fields[i] ; *c != '\0' ; c++ ) {
+            switch ( *c ) {
+            case '\\': fputs( "\\\\", out ); break;
+            case '\t': fputs( "\\t", out ); break;
+            case '\n': fputs( "\\n", out ); break;
+            default:   fputc( *c, out ); break;
+            }
+        }
+    }
+    fputc( '\n', out );
+}
+
+/**
+ */
+static void
+sync_error( FILE *out, const char *why ) {
+    const char *fields[] = { "ERROR", why };
+
+    if ( debug ) fprintf( stderr, "sync: %s\n", why );
+    sync_send( out, fields, 2 );
+    fflush( out );
+}
+
+/** Split a line into at most max fields, in place
+ *
+ * Returns the number of fields.
+ */
+static int
+sync_parse( char *line, char **fields, int max ) {
+    int count = 0;
+    char *in, *out;
+
+    line[strcspn(line, "\n")] = '\0';
+    while ( count < max ) {
+        int null = line[0] == '\\' && line[1] == 'N' && (line[2] == '\0' || line[2] == '\t');
+        int last;
+
+        for ( in = out = line ; *in != '\0' && *in != '\t' ; in++ ) {
+            if ( *in == '\\' && in[1] != '\0' ) {
+                in++;
+                *out++ = (*in == 't') ? '\t' : (*in == 'n') ? '\n' : *in;
+            } else {
+                *out++ = *in;
+            }
+        }
+        last = (*in == '\0');
+        *out = '\0';
+        fields[count++] = null ? NULL : line;
+        if ( last ) break;
+        line = in + 1;
+    }
+    return count;
+}
+
+/**
+ * Called with the handle locked.
+ */
+static sqlite3_stmt *
+Hosts_bind_text( Hosts_handle *h, int which, const char **values, int count ) {
+    sqlite3_stmt *stmt;
+    int i;
+
+    if ( (stmt = Hosts_statement(h, which)) == NULL ) return NULL;
+    for ( i = 0 ; i < count ; i++ ) {
+        if ( sqlite3_bind_text(stmt, i + 1, values[i], -1, SQLITE_STATIC) != SQLITE_OK ) {
+            sqlite3_clear_bindings( stmt );
+            return NULL;
+        }
+    }
+    return stmt;
+}
+
+/**
+ * Called with the handle locked.
+ */
+static int
+Hosts_finish( sqlite3_stmt *stmt, int status ) {
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
+    return status;
+}
+
+/** The uuid of this node
+ */
+static int
+sync_self( Hosts_handle *h, char *uuid, size_t size ) {
+    sqlite3_stmt *stmt;
+    int result = -1;
+
+    if ( (stmt = Hosts_statement(h, HANDLE_SELF)) == NULL ) return -1;
+    if ( sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_text(stmt, 0) != NULL ) {
+        snprintf( uuid, size, "%s", (const char *)sqlite3_column_text(stmt, 0) );
+        result = 0;
+    }
+    return Hosts_finish( stmt, result );
+}
+
+/** The seq pulled from a peer so far, or -1 if it is not a peer
+ */
+static int64_t
+sync_peer( Hosts_handle *h, const char *uuid ) {
+    sqlite3_stmt *stmt;
+    int64_t result = -1;
+
+    if ( (stmt = Hosts_bind_text(h, HANDLE_PEER, &uuid, 1)) == NULL ) return -1;
+    if ( sqlite3_step(stmt) == SQLITE_ROW ) result = sqlite3_column_int64( stmt, 0 );
+    Hosts_finish( stmt, 0 );
+    return result;
+}
+
+/**
+ */
+static int
+sync_synced( Hosts_handle *h, const char *uuid, int64_t seq ) {
+    sqlite3_stmt *stmt;
+
+    if ( (stmt = Hosts_bind_text(h, HANDLE_SYNCED, &uuid, 1)) == NULL ) return -1;
+    if ( sqlite3_bind_int64(stmt, 2, seq) != SQLITE_OK ) return Hosts_finish( stmt, -1 );
+    return Hosts_finish( stmt, sqlite3_step(stmt) == SQLITE_DONE ? 0 : -1 );
+}
+
+/** Has the row changed here since time?
+ *
+ * Times are compared as seconds since the epoch, since the journal
+ * keeps milliseconds and ctime and mtime do not.
+ */
+static int
+sync_newer( Hosts_handle *h, const char *hostname, const char *address, const char *time ) {
+    const char *key[] = { hostname, address, time };
+    sqlite3_stmt *stmt;
+    int newer = 0;
+
+    if ( (stmt = Hosts_bind_text(h, HANDLE_LATEST, key, 3)) == NULL ) return -1;
+    if ( sqlite3_step(stmt) == SQLITE_ROW ) newer = sqlite3_column_int( stmt, 0 );
+    return Hosts_finish( stmt, newer );
+}
+
+/** Apply a pulled insert, returns 1 if it changed the table
+ */
+static int
+sync_put( Hosts_handle *h, char *hostname, char *address, char *zone,
+          int64_t expires, const char *time )
+{
+    const char *row[] = { hostname, address, zone };
+    sqlite3_stmt *stmt;
+    struct address a;
+    int same;
+
+    if ( hostname == NULL || address == NULL ) return 0;
+    if ( (stmt = Hosts_bind_text(h, HANDLE_SAME, row, 3)) == NULL ) return -1;
+    if ( expires > 0 && sqlite3_bind_int64(stmt, 4, expires) != SQLITE_OK ) {
+        return Hosts_finish( stmt, -1 );
+    }
+    same = Hosts_finish( stmt, sqlite3_step(stmt) == SQLITE_ROW );
+    if ( same ) return 0;
+
+    switch ( sync_newer(h, hostname, address, time) ) {
+    case -1: return -1;
+    case 1:
+        if ( debug ) fprintf( stderr, "sync: kept newer %s %s\n", hostname, address );
+        return 0;
+    }
+
+    if ( Hosts_address(&a, address) < 0 ) return 0;
+    if ( Hosts_insert(h, hostname, &a, zone, expires) < 0 ) return -1;
+    return 1;
+}
+
+/** Apply a pulled delete, returns 1 if it changed the table
+ */
+static int
+sync_remove( Hosts_handle *h, char *hostname, char *address, const char *time ) {
+    const char *key[] = { hostname, address };
+    sqlite3_stmt *stmt;
+    int status;
+
+    if ( hostname == NULL || address == NULL ) return 0;
+    switch ( sync_newer(h, hostname, address, time) ) {
+    case -1: return -1;
+    case 1:
+        if ( debug ) fprintf( stderr, "sync: kept newer %s %s\n", hostname, address );
+        return 0;
+    }
+
+    if ( (stmt = Hosts_bind_text(h, HANDLE_REMOVE, key, 2)) == NULL ) return -1;
+    status = Hosts_finish( stmt, sqlite3_step(stmt) );
+    if ( status != SQLITE_DONE ) return -1;
+    return sqlite3_changes( h->db ) > 0;
+}
+
+/** Apply one CHANGE line of count fields
+ *
+ * What it journals here is stamped with the origin and time of the
+ * change, so it is passed on as the same change.  Returns 1 if it
+ * changed the table, 0 if it was skipped, or -1.
+ */
+static int
+sync_apply( Hosts_handle *h, char **f, int count, const char *self, const char *server ) {
+    const char *origin = f[4] ? f[4] : server;
+    const char *stamp[] = { origin, f[3] };
+    int64_t expires = (count > 11 && f[11] != NULL) ? strtoll( f[11], NULL, 10 ) : 0;
+    sqlite3_stmt *stmt;
+    int64_t before;
+    int applied = 0, result;
+
+    if ( f[2] == NULL ) return -1;
+    if ( strcasecmp(origin, self) == 0 ) return 0;
+    if ( (before = Hosts_scalar(h, HANDLE_CHANGE_SEQ)) < 0 ) return -1;
+
+    if ( strcmp(f[2], "delete") == 0 || strcmp(f[2], "update") == 0 ) {
+        if ( (result = sync_remove(h, f[5], f[6], f[3])) < 0 ) return -1;
+        applied += result;
+    }
+    if ( strcmp(f[2], "insert") == 0 || strcmp(f[2], "update") == 0 ) {
+        if ( (result = sync_put(h, f[8], f[9], f[10], expires, f[3])) < 0 ) return -1;
+        applied += result;
+    }
+    if ( applied == 0 ) return 0;
+
+    if ( (stmt = Hosts_bind_text(h, HANDLE_STAMP, stamp, 2)) == NULL ) return -1;
+    if ( sqlite3_bind_int64(stmt, 3, before) != SQLITE_OK ) return Hosts_finish( stmt, -1 );
+    if ( Hosts_finish(stmt, sqlite3_step(stmt)) != SQLITE_DONE ) return -1;
+    return 1;
+}
+
+/** Note a row a rescan has sent
+ */
+static int
+sync_sent( Hosts_handle *h, char **f ) {
+    const char *key[] = { f[8], f[9] };
+    sqlite3_stmt *stmt;
+
+    if ( f[8] == NULL || f[9] == NULL ) return 0;
+    if ( (stmt = Hosts_bind_text(h, HANDLE_SENT, key, 2)) == NULL ) return -1;
+    return Hosts_finish( stmt, sqlite3_step(stmt) == SQLITE_DONE ? 0 : -1 );
+}
+
+/** Delete what a rescan did not send, of the rows last changed by it
+ *
+ * The deletes are journaled as the server's, so they are not sent
+ * back to it.  Returns the number of rows deleted, or -1.
+ */
+static int
+sync_unsent( Hosts_handle *h, const char *server ) {
+    sqlite3_stmt *stmt;
+    int64_t before;
+    int deleted;
+
+    if ( (before = Hosts_scalar(h, HANDLE_CHANGE_SEQ)) < 0 ) return -1;
+    if ( (stmt = Hosts_bind_text(h, HANDLE_UNSENT, &server, 1)) == NULL ) return -1;
+    if ( Hosts_finish(stmt, sqlite3_step(stmt)) != SQLITE_DONE ) return -1;
+    if ( (deleted = sqlite3_changes(h->db)) == 0 ) return 0;
+
+    if ( (stmt = Hosts_bind_text(h, HANDLE_ORIGIN, &server, 1)) == NULL ) return -1;
+    if ( sqlite3_bind_int64(stmt, 2, before) != SQLITE_OK ) return Hosts_finish( stmt, -1 );
+    if ( Hosts_finish(stmt, sqlite3_step(stmt)) != SQLITE_DONE ) return -1;
+    return deleted;
+}
+
+/*
+ * Where a server sends changes to.
+ */
+struct sync_server {
+    FILE *out;
+    const char *self;
+    const char *peer;
+    int64_t last;
+    int sent;
+};
+
+/**
+ */
+static int
+sync_send_change( void *arg, const Hosts_change *c ) {
+    struct sync_server *s = (struct sync_server *)arg;
+    const char *origin = c->origin ? c->origin : s->self;
+    char seq[24], expires[24];
+    const char *fields[SYNC_FIELDS] = {
+        "CHANGE", seq, c->op, c->time, origin,
+        c->old_hostname, c->old_address, c->old_zone,
+        c->new_hostname, c->new_address, c->new_zone,
+        c->new_expires > 0 ? expires : NULL
+    };
+
+    s->last = c->seq;
+    if ( strcasecmp(origin, s->peer) == 0 ) return 0;
+    snprintf( seq, sizeof(seq), "%lld", (long long)c->seq );
+    snprintf( expires, sizeof(expires), "%lld", (long long)c->new_expires );
+    sync_send( s->out, fields, SYNC_FIELDS );
+    s->sent++;
+    return ferror( s->out ) ? 1 : 0;
+}
+
+/** Send every row as an insert, for a peer that has to start over
+ *
+ * Called with the handle locked.
+ */
+static int
+sync_dump( Hosts_handle *h, struct sync_server *s, int64_t seq ) {
+    sqlite3_stmt *stmt;
+    char text[24];
+    int status;
+
+    if ( (stmt = Hosts_statement(h, HANDLE_DUMP)) == NULL ) return -1;
+    snprintf( text, sizeof(text), "%lld", (long long)seq );
+    while ( (status = sqlite3_step(stmt)) == SQLITE_ROW ) {
+        const char *fields[SYNC_FIELDS] = {
+            "CHANGE", text, "insert", (const char *)sqlite3_column_text(stmt, 3), s->self,
+            NULL, NULL, NULL,
+            (const char *)sqlite3_column_text(stmt, 0),
+            (const char *)sqlite3_column_text(stmt, 1),
+            (const char *)sqlite3_column_text(stmt, 2),
+            (const char *)sqlite3_column_text(stmt, 4)
+        };
+        sync_send( s->out, fields, SYNC_FIELDS );
+        s->sent++;
+    }
+    return Hosts_finish( stmt, status == SQLITE_DONE ? 0 : -1 );
+}
+
+/** Open both ends of the stream
+ */
+static int
+sync_streams( int in, int out, FILE **r, FILE **w ) {
+    int fd;
+
+    *r = *w = NULL;
+    if ( (fd = dup(in)) < 0 ) return -1;
+    if ( (*r = fdopen(fd, "r")) == NULL ) {
+        close( fd );
+        return -1;
+    }
+    if ( (fd = dup(out)) < 0 ) return -1;
+    if ( (*w = fdopen(fd, "w")) == NULL ) {
+        close( fd );
+        return -1;
+    }
+    return 0;
+}
+
+/** Serve one peer pulling from this db
+ *
+ * Returns the number of changes sent, or -1.
+ */
+int
+Hosts_sync_serve( Hosts_handle *h, int in, int out ) {
+    struct sync_server s = { 0 };
+    char self[256], peer[256], latest[24];
+    char *fields[3], *line = NULL;
+    const char *hello[3] = { "HELLO", self, latest };
+    const char *end[2] = { "END", latest };
+    size_t size = 0;
+    FILE *r, *w;
+    int64_t since, seq;
+    int count, result = -1;
+
+    if ( sync_streams(in, out, &r, &w) < 0 ) goto close;
+    pthread_mutex_lock( &h->lock );
+
+    if ( getline(&line, &size, r) < 0 ) goto unlock;
+    if ( sync_parse(line, fields, 2) != 2 || fields[0] == NULL ||
+         strcmp(fields[0], "HELLO") != 0 || fields[1] == NULL ) {
+        sync_error( w, "expected HELLO" );
+        goto unlock;
+    }
+    snprintf( peer, sizeof(peer), "%s", fields[1] );
+    if ( sync_self(h, self, sizeof(self)) < 0 ) {
+        sync_error( w, "no self node" );
+        goto unlock;
+    }
+    if ( sync_peer(h, peer) < 0 ) {
+        sync_error( w, "not a peer" );
+        goto unlock;
+    }
+    if ( (seq = Hosts_scalar(h, HANDLE_CHANGE_SEQ)) < 0 ) goto unlock;
+    snprintf( latest, sizeof(latest), "%lld", (long long)seq );
+    sync_send( w, hello, 3 );
+    fflush( w );
+
+    if ( getline(&line, &size, r) < 0 ) goto unlock;
+    if ( sync_parse(line, fields, 2) != 2 || fields[0] == NULL ||
+         strcmp(fields[0], "PULL") != 0 || fields[1] == NULL ) {
+        sync_error( w, "expected PULL" );
+        goto unlock;
+    }
+    since = strtoll( fields[1], NULL, 10 );
+    if ( debug ) fprintf( stderr, "sync: %s pulls since %lld\n", peer, (long long)since );
+
+    s.out = w;
+    s.self = self;
+    s.peer = peer;
+    s.last = seq;
+
+    /* a peer ahead of us is pulling from a db that has been replaced */
+    count = (since > seq) ? HOSTS_RESCAN : Hosts_changes( h, since, sync_send_change, &s );
+    if ( count == HOSTS_RESCAN ) {
+        const char *rescan[1] = { "RESCAN" };
+        sync_send( w, rescan, 1 );
+        s.last = seq;
+        if ( sync_dump(h, &s, seq) < 0 ) goto unlock;
+    } else if ( count < 0 ) {
+        goto unlock;
+    }
+
+    if ( s.last < seq ) s.last = seq;
+    snprintf( latest, sizeof(latest), "%lld", (long long)s.last );
+    sync_send( w, end, 2 );
+    if ( fflush(w) != 0 || ferror(w) ) goto unlock;
+    result = s.sent;
+
+unlock:
+    pthread_mutex_unlock( &h->lock );
+close:
+    free( line );
+    if ( r != NULL ) fclose( r );
+    if ( w != NULL ) fclose( w );
+    return result;
+}
+
+/** Pull the changes a peer has made since the last pull
+ *
+ * The handle must not have a transaction open.  Returns the number of
+ * changes that were applied, or -1.
+ */
+int
+Hosts_sync_pull( Hosts_handle *h, int in, int out ) {
+    char self[256], server[256], since[24];
+    char *fields[SYNC_FIELDS], *line = NULL;
+    const char *hello[2] = { "HELLO", self };
+    const char *pull[2] = { "PULL", since };
+    size_t size = 0;
+    FILE *r, *w;
+    int64_t synced, last = 0;
+    int rescan = 0, batch = 0, applied = 0, result = -1;
+    int n, changed;
+
+    if ( sync_streams(in, out, &r, &w) < 0 ) goto close;
+    pthread_mutex_lock( &h->lock );
+
+    if ( sync_self(h, self, sizeof(self)) < 0 ) {
+        if ( debug ) fprintf( stderr, "sync: no self node\n" );
+        goto unlock;
+    }
+    sync_send( w, hello, 2 );
+    fflush( w );
+
+    if ( getline(&line, &size, r) < 0 ) goto unlock;
+    n = sync_parse( line, fields, 3 );
+    if ( n < 2 || fields[0] == NULL || strcmp(fields[0], "HELLO") != 0 || fields[1] == NULL ) {
+        if ( debug ) fprintf( stderr, "sync: refused: %s\n", n > 1 && fields[1] ? fields[1] : "" );
+        goto unlock;
+    }
+    snprintf( server, sizeof(server), "%s", fields[1] );
+    if ( (synced = sync_peer(h, server)) < 0 ) {
+        if ( debug ) fprintf( stderr, "sync: %s is not a peer\n", server );
+        goto unlock;
+    }
+    snprintf( since, sizeof(since), "%lld", (long long)synced );
+    sync_send( w, pull, 2 );
+    fflush( w );
+
+    if ( Hosts_exec(h, "BEGIN IMMEDIATE") < 0 ) goto unlock;
+    while ( getline(&line, &size, r) >= 0 ) {
+        n = sync_parse( line, fields, SYNC_FIELDS );
+
+        if ( n < 1 || fields[0] == NULL ) {
+            if ( debug ) fprintf( stderr, "sync: unexpected line\n" );
+            break;
+        }
+
+        if ( strcmp(fields[0], "RESCAN") == 0 ) {
+            if ( debug ) fprintf( stderr, "sync: %s sends every row\n", server );
+            if ( Hosts_exec(h, "CREATE TEMP TABLE IF NOT EXISTS sync_sent"
+                               " (hostname STRING COLLATE NOCASE, address STRING COLLATE NOCASE,"
+                               "  PRIMARY KEY (hostname, address))") < 0 ) break;
+            if ( Hosts_exec(h, "DELETE FROM temp.sync_sent") < 0 ) break;
+            rescan = 1;
+            continue;
+        }
+
+        if ( strcmp(fields[0], "END") == 0 && n == 2 && fields[1] != NULL ) {
+            if ( rescan ) {
+                if ( (changed = sync_unsent(h, server)) < 0 ) break;
+                applied += changed;
+            }
+            if ( sync_synced(h, server, strtoll(fields[1], NULL, 10)) < 0 ) break;
+            if ( Hosts_exec(h, "COMMIT") < 0 ) break;
+            result = applied;
+            break;
+        }
+
+        if ( strcmp(fields[0], "CHANGE") != 0 || n < SYNC_FIELDS - 1 || fields[1] == NULL ) {
+            if ( debug ) fprintf( stderr, "sync: unexpected %s\n", fields[0] );
+            break;
+        }
+        if ( (changed = sync_apply(h, fields, n, self, server)) < 0 ) break;
+        if ( rescan && sync_sent(h, fields) < 0 ) break;
+        applied += changed;
+        last = strtoll( fields[1], NULL, 10 );
+
+        if ( ++batch == SYNC_BATCH ) {
+            /* a rescan is only complete at the end */
+            if ( rescan == 0 && sync_synced(h, server, last) < 0 ) break;
+            if ( Hosts_exec(h, "COMMIT") < 0 ) break;
+            if ( Hosts_exec(h, "BEGIN IMMEDIATE") < 0 ) goto unlock;
+            batch = 0;
+        }
+    }
+    if ( result < 0 ) Hosts_exec( h, "ROLLBACK" );
+    if ( debug ) fprintf( stderr, "sync: %d changes applied from %s\n", applied, server );
+
+unlock:
+    pthread_mutex_unlock( &h->lock );
+close:
+    free( line );
+    if ( r != NULL ) fclose( r );
+    if ( w != NULL ) fclose( w );
+    return result;
+}
+
+/**
+ */
+int
+Hosts_add_zoned_host( char *hostname, char *address, char *zone ) {
+    Hosts_handle *h;
+    int result;
+
+    if ( (h = Hosts_open(NULL)) == NULL ) return -1;
+    result = Hosts_add( h, hostname, address, zone );
+    Hosts_close( h );
+    return result;
+}
+
+/**
+ */
+int
+Hosts_del_zoned_host( char *hostname, char *address, char *zone ) {
+    Hosts_handle *h;
+    int result;
+
+    if ( (h = Hosts_open(NULL)) == NULL ) return -1;
+    result = Hosts_delete( h, hostname, address, zone ) < 0 ? -1 : 0;
+    Hosts_close( h );
+    return result;
+}
+
+/**
+ */
+int
+Hosts_add_host( char *hostname, char *address ) {
+    return Hosts_add_zoned_host( hostname, address, NULL );
+}
+
+/*
+ * Rows are committed every IMPORT_BATCH inserts, so a large import
+ * writes the journal a few times rather than once per host.
+ */
+#define IMPORT_BATCH 10000
+
+/**
+ * Called with the handle locked.
+ */
+static int
+Hosts_import_row( Hosts_handle *h, char *hostname, char *address, char *zone ) {
+    struct address a;
+    char *percent;
+
+    /* link-local addresses may carry their zone as fe80::1%eth0 */
+    if ( (percent = strchr(address, '%')) != NULL ) {
+        *percent = '\0';
+        if ( zone == NULL ) zone = percent + 1;
+    }
+
+    if ( Hosts_address(&a, address) < 0 ) return -1;
+    return Hosts_insert( h, hostname, &a, zone, 0 );
+}
+
+/** Load hosts from a stream
+ *
+ * Lines are either /etc/hosts format ("address name [alias...]") or
+ * "name address [zone]".  Comments and blank lines are skipped, lines
+ * that do not parse are counted and skipped.  Rows go through the
+ * handle's insert statement and are committed in batches.
+ *
+ * With replace the table is emptied and reloaded in one transaction,
+ * so readers see either the old contents or the new ones.  If the
+ * caller already has a transaction open on the handle the rows are
+ * added to it and left for the caller to commit.
+ *
+ * Returns the number of rows added, or -1.  The number of lines that
+ * were skipped is returned in rejected if it is not NULL.
+ */
+int
+Hosts_import( Hosts_handle *h, FILE *in, int replace, int *rejected ) {
+    int result = -1;
+    char line[4096];
+    int added = 0, pending = 0, bad = 0, number = 0;
+    int own;
+
+    pthread_mutex_lock( &h->lock );
+    own = sqlite3_get_autocommit( h->db );
+
+    if ( own && Hosts_exec(h, "BEGIN IMMEDIATE") < 0 ) goto unlock;
+    if ( replace ) {
+        if ( Hosts_exec(h, "DELETE FROM host") < 0 ) goto rollback;
+    }
+
+    while ( fgets(line, sizeof(line), in) != NULL ) {
+        char *token[64];
+        char *comment, *save = NULL;
+        struct in6_addr scratch;
+        int ntokens = 0, rows = 0, i;
+
+        number++;
+        if ( (comment = strchr(line, '#')) != NULL ) *comment = '\0';
+
+        for ( token[0] = strtok_r(line, " \t\r\n", &save) ;
+              token[ntokens] != NULL && ntokens < 63 ;
+              token[ntokens] = strtok_r(NULL, " \t\r\n", &save) ) {
+            ntokens++;
+        }
+        if ( ntokens == 0 ) continue;
+        if ( ntokens < 2 ) goto reject;
+
+        if ( strchr(token[0], '%') == NULL &&
+             hosts_parse_address(token[0], &scratch) == 0 ) {
+            /* name address [zone] */
+            if ( ntokens > 3 ) goto reject;
+            if ( Hosts_import_row(h, token[0], token[1], ntokens > 2 ? token[2] : NULL) < 0 ) {
+                goto reject;
+            }
+            rows = 1;
+        } else {
+            /* address name [alias...] */
+            for ( i = 1 ; i < ntokens ; i++ ) {
+                char address[INET6_ADDRSTRLEN + IF_NAMESIZE];
+                snprintf( address, sizeof(address), "%s", token[0] );
+                if ( Hosts_import_row(h, token[i], address, NULL) < 0 ) goto reject;
+                rows++;
+            }
+        }
+
+        added += rows;
+        pending += rows;
+        if ( pending >= IMPORT_BATCH && own && replace == 0 ) {
+            if ( Hosts_exec(h, "COMMIT") < 0 ) goto rollback;
+            if ( Hosts_exec(h, "BEGIN IMMEDIATE") < 0 ) goto unlock;
+            pending = 0;
+        }
+        continue;
+
+    reject:
+        if ( debug ) fprintf( stderr, "line %d rejected\n", number );
+        added += rows;
+        pending += rows;
+        bad++;
+    }
+
+    if ( ferror(in) ) goto rollback;
+    if ( own && Hosts_exec(h, "COMMIT") < 0 ) goto rollback;
+    if ( debug ) fprintf( stderr, "%d hosts added, %d lines rejected\n", added, bad );
+    if ( rejected != NULL ) *rejected = bad;
+    result = added;
+    goto unlock;
+
+rollback:
+    if ( own ) Hosts_exec( h, "ROLLBACK" );
+unlock:
+    pthread_mutex_unlock( &h->lock );
+    return result;
+}
+
+/*
+ * SQL functions used to convert text addresses and names while
+ * migrating, and by the batch lookups.  Every connection the library
+ * opens has them.
+ */
+static void
+sql_inet_family( sqlite3_context *context, int argc, sqlite3_value **argv ) {
+    struct in6_addr addr;
+    int family = hosts_parse_address( (const char *)sqlite3_value_text(argv[0]), &addr );
+
+    if ( family == 0 ) {
+        sqlite3_result_null( context );
+    } else {
+        sqlite3_result_int( context, family );
+    }
+}
+
+static void
+sql_inet_addr( sqlite3_context *context, int argc, sqlite3_value **argv ) {
+    struct in6_addr addr;
+    int family = hosts_parse_address( (const char *)sqlite3_value_text(argv[0]), &addr );
+
+    if ( family == 0 ) {
+        sqlite3_result_null( context );
+    } else {
+        sqlite3_result_blob( context, &addr, hosts_address_length(family), SQLITE_TRANSIENT );
+    }
+}
+
+static void
+sql_reverse_labels( sqlite3_context *context, int argc, sqlite3_value **argv ) {
+    const char *name = (const char *)sqlite3_value_text( argv[0] );
+    char rname[NI_MAXHOST];
+
+    if ( name == NULL || hosts_reverse_labels(name, rname, sizeof(rname)) < 0 ) {
+        sqlite3_result_null( context );
+    } else {
+        sqlite3_result_text( context, rname, -1, SQLITE_TRANSIENT );
+    }
+}
+
+static void
+sql_name_key( sqlite3_context *context, int argc, sqlite3_value **argv ) {
+    const char *name = (const char *)sqlite3_value_text( argv[0] );
+    char key[NI_MAXHOST];
+
+    if ( name == NULL || hosts_name_key(name, key, sizeof(key)) < 0 ) {
+        sqlite3_result_null( context );
+    } else {
+        sqlite3_result_text( context, key, -1, SQLITE_TRANSIENT );
+    }
+}
+
+static void
+sql_name_hash( sqlite3_context *context, int argc, sqlite3_value **argv ) {
+    const char *key = (const char *)sqlite3_value_text( argv[0] );
+
+    if ( key == NULL ) {
+        sqlite3_result_null( context );
+    } else {
+        sqlite3_result_int64( context, hosts_name_hash(key) );
+    }
+}
+
+static void
+sql_inet_text( sqlite3_context *context, int argc, sqlite3_value **argv ) {
+    struct in6_addr addr;
+    char text[INET6_ADDRSTRLEN];
+    int family = hosts_parse_address( (const char *)sqlite3_value_text(argv[0]), &addr );
+
+    if ( family == 0 ) {
+        sqlite3_result_value( context, argv[0] );
+    } else {
+        inet_ntop( family, &addr, text, sizeof(text) );
+        sqlite3_result_text( context, text, -1, SQLITE_TRANSIENT );
+    }
+}
+
+/**
+ */
+static void
+Hosts_functions( sqlite3 *db ) {
+    sqlite3_create_function( db, "inet_family", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                             NULL, sql_inet_family, NULL, NULL );
+    sqlite3_create_function( db, "inet_addr", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                             NULL, sql_inet_addr, NULL, NULL );
+    sqlite3_create_function( db, "inet_text", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                             NULL, sql_inet_text, NULL, NULL );
+    sqlite3_create_function( db, "reverse_labels", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                             NULL, sql_reverse_labels, NULL, NULL );
+    sqlite3_create_function( db, "name_key", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                             NULL, sql_name_key, NULL, NULL );
+    sqlite3_create_function( db, "name_hash", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                             NULL, sql_name_hash, NULL, NULL );
+}
+
+/*
+ * Version 2 stores addresses in binary.  The table is rebuilt because
+ * the unique constraint moves from the text address to addr.  Text
+ * variants of one address ("::1" and "0:0::1") collapse into the
+ * oldest row.
+ */
+static char *migrate_v2[] = {
+    "CREATE TABLE host_v2(      id INTEGER PRIMARY KEY,"
+    "                      address STRING COLLATE NOCASE,"
+    "                       family INTEGER,"
+    "                         addr BLOB,"
+    "                     hostname STRING COLLATE NOCASE,"
+    "                         zone STRING COLLATE NOCASE,"
+    "                        ctime DATE,"
+    "                        mtime DATE,"
+    "                 CONSTRAINT pairUnique UNIQUE (addr,hostname)"
+    "                  )",
+    "INSERT OR IGNORE INTO host_v2 (id,address,family,addr,hostname,zone,ctime,mtime)"
+    " SELECT id, inet_text(address), inet_family(address), inet_addr(address),"
+    "        hostname, zone, ctime, mtime FROM host ORDER BY id",
+    "DROP TABLE host",
+    "ALTER TABLE host_v2 RENAME TO host",
+    "CREATE INDEX by_name ON host(hostname,family,addr)",
+    "CREATE TRIGGER create_host AFTER INSERT ON host"
+    " BEGIN"
+    "     UPDATE host SET ctime = DATETIME('NOW') WHERE rowid = new.rowid;"
+    " END",
+    "CREATE TRIGGER touch_host AFTER UPDATE ON host"
+    " BEGIN"
+    "     UPDATE host SET mtime = DATETIME('NOW') WHERE rowid = new.rowid;"
+    " END",
+    NULL
+};
+
+/*
+ * Version 3 lets forward lookups read the zone, for scope ids and
+ * "name%zone", from the by_name index too.
+ */
+static char *migrate_v3[] = {
+    "DROP INDEX by_name",
+    "CREATE INDEX by_name ON host(hostname,family,addr,zone)",
+    NULL
+};
+
+/*
+ * Version 4 keeps the names of cluster nodes in node_name, as
+ * hosts.sql describes, and fills it from the tables as they are.
+ */
+static char *migrate_v4[] = {
+    "CREATE TABLE IF NOT EXISTS node(  id INTEGER PRIMARY KEY,"
+    "                                uuid STRING COLLATE NOCASE,"
+    "                              status STRING DEFAULT 'foreign',"
+    "                               ctime DATE,"
+    "                               mtime DATE,"
+    "                               CONSTRAINT uniqueUUID UNIQUE (uuid)"
+    "                                )",
+    "CREATE TABLE node_name( name STRING COLLATE NOCASE,"
+    "                      family INTEGER,"
+    "                        addr BLOB,"
+    "                        zone STRING COLLATE NOCASE,"
+    "                        node INTEGER,"
+    "                        host INTEGER"
+    "                      )",
+    "CREATE INDEX node_name_by_name ON node_name(name,family,addr,zone)",
+    "CREATE INDEX node_name_by_node ON node_name(node)",
+    "CREATE INDEX node_name_by_host ON node_name(host)",
+    "CREATE VIEW node_map AS"
+    "    SELECT n.uuid || '.node' AS name, h.family, h.addr, h.zone, n.id AS node, h.id AS host"
+    "      FROM node n JOIN host h ON h.hostname = n.uuid"
+    "    UNION ALL"
+    "    SELECT 'peer' || n.id, h.family, h.addr, h.zone, n.id, h.id"
+    "      FROM node n JOIN host h ON h.hostname = n.uuid"
+    "     WHERE n.status = 'peer'",
+    "CREATE TRIGGER name_host AFTER INSERT ON host"
+    " WHEN EXISTS (SELECT 1 FROM node WHERE uuid = new.hostname)"
+    " BEGIN"
+    "     DELETE FROM node_name WHERE host NOT IN (SELECT id FROM host)"
+    "        AND node IN (SELECT id FROM node WHERE uuid = new.hostname);"
+    "     INSERT INTO node_name SELECT * FROM node_map WHERE host = new.id;"
+    " END",
+    "CREATE TRIGGER rename_host AFTER UPDATE OF hostname, family, addr, zone ON host"
+    " BEGIN"
+    "     DELETE FROM node_name WHERE host = old.id;"
+    "     INSERT INTO node_name SELECT * FROM node_map WHERE host = new.id;"
+    " END",
+    "CREATE TRIGGER unname_host AFTER DELETE ON host"
+    " BEGIN"
+    "     DELETE FROM node_name WHERE host = old.id;"
+    " END",
+    "CREATE TRIGGER name_node AFTER INSERT ON node"
+    " BEGIN"
+    "     DELETE FROM node_name WHERE node NOT IN (SELECT id FROM node);"
+    "     INSERT INTO node_name SELECT * FROM node_map WHERE node = new.id;"
+    " END",
+    "CREATE TRIGGER rename_node AFTER UPDATE OF uuid, status ON node"
+    " BEGIN"
+    "     DELETE FROM node_name WHERE node = old.id;"
+    "     INSERT INTO node_name SELECT * FROM node_map WHERE node = new.id;"
+    " END",
+    "CREATE TRIGGER unname_node AFTER DELETE ON node"
+    " BEGIN"
+    "     DELETE FROM node_name WHERE node = old.id;"
+    " END",
+    "INSERT INTO node_name SELECT * FROM node_map",
+    NULL
+};
+
+/*
+ * Version 5 journals changes to host in host_change.  The journal
+ * starts empty, a mirror of an existing db starts from a full read.
+ */
+static char *migrate_v5[] = {
+    "CREATE TABLE host_change(  seq INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "                            op STRING,"
+    "                            id INTEGER,"
+    "                  old_hostname STRING,"
+    "                   old_address STRING,"
+    "                      old_zone STRING,"
+    "                  new_hostname STRING,"
+    "                   new_address STRING,"
+    "                      new_zone STRING,"
+    "                          time DATE"
+    "                         )",
+    "CREATE TRIGGER journal_insert_host AFTER INSERT ON host"
+    " BEGIN"
+    "     INSERT INTO host_change (op, id, new_hostname, new_address, new_zone, time)"
+    "     VALUES ('insert', new.id, new.hostname, new.address, new.zone,"
+    "             STRFTIME('%Y-%m-%d %H:%M:%f', 'NOW'));"
+    " END",
+    "CREATE TRIGGER journal_update_host AFTER UPDATE OF hostname, address, family, addr, zone ON host"
+    " BEGIN"
+    "     INSERT INTO host_change (op, id, old_hostname, old_address, old_zone,"
+    "                              new_hostname, new_address, new_zone, time)"
+    "     VALUES ('update', new.id, old.hostname, old.address, old.zone,"
+    "             new.hostname, new.address, new.zone, STRFTIME('%Y-%m-%d %H:%M:%f', 'NOW'));"
+    " END",
+    "CREATE TRIGGER journal_delete_host AFTER DELETE ON host"
+    " BEGIN"
+    "     INSERT INTO host_change (op, id, old_hostname, old_address, old_zone, time)"
+    "     VALUES ('delete', old.id, old.hostname, old.address, old.zone,"
+    "             STRFTIME('%Y-%m-%d %H:%M:%f', 'NOW'));"
+    " END",
+    NULL
+};
+
+/*
+ * Version 6 records where a pulled change came from, how far each
+ * peer has been pulled, and indexes the journal by row for conflicts.
+ */
+static char *migrate_v6[] = {
+    "ALTER TABLE host_change ADD COLUMN origin STRING",
+    "CREATE INDEX host_change_by_new ON host_change(new_hostname COLLATE NOCASE, new_address)",
+    "CREATE INDEX host_change_by_old ON host_change(old_hostname COLLATE NOCASE, old_address)",
+    "ALTER TABLE node ADD COLUMN synced INTEGER DEFAULT 0",
+    NULL
+};
+
+/*
+ * Version 7 adds rname.  touch_host is dropped while existing rows
+ * are filled in, so they keep the mtime replication compares.
+ */
+static char *migrate_v7[] = {
+    "ALTER TABLE host ADD COLUMN rname TEXT",
+    "DROP TRIGGER touch_host",
+    "UPDATE host SET rname = reverse_labels(hostname)",
+    "CREATE TRIGGER touch_host AFTER UPDATE ON host"
+    " BEGIN"
+    "     UPDATE host SET mtime = DATETIME('NOW') WHERE rowid = new.rowid;"
+    " END",
+    "CREATE INDEX by_rname ON host(rname)",
+    NULL
+};
+
+/*
+ * Version 8 adds name_key and name_hash, filled in with touch_host
+ * dropped as for version 7.  Rows that differ only by a trailing dot
+ * collapse into the oldest, and the dot is dropped from the rest.
+ */
+static char *migrate_v8[] = {
+    "ALTER TABLE host ADD COLUMN name_key TEXT",
+    "ALTER TABLE host ADD COLUMN name_hash INTEGER",
+    "DROP TRIGGER touch_host",
+    "UPDATE host SET name_key = name_key(hostname)",
+    "UPDATE host SET name_hash = name_hash(name_key), rname = reverse_labels(name_key)",
+    "CREATE TRIGGER touch_host AFTER UPDATE ON host"
+    " BEGIN"
+    "     UPDATE host SET mtime = DATETIME('NOW') WHERE rowid = new.rowid;"
+    " END",
+    "DELETE FROM host WHERE id NOT IN (SELECT min(id) FROM host GROUP BY addr, name_key)",
+    "UPDATE host SET hostname = rtrim(hostname, '.')"
+    " WHERE hostname LIKE '%.' AND rtrim(hostname, '.') != ''",
+    "CREATE INDEX by_hash ON host(name_hash,name_key,family,addr,zone)",
+    NULL
+};
+
+/*
+ * Version 9 adds expires.  Every existing row is forever, so only the
+ * indexes change: by_hash carries expires so forward lookups still
+ * filter from the index alone, and by_expires finds what has expired.
+ */
+static char *migrate_v9[] = {
+    "ALTER TABLE host ADD COLUMN expires INTEGER",
+    "DROP INDEX by_hash",
+    "CREATE INDEX by_hash ON host(name_hash,name_key,family,addr,zone,expires)",
+    "CREATE INDEX by_expires ON host(expires) WHERE expires IS NOT NULL",
+    NULL
+};
+
+/*
+ * Version 10 journals expires, so a pulled row expires when it does
+ * on the node it came from.  A change to expires alone is journaled
+ * as an update.
+ */
+static char *migrate_v10[] = {
+    "ALTER TABLE host_change ADD COLUMN new_expires INTEGER",
+    "DROP TRIGGER journal_insert_host",
+    "CREATE TRIGGER journal_insert_host AFTER INSERT ON host"
+    " BEGIN"
+    "     INSERT INTO host_change (op, id, new_hostname, new_address, new_zone, new_expires, time)"
+    "     VALUES ('insert', new.id, new.hostname, new.address, new.zone, new.expires,"
+    "             STRFTIME('%Y-%m-%d %H:%M:%f', 'NOW'));"
+    " END",
+    "DROP TRIGGER journal_update_host",
+    "CREATE TRIGGER journal_update_host"
+    " AFTER UPDATE OF hostname, address, family, addr, zone, expires ON host"
+    " BEGIN"
+    "     INSERT INTO host_change (op, id, old_hostname, old_address, old_zone,"
+    "                              new_hostname, new_address, new_zone, new_expires, time)"
+    "     VALUES ('update', new.id, old.hostname, old.address, old.zone,"
+    "             new.hostname, new.address, new.zone, new.expires,"
+    "             STRFTIME('%Y-%m-%d %H:%M:%f', 'NOW'));"
+    " END",
+    NULL
+};
+
+/*
+ * The steps that bring a db to each version, indexed by version.
+ */
+static char **migrations[HOSTS_SCHEMA_VERSION + 1] = {
+    [2] = migrate_v2,
+    [3] = migrate_v3,
+    [4] = migrate_v4,
+    [5] = migrate_v5,
+    [6] = migrate_v6,
+    [7] = migrate_v7,
+    [8] = migrate_v8,
+    [9] = migrate_v9,
+    [10] = migrate_v10,
+};
+
+/** Upgrade the db in place to the current schema version
+ *
+ * All steps run in one transaction, so readers see either the old
+ * schema or the new one.  The db is also switched to WAL journaling
+ * (as hosts.sql creates it) so lookups are not blocked by writers.
+ * Returns the version the db was at before, or -1.
+ */
+int
+Hosts_migrate() {
+    int result = -1;
+    sqlite3 *db = NULL;
+    char *error = NULL;
+    char pragma[64];
+    int version, v;
+    char **step;
+
+    if ( Hosts_opendb(NULL, &db) != SQLITE_OK ) goto close;
+    if ( (version = hosts_schema_version(db)) < 0 ) goto close;
+    if ( debug ) fprintf( stderr, "db is schema version %d\n", version );
+
+    if ( sqlite3_exec(db, "PRAGMA journal_mode = WAL", NULL, NULL, NULL) != SQLITE_OK ) {
+        if ( debug ) fprintf( stderr, "could not switch to WAL: %s\n", sqlite3_errmsg(db) );
+    }
+    if ( version >= HOSTS_SCHEMA_VERSION ) {
+        result = version;
+        goto close;
+    }
+
+    if ( sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, &error) != SQLITE_OK ) goto fail;
+    for ( v = version + 1 ; v <= HOSTS_SCHEMA_VERSION ; v++ ) {
+        for ( step = migrations[v] ; step != NULL && *step != NULL ; step++ ) {
+            if ( sqlite3_exec(db, *step, NULL, NULL, &error) != SQLITE_OK ) goto rollback;
+        }
+        if ( debug ) fprintf( stderr, "migrated to schema version %d\n", v );
+    }
+    snprintf( pragma, sizeof(pragma), "PRAGMA user_version = %d", HOSTS_SCHEMA_VERSION );
+    if ( sqlite3_exec(db, pragma, NULL, NULL, &error) != SQLITE_OK ) goto rollback;
+    if ( sqlite3_exec(db, "COMMIT", NULL, NULL, &error) != SQLITE_OK ) goto rollback;
+
+    result = version;
+    goto close;
+
+rollback:
+    sqlite3_exec( db, "ROLLBACK", NULL, NULL, NULL );
+fail:
+    if ( debug ) fprintf( stderr, "migration failed: %s\n", error ? error : "" );
+    sqlite3_free( error );
+close:
+    sqlite3_close( db );
+    return result;
+}
+
+/** Compile the host table into the snapshot the NSS module maps
+ *
+ * The snapshot goes next to the db (HOSTSDB.snap) unless a path is
+ * given.  Returns the number of names compiled, or -1.
+ */
+int
+Hosts_compile( char *path ) {
+    int result = -1;
+    sqlite3 *db = NULL;
+    char *dbfile = Hosts_dbfile();
+    char snapfile[4096];
+
+    if ( path == NULL ) {
+        snprintf( snapfile, sizeof(snapfile), "%s.snap", dbfile );
+        path = snapfile;
+    }
+
+    if ( Hosts_opendb(NULL, &db) != SQLITE_OK ) goto close;
+    result = snapshot_compile( db, dbfile, path );
+    if ( debug ) fprintf( stderr, "compiled %d names into %s\n", result, path );
+
+close:
+    sqlite3_close( db );
+    return result;
+}
+
+/** Report the lookup statistics of the NSS module
+ *
+ * They are summed over every process and CPU since the last reset,
+ * and printed as a table, or as one line of JSON.  With reset they are
+ * zeroed after being printed.  Returns -1 if there are none.
+ */
+int
+Hosts_stats( FILE *out, int json, int reset ) {
+    unsigned int slots;
+    struct stats_segment *s = stats_map( reset ? STATS_WRITE : STATS_READ, &slots );
+
+    if ( s == NULL ) return -1;
+    stats_report( s, slots, out, json );
+    if ( reset ) stats_reset( s );
+    munmap( s, sizeof(*s) );
+    return 0;
 }
 
 /*
@@ -0,0 +1,473 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file nss_cache.c
+ * \brief In-process cache of NSS lookup results
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sqlite3.h>
+
+#include "hosts.h"
+#include "hosts_db.h"
+#include "nss_cache.h"
+#include "nss_config.h"
+#include "nss_iface.h"
+#include "hosts_watch.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static int size = CACHE_SIZE;
+static int negative = CACHE_NEGATIVE;
+static int watching = 1;
+
+static struct cache_entry **table = NULL;
+static uint32_t buckets = 0;
+static int count = 0;
+static struct cache_entry *newest = NULL;
+static struct cache_entry *oldest = NULL;
+static uint64_t generation = 1;
+
+/*
+ * The cache keeps its own connection only to read data_version, whose
+ * value changes whenever another connection commits.
+ */
+static sqlite3      *db = NULL;
+static sqlite3_stmt *data_version = NULL;
+static sqlite3_int64 last_version = -1;
+static const char *dbfile;
+static int fallback;
+static pid_t pid;
+static dev_t dev;
+static ino_t ino;
+
+/*
+ * The watch says when data_version is worth reading.  A child after
+ * fork() opens its own rather than drain its parent's.
+ */
+static struct watch watch = { .fd = -1 };
+static pid_t watch_pid;
+
+static void lock_cache() { pthread_mutex_lock( &lock ); }
+static void unlock_cache() { pthread_mutex_unlock( &lock ); }
+
+/**
+ */
+static void
+cache_init() {
+    const struct nss_config *config = nss_config();
+
+    dbfile = config->database;
+    size = config->lookup_cache;
+    negative = config->negative_cache;
+    watching = config->watch;
+
+    pthread_atfork( lock_cache, unlock_cache, unlock_cache );
+}
+
+/** Set the number of entries kept and whether misses are cached
+ *
+ * A size of 0 turns the cache off.
+ */
+void
+cache_configure( int entries, int misses ) {
+    pthread_once( &once, cache_init );
+    lock_cache();
+    size = entries;
+    negative = misses;
+    unlock_cache();
+}
+
+/**
+ */
+static void
+cache_flush() {
+    struct cache_entry *e, *older;
+
+    for ( e = newest ; e != NULL ; e = older ) {
+        older = e->older;
+        free( e );
+    }
+    if ( table != NULL ) memset( table, 0, buckets * sizeof(*table) );
+    newest = oldest = NULL;
+    count = 0;
+    generation++;
+}
+
+/**
+ */
+static void
+cache_close() {
+    if ( db != NULL && pid == getpid() ) {
+        sqlite3_finalize( data_version );
+        sqlite3_close( db );
+    }
+    data_version = NULL;
+    db = NULL;
+}
+
+/** Has the db been left alone since it was last checked?
+ *
+ * The watch is opened before the first check, so no write can fall
+ * between them.  Without one the db is checked every time.
+ */
+static int
+cache_quiet() {
+    if ( watching == 0 ) return 0;
+    if ( watch_pid != getpid() ) {
+        watch_pid = getpid();
+        watch_open( &watch, dbfile );
+        return 0;
+    }
+    return watch_changed( &watch ) == 0;
+}
+
+/** Flush the cache if the db has changed since it was last checked
+ *
+ * Returns -1 if the db cannot be checked, and nothing may be cached.
+ */
+static int
+cache_validate() {
+    struct stat s;
+    sqlite3_int64 version;
+
+    if ( cache_quiet() && db != NULL ) return 0;
+    if ( stat(dbfile, &s) < 0 ) goto fail;
+
+    if ( db != NULL && (pid != getpid() || dev != s.st_dev || ino != s.st_ino ||
+                        (fallback && nss_config_reopen())) ) {
+        cache_close();
+    }
+
+    if ( db == NULL ) {
+        if ( (fallback = nss_config_open(&db, 1)) < 0 ) goto fail;
+        if ( sqlite3_prepare_v2(db, "PRAGMA data_version", -1, &data_version, NULL) != SQLITE_OK ) {
+            goto fail;
+        }
+        pid = getpid();
+        dev = s.st_dev;
+        ino = s.st_ino;
+        last_version = -1;
+    }
+
+    if ( sqlite3_step(data_version) != SQLITE_ROW ) {
+        sqlite3_reset( data_version );
+        return -1;
+    }
+    version = sqlite3_column_int64( data_version, 0 );
+    sqlite3_reset( data_version );
+
+    if ( version != last_version ) {
+        cache_flush();
+        last_version = version;
+    }
+
+    return 0;
+
+fail:
+    cache_close();
+    cache_flush();
+    return -1;
+}
+
+/**
+ * Names are hashed and compared without case, the same as the
+ * NOCASE collation of hostname.
+ */
+static uint32_t
+cache_hash( int kind, int family, const unsigned char *key, size_t keylen ) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    hash = (hash ^ kind) * 16777619u;
+    hash = (hash ^ family) * 16777619u;
+    for ( i = 0 ; i < keylen ; i++ ) {
+        unsigned char c = key[i];
+        if ( kind != CACHE_BYADDR && c >= 'A' && c <= 'Z' ) c += 'a' - 'A';
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+static int
+cache_match( const struct cache_entry *e, uint32_t hash, int kind, int family,
+             const char *key, size_t keylen ) {
+    if ( e->hash != hash || e->kind != kind || e->family != family ) return 0;
+    if ( e->keylen != keylen ) return 0;
+    if ( kind == CACHE_BYADDR ) return memcmp( e->key, key, keylen ) == 0;
+    return strncasecmp( e->key, key, keylen ) == 0;
+}
+
+static struct cache_entry **
+cache_find( uint32_t hash, int kind, int family, const char *key, size_t keylen ) {
+    struct cache_entry **e;
+
+    if ( table == NULL ) return NULL;
+    for ( e = &table[hash & (buckets - 1)] ; *e != NULL ; e = &(*e)->chain ) {
+        if ( cache_match(*e, hash, kind, family, key, keylen) ) return e;
+    }
+    return NULL;
+}
+
+static void
+lru_unlink( struct cache_entry *e ) {
+    if ( e->newer != NULL ) e->newer->older = e->older; else newest = e->older;
+    if ( e->older != NULL ) e->older->newer = e->newer; else oldest = e->newer;
+}
+
+static void
+lru_push( struct cache_entry *e ) {
+    e->newer = NULL;
+    e->older = newest;
+    if ( newest != NULL ) newest->newer = e; else oldest = e;
+    newest = e;
+}
+
+static void
+cache_remove( struct cache_entry **link ) {
+    struct cache_entry *e = *link;
+
+    *link = e->chain;
+    lru_unlink( e );
+    free( e );
+    count--;
+}
+
+/** Look up a result, filling the caller's result from it on a hit
+ *
+ * Returns 1 on a hit with the status of the fill, or 0 on a miss.
+ * On a miss generation is set for the cache_store call that follows
+ * the real lookup, and is 0 when nothing should be stored.
+ */
+int
+cache_fetch( int kind, int family, const void *key, size_t keylen,
+             uint64_t *generation_p, cache_fill fill, void *arg,
+             enum nss_status *status ) {
+    uint32_t hash = cache_hash( kind, family, (const unsigned char *)key, keylen );
+    struct cache_entry **e;
+    int hit = 0;
+
+    *generation_p = 0;
+    pthread_once( &once, cache_init );
+    if ( size <= 0 ) return 0;
+
+    lock_cache();
+
+    if ( cache_validate() < 0 ) goto unlock;
+    *generation_p = generation;
+
+    e = cache_find( hash, kind, family, (const char *)key, keylen );
+    if ( e != NULL && (*e)->expires != 0 && time(NULL) >= (*e)->expires ) {
+        cache_remove( e );
+        e = NULL;
+    }
+    if ( e != NULL ) {
+        struct cache_entry *entry = *e;
+        lru_unlink( entry );
+        lru_push( entry );
+        *status = entry->found ? fill(entry, arg) : NSS_STATUS_NOTFOUND;
+        hit = 1;
+    }
+
+unlock:
+    unlock_cache();
+    return hit;
+}
+
+/** Add an entry, replacing any entry for the same key
+ *
+ * Nothing is stored if the cache was flushed since the fetch that
+ * missed, the result may predate the change that flushed it.
+ */
+static void
+cache_store( struct cache_entry *entry, uint64_t generation_p ) {
+    struct cache_entry **e;
+    uint32_t want;
+
+    lock_cache();
+
+    if ( generation_p == 0 || generation_p != generation || size <= 0 ) {
+        free( entry );
+        goto unlock;
+    }
+
+    if ( table == NULL ) {
+        for ( want = 16 ; (int)want < size && want < (1u << 30) ; want <<= 1 ) ;
+        table = (struct cache_entry **)calloc( want, sizeof(*table) );
+        if ( table == NULL ) {
+            free( entry );
+            goto unlock;
+        }
+        buckets = want;
+    }
+
+    e = cache_find( entry->hash, entry->kind, entry->family, entry->key, entry->keylen );
+    if ( e != NULL ) cache_remove( e );
+
+    while ( count >= size && oldest != NULL ) {
+        struct cache_entry *victim = oldest;
+        e = &table[victim->hash & (buckets - 1)];
+        while ( *e != victim ) e = &(*e)->chain;
+        cache_remove( e );
+    }
+
+    e = &table[entry->hash & (buckets - 1)];
+    entry->chain = *e;
+    *e = entry;
+    lru_push( entry );
+    count++;
+
+unlock:
+    unlock_cache();
+}
+
+/** Allocate an entry with room for its addresses, key and names
+ */
+static struct cache_entry *
+cache_entry( int kind, int family, const void *key, size_t keylen,
+             int naddrs, size_t names ) {
+    struct cache_entry *e;
+    char *data;
+    size_t total = sizeof(*e) + naddrs * sizeof(struct cache_address) + keylen + 1 + names;
+
+    e = (struct cache_entry *)calloc( 1, total );
+    if ( e == NULL ) return NULL;
+
+    data = (char *)(e + 1);
+    e->addrs = (struct cache_address *)data;
+    data += naddrs * sizeof(struct cache_address);
+    memcpy( data, key, keylen );
+    data[keylen] = '\0';
+    e->key = data;
+    e->names = data + keylen + 1;
+
+    e->hash = cache_hash( kind, family, (const unsigned char *)key, keylen );
+    e->kind = kind;
+    e->family = family;
+    e->keylen = keylen;
+    return e;
+}
+
+/** Remember a hostent result, or a miss when h is NULL
+ */
+void
+cache_store_hostent( int kind, int family, const void *key, size_t keylen,
+                     uint64_t generation_p, const struct hostent *h, int64_t expires ) {
+    struct cache_entry *e;
+    struct cache_address *a;
+    size_t names = 0;
+    char *n;
+    int naddrs = 0, nnames = 0, i;
+
+    if ( generation_p == 0 ) return;
+    if ( h == NULL && negative == 0 ) return;
+
+    if ( h != NULL ) {
+        if ( h->h_length > (int)sizeof(a->addr) ) return;
+        while ( h->h_addr_list[naddrs] != NULL ) naddrs++;
+        names = strlen( h->h_name ) + 1;
+        nnames = 1;
+        for ( i = 0 ; h->h_aliases[i] != NULL ; i++ ) {
+            names += strlen( h->h_aliases[i] ) + 1;
+            nnames++;
+        }
+    }
+
+    e = cache_entry( kind, family, key, keylen, naddrs, names );
+    if ( e == NULL ) return;
+
+    if ( h != NULL ) {
+        e->found = 1;
+        e->expires = expires;
+        e->naddrs = naddrs;
+        e->nnames = nnames;
+        a = (struct cache_address *)e->addrs;
+        for ( i = 0 ; i < naddrs ; i++ ) {
+            a[i].family = h->h_addrtype;
+            memcpy( a[i].addr, h->h_addr_list[i], h->h_length );
+        }
+        n = (char *)e->names;
+        n = stpcpy( n, h->h_name ) + 1;
+        for ( i = 0 ; h->h_aliases[i] != NULL ; i++ ) {
+            n = stpcpy( n, h->h_aliases[i] ) + 1;
+        }
+    }
+
+    cache_store( e, generation_p );
+}
+
+/** Remember a gethostbyname4_r result, or a miss when pat is NULL
+ *
+ * Only the first naddrs tuples of the chain are the result; any the
+ * caller chained in past those were left untouched by the lookup.
+ */
+void
+cache_store_tuples( const char *name, uint64_t generation_p,
+                    const struct gaih_addrtuple *pat, int naddrs, int64_t expires ) {
+    const struct gaih_addrtuple *t;
+    struct cache_entry *e;
+    struct cache_address *a;
+    size_t keylen = strlen( name );
+    int i;
+
+    if ( generation_p == 0 ) return;
+    if ( pat == NULL && negative == 0 ) return;
+    if ( pat == NULL ) naddrs = 0;
+
+    e = cache_entry( CACHE_BYNAME4, 0, name, keylen, naddrs, 0 );
+    if ( e == NULL ) return;
+
+    if ( pat != NULL ) {
+        e->found = 1;
+        e->expires = expires;
+        e->naddrs = naddrs;
+        a = (struct cache_address *)e->addrs;
+        for ( t = pat, i = 0 ; t != NULL && i < naddrs ; t = t->next, i++ ) {
+            a[i].family = t->family;
+            memcpy( a[i].addr, t->addr, hosts_address_length(t->family) );
+            if ( t->scopeid != 0 && iface_name(t->scopeid, a[i].zone) < 0 ) {
+                snprintf( a[i].zone, sizeof(a[i].zone), "%u", t->scopeid );
+            }
+        }
+    }
+
+    cache_store( e, generation_p );
+}
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
@@ -0,0 +1,98 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file nss_cache.h
+ * \brief In-process cache of NSS lookup results
+ *
+ * A bounded LRU of positive and negative results shared by all the
+ * threads of a process, keyed by (name, family) or (address, family).
+ * It is flushed whenever PRAGMA data_version on the cache's own
+ * connection says another connection has committed, or the db file
+ * has been replaced, so a "hosts --add" is seen by the next lookup.
+ * With a watch on the db (see hosts_watch.h) that is only asked after
+ * a write to it, and a hit while it is left alone does not touch the db.
+ * A result from rows that expire is dropped when the first one does.
+ */
+
+#ifndef _NSS_CACHE_H_
+#define _NSS_CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <nss.h>
+
+#define CACHE_BYNAME    1       /* hostent for gethostbyname2_r */
+#define CACHE_BYADDR    2       /* hostent for gethostbyaddr_r */
+#define CACHE_BYNAME4   3       /* tuples for gethostbyname4_r */
+
+#define CACHE_SIZE      1024
+#define CACHE_NEGATIVE  1
+
+/*
+ * The zone is kept by name, not as the scope id, so a cached result
+ * follows an interface that has been renumbered.
+ */
+struct cache_address {
+    int family;
+    unsigned char addr[16];
+    char zone[IF_NAMESIZE];
+};
+
+struct cache_entry {
+    struct cache_entry *chain;
+    struct cache_entry *newer;
+    struct cache_entry *older;
+    uint32_t hash;
+    int kind;
+    int family;
+    int found;                  /* 0 for a negative entry */
+    int naddrs;
+    int nnames;
+    int64_t expires;            /* 0 for never */
+    size_t keylen;
+    const char *key;
+    const struct cache_address *addrs;
+    const char *names;          /* nnames strings back to back */
+};
+
+typedef enum nss_status (*cache_fill)( const struct cache_entry *, void *arg );
+
+void cache_configure( int size, int negative );
+
+int cache_fetch( int kind, int family, const void *key, size_t keylen,
+                 uint64_t *generation, cache_fill fill, void *arg,
+                 enum nss_status *status );
+
+void cache_store_hostent( int kind, int family, const void *key, size_t keylen,
+                          uint64_t generation, const struct hostent *, int64_t expires );
+void cache_store_tuples( const char *name, uint64_t generation,
+                         const struct gaih_addrtuple *, int naddrs, int64_t expires );
+
+#endif
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
@@ -0,0 +1,288 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/** \file nss_config.c
+ * \brief Runtime settings of the NSS module
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "hosts.h"
+#include "nss_cache.h"
+#include "hosts_stats.h"
+#include "nss_config.h"
+#include "hosts_resolver.h"
+
+static struct nss_config config = {
+    .database = HOSTSDB,
+    .readonly = 0,
+    .immutable = 0,
+    .mmap_size = -1,
+    .cache_size = 0,
+    .busy_timeout = 20,
+    .retry_budget = 250,
+    .lookup_cache = CACHE_SIZE,
+    .negative_cache = CACHE_NEGATIVE,
+    .watch = 1,
+    .stats = STATS_OFF,
+    .resolver = RESOLVER_SOCKET,
+};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static char walfile[PATH_MAX + sizeof("-wal")];
+
+/**
+ */
+static int
+config_boolean( const char *value ) {
+    if ( strcasecmp(value, "yes") == 0 || strcasecmp(value, "true") == 0 ||
+         strcasecmp(value, "on") == 0 || strcmp(value, "1") == 0 ) {
+        return 1;
+    }
+    return 0;
+}
+
+/** Apply one setting
+ *
+ * Returns -1 for a key that is not known.
+ */
+static int
+config_set( const char *key, const char *value ) {
+    if ( strcmp(key, "database") == 0 ) {
+        snprintf( config.database, sizeof(config.database), "%s", value );
+    } else if ( strcmp(key, "readonly") == 0 ) {
+        config.readonly = config_boolean( value );
+    } else if ( strcmp(key, "immutable") == 0 ) {
+        config.immutable = config_boolean( value );
+    } else if ( strcmp(key, "mmap_size") == 0 ) {
+        config.mmap_size = atoll( value );
+    } else if ( strcmp(key, "cache_size") == 0 ) {
+        config.cache_size = atoi( value );
+    } else if ( strcmp(key, "busy_timeout") == 0 ) {
+        config.busy_timeout = atoi( value );
+    } else if ( strcmp(key, "retry_budget") == 0 ) {
+        config.retry_budget = atoi( value );
+    } else if ( strcmp(key, "lookup_cache") == 0 ) {
+        config.lookup_cache = atoi( value );
+    } else if ( strcmp(key, "negative_cache") == 0 ) {
+        config.negative_cache = config_boolean( value );
+    } else if ( strcmp(key, "watch") == 0 ) {
+        config.watch = config_boolean( value );
+    } else if ( strcmp(key, "stats") == 0 ) {
+        if ( strcasecmp(value, "counters") == 0 ) {
+            config.stats = STATS_COUNTERS;
+        } else {
+            config.stats = config_boolean( value ) ? STATS_LATENCY : STATS_OFF;
+        }
+    } else if ( strcmp(key, "resolver") == 0 ) {
+        if ( strcasecmp(value, "off") == 0 || strcasecmp(value, "no") == 0 ) value = "";
+        snprintf( config.resolver, sizeof(config.resolver), "%s", value );
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ */
+static char *
+trim( char *s ) {
+    char *end;
+
+    while ( isspace((unsigned char)*s) ) s++;
+    end = s + strlen( s );
+    while ( end > s && isspace((unsigned char)end[-1]) ) end--;
+    *end = '\0';
+    return s;
+}
+
+/**
+ */
+static void
+config_read( const char *path ) {
+    char line[PATH_MAX + 64];
+    char *key, *value, *comment;
+    FILE *f;
+    int number = 0;
+
+    if ( (f = fopen(path, "re")) == NULL ) return;
+
+    while ( fgets(line, sizeof(line), f) != NULL ) {
+        number++;
+        if ( (comment = strchr(line, '#')) != NULL ) *comment = '\0';
+        key = trim( line );
+        if ( *key == '\0' ) continue;
+
+        if ( (value = strchr(key, '=')) == NULL ) {
+            syslog( LOG_WARNING, "%s:%d: expected key = value", path, number );
+            continue;
+        }
+        *value++ = '\0';
+        key = trim( key );
+        value = trim( value );
+        if ( config_set(key, value) < 0 ) {
+            syslog( LOG_WARNING, "%s:%d: unknown setting '%s'", path, number, key );
+        }
+    }
+    fclose( f );
+}
+
+/*
+ * Environment names of the settings that can be overridden.
+ */
+static const char *overrides[][2] = {
+    { "NSS_SQLITE_BUSY_TIMEOUT",   "busy_timeout" },
+    { "NSS_SQLITE_RETRY_BUDGET",   "retry_budget" },
+    { "NSS_SQLITE_LOOKUP_CACHE",   "lookup_cache" },
+    { "NSS_SQLITE_CACHE_SIZE",     "cache_size" },
+    { "NSS_SQLITE_NEGATIVE_CACHE", "negative_cache" },
+    { "NSS_SQLITE_WATCH",          "watch" },
+    { "NSS_SQLITE_READONLY",       "readonly" },
+    { "NSS_SQLITE_IMMUTABLE",      "immutable" },
+    { "NSS_SQLITE_MMAP_SIZE",      "mmap_size" },
+    { "NSS_SQLITE_STATS",          "stats" },
+    { "NSS_SQLITE_RESOLVER",       "resolver" },
+};
+
+/**
+ */
+static void
+config_init() {
+    const char *path, *value;
+    size_t i;
+
+    path = secure_getenv( "NSS_SQLITE_CONF" );
+    config_read( path != NULL ? path : NSS_SQLITE_CONF );
+
+    if ( (value = secure_getenv("HOSTSDB")) != NULL ) {
+        config_set( "database", value );
+    }
+    for ( i = 0 ; i < sizeof(overrides) / sizeof(overrides[0]) ; i++ ) {
+        if ( (value = secure_getenv(overrides[i][0])) != NULL ) {
+            config_set( overrides[i][1], value );
+        }
+    }
+    snprintf( walfile, sizeof(walfile), "%s-wal", config.database );
+}
+
+/** The module settings, read on first use
+ */
+const struct nss_config *
+nss_config() {
+    pthread_once( &once, config_init );
+    return &config;
+}
+
+/** Has the -wal file appeared since the db was opened without it?
+ *
+ * A connection nss_config_open returned 1 for is opened again when it
+ * has, so that it sees the commits made from now on.
+ */
+int
+nss_config_reopen( void ) {
+    nss_config();
+    return access( walfile, F_OK ) == 0;
+}
+
+/** Open the configured db with the configured flags and pragmas
+ *
+ * readonly forces a read only open whatever the settings say, and
+ * sqlite opens a db the caller cannot write read only anyway.  A read
+ * only open of a WAL db needs the -wal and -shm files, and cannot make
+ * them without write access to the directory.  Without a -wal file
+ * every commit is in the db file itself, so it is then opened as
+ * immutable instead, and 1 is returned: see nss_config_reopen.
+ */
+int
+nss_config_open( sqlite3 **db, int readonly ) {
+    const struct nss_config *c = nss_config();
+    char uri[PATH_MAX + 32];
+    char pragma[64];
+    int flags = SQLITE_OPEN_READWRITE;
+    const char *name = c->database;
+    int result = 0;
+
+    if ( c->readonly || readonly ) flags = SQLITE_OPEN_READONLY;
+    if ( c->immutable ) {
+        snprintf( uri, sizeof(uri), "file:%s?immutable=1", c->database );
+        name = uri;
+        flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_URI;
+    }
+
+    if ( sqlite3_open_v2(name, db, flags, NULL) != SQLITE_OK ) goto fail;
+    sqlite3_busy_timeout( *db, c->busy_timeout );
+
+    /*
+     * The WAL files are only looked for when the db is first read.  With
+     * a -wal file there a failure here passes, as a writer rebuilding
+     * the -shm does, so the connection is kept for the lookup to retry.
+     */
+    if ( c->immutable == 0 && sqlite3_db_readonly(*db, "main") == 1 &&
+         sqlite3_exec(*db, "PRAGMA schema_version", NULL, NULL, NULL) != SQLITE_OK &&
+         nss_config_reopen() == 0 ) {
+        int error = sqlite3_errcode( *db );
+
+        if ( error != SQLITE_READONLY && error != SQLITE_CANTOPEN ) goto fail;
+        sqlite3_close( *db );
+        snprintf( uri, sizeof(uri), "file:%s?immutable=1", c->database );
+        if ( sqlite3_open_v2(uri, db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, NULL) != SQLITE_OK ) {
+            goto fail;
+        }
+        sqlite3_busy_timeout( *db, c->busy_timeout );
+        result = 1;
+    }
+
+    if ( c->mmap_size >= 0 ) {
+        snprintf( pragma, sizeof(pragma), "PRAGMA mmap_size = %lld", c->mmap_size );
+        sqlite3_exec( *db, pragma, NULL, NULL, NULL );
+    }
+    if ( c->cache_size != 0 ) {
+        snprintf( pragma, sizeof(pragma), "PRAGMA cache_size = %d", c->cache_size );
+        sqlite3_exec( *db, pragma, NULL, NULL, NULL );
+    }
+    return result;
+
+fail:
+    sqlite3_close( *db );
+    *db = NULL;
+    return -1;
+}
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
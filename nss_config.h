@@ -0,0 +1,96 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/** \file nss_config.h
+ * \brief Runtime settings of the NSS module
+ *
+ * Read once from /etc/nss-sqlite.conf, the first time the module is
+ * used.  Lines are "key = value", # starts a comment:
+ *
+ *   database       = /var/db/hosts.db
+ *   readonly       = no        open with SQLITE_OPEN_READONLY
+ *   immutable      = no        open as file:...?immutable=1, no locking
+ *   mmap_size      = 8388608   PRAGMA mmap_size, in bytes
+ *   cache_size     = -2000     PRAGMA cache_size, pages or -KiB
+ *   busy_timeout   = 20        ms sqlite waits for a lock
+ *   retry_budget   = 250       ms of jittered retries after that
+ *   lookup_cache   = 1024      entries in the result cache, 0 is off
+ *   negative_cache = yes       cache misses as well
+ *   watch          = yes       check the db for changes only after
+ *                              inotify reports a write to it
+ *   stats          = off       shared lookup statistics: on, counters
+ *                              (no latency, so no clock reads) or off,
+ *                              kept only by processes running as root
+ *   resolver       = /run/hosts-resolverd.sock
+ *                              where to ask hosts-resolverd, or off
+ *
+ * An immutable db must only be changed by replacing the file (as the
+ * snapshot is), since nothing will notice a change made in place.
+ *
+ * A read only open of a WAL db needs its -wal and -shm files to exist
+ * and be readable, since only a connection that can write the
+ * directory can create them; a process that cannot write the db file
+ * opens it read only whatever readonly says.  libhosts keeps both
+ * files after its last write, with the mode of the db file.  A db
+ * with no -wal file at all is opened immutable until one appears.
+ *
+ * HOSTSDB, NSS_SQLITE_CONF (another file) and the NSS_SQLITE_* names
+ * of the settings in the environment override the file, except in
+ * setuid and setgid programs.
+ */
+
+#ifndef _NSS_CONFIG_H_
+#define _NSS_CONFIG_H_
+
+#include <limits.h>
+
+#include <sqlite3.h>
+
+#define NSS_SQLITE_CONF "/etc/nss-sqlite.conf"
+
+struct nss_config {
+    char database[PATH_MAX];
+    int readonly;
+    int immutable;
+    long long mmap_size;        /* -1 leaves the sqlite default */
+    int cache_size;             /* 0 leaves the sqlite default */
+    int busy_timeout;
+    int retry_budget;
+    int lookup_cache;
+    int negative_cache;
+    int watch;
+    int stats;                  /* STATS_OFF, _COUNTERS or _LATENCY */
+    char resolver[PATH_MAX];    /* "" when off */
+};
+
+const struct nss_config *nss_config( void );
+int nss_config_open( sqlite3 **db, int readonly );
+int nss_config_reopen( void );
+
+#endif
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
@@ -0,0 +1,217 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/** \file nss_iface.c
+ * \brief Interface names and indexes for IPv6 zones
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "nss_iface.h"
+
+/*
+ * Without a netlink socket (a seccomp sandbox, say) the table is
+ * simply read again once it is IFACE_STALE seconds old.
+ */
+#define IFACE_STALE 5
+
+struct iface {
+    unsigned int index;
+    char name[IF_NAMESIZE];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct iface *table = NULL;
+static int count = 0;
+static int loaded = 0;
+static time_t loaded_at;
+static int netlink = -1;
+static pid_t pid;
+
+/** Read every interface into the table
+ */
+static void
+iface_load() {
+    struct if_nameindex *list, *i;
+    struct iface *grown;
+    int n = 0;
+
+    loaded = 1;
+    loaded_at = time( NULL );
+    if ( (list = if_nameindex()) == NULL ) return;
+
+    for ( i = list ; i->if_index != 0 ; i++ ) n++;
+    grown = (struct iface *)realloc( table, (n + 1) * sizeof(*table) );
+    if ( grown != NULL ) {
+        table = grown;
+        for ( count = 0, i = list ; i->if_index != 0 ; i++, count++ ) {
+            table[count].index = i->if_index;
+            memset( table[count].name, 0, IF_NAMESIZE );
+            strncpy( table[count].name, i->if_name, IF_NAMESIZE - 1 );
+        }
+    }
+    if_freenameindex( list );
+}
+
+/** Listen for link changes
+ *
+ * A socket inherited across fork() is shared with the parent, which
+ * would take some of our messages, so the child opens its own.
+ */
+static void
+iface_listen() {
+    struct sockaddr_nl local;
+
+    if ( netlink >= 0 ) close( netlink );
+    pid = getpid();
+    netlink = socket( AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE );
+    if ( netlink < 0 ) return;
+
+    memset( &local, 0, sizeof(local) );
+    local.nl_family = AF_NETLINK;
+    local.nl_groups = RTMGRP_LINK;
+    if ( bind(netlink, (struct sockaddr *)&local, sizeof(local)) < 0 ) {
+        close( netlink );
+        netlink = -1;
+    }
+}
+
+/** Drain pending netlink messages, return 1 if a link changed
+ *
+ * An overrun socket (ENOBUFS) has lost messages, so counts as one.
+ */
+static int
+iface_changed() {
+    char buffer[8192] __attribute__((aligned(__alignof__(struct nlmsghdr))));
+    int changed = 0;
+    ssize_t n;
+
+    while ( (n = recv(netlink, buffer, sizeof(buffer), MSG_DONTWAIT)) != 0 ) {
+        struct nlmsghdr *h;
+
+        if ( n < 0 ) {
+            if ( errno == EINTR ) continue;
+            if ( errno == ENOBUFS ) {
+                changed = 1;
+                continue;
+            }
+            break;
+        }
+        for ( h = (struct nlmsghdr *)buffer ; NLMSG_OK(h, n) ; h = NLMSG_NEXT(h, n) ) {
+            if ( h->nlmsg_type == RTM_NEWLINK || h->nlmsg_type == RTM_DELLINK ) changed = 1;
+        }
+    }
+    return changed;
+}
+
+/** Bring the table up to date, called with the lock held
+ */
+static void
+iface_refresh() {
+    if ( loaded == 0 || pid != getpid() ) {
+        iface_listen();
+        iface_load();
+        return;
+    }
+    if ( netlink < 0 ) {
+        if ( time(NULL) - loaded_at >= IFACE_STALE ) iface_load();
+        return;
+    }
+    if ( iface_changed() ) iface_load();
+}
+
+/** The index of the interface a zone names, 0 if there is none
+ *
+ * A numeric zone is taken as the index itself, as glibc does for
+ * "fe80::1%2".
+ */
+unsigned int
+iface_index( const char *zone ) {
+    unsigned int index = 0;
+    char *end;
+    int i;
+
+    if ( zone == NULL || zone[0] == '\0' ) return 0;
+
+    index = strtoul( zone, &end, 10 );
+    if ( *end == '\0' ) return index;
+    index = 0;
+
+    pthread_mutex_lock( &lock );
+    iface_refresh();
+    for ( i = 0 ; i < count ; i++ ) {
+        if ( strcasecmp(table[i].name, zone) == 0 ) {
+            index = table[i].index;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &lock );
+
+    return index;
+}
+
+/** The name of an interface, into zone of IF_NAMESIZE bytes
+ *
+ * Returns -1 if there is no such interface.
+ */
+int
+iface_name( unsigned int index, char *zone ) {
+    int result = -1;
+    int i;
+
+    if ( index == 0 ) return -1;
+
+    pthread_mutex_lock( &lock );
+    iface_refresh();
+    for ( i = 0 ; i < count ; i++ ) {
+        if ( table[i].index == index ) {
+            memcpy( zone, table[i].name, IF_NAMESIZE );
+            result = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock( &lock );
+
+    return result;
+}
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
@@ -0,0 +1,49 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/** \file nss_iface.h
+ * \brief Interface names and indexes for IPv6 zones
+ *
+ * The zone of a host row names the interface a link-local address is
+ * reached on, and getaddrinfo wants it as the scope id.  Rather than
+ * an if_nametoindex() (a socket, an ioctl and a close) per result,
+ * the module keeps a table of every interface, read once and read
+ * again only when a netlink link message says one has come, gone or
+ * been renamed.
+ */
+
+#ifndef _NSS_IFACE_H_
+#define _NSS_IFACE_H_
+
+#include <net/if.h>
+
+unsigned int iface_index( const char *zone );
+int iface_name( unsigned int index, char *zone );
+
+#endif
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
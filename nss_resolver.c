@@ -0,0 +1,352 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file nss_resolver.c
+ * \brief Client of hosts-resolverd in the NSS module
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "nss_resolver.h"
+#include "nss_config.h"
+
+/*
+ * The buffers are only allocated once a daemon has been reached, so a
+ * thread of a process with no hosts-resolverd running, the usual case,
+ * costs no more than this.
+ */
+struct resolver {
+    pid_t pid;
+    int fd;
+    time_t retry;               /* do not connect again before this */
+    char *request;
+    char *reply;
+    struct cache_address *addrs;
+};
+
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static const char *path = NULL;
+static char database[PATH_MAX];
+
+/**
+ */
+static void
+resolver_destroy( void *arg ) {
+    struct resolver *r = (struct resolver *)arg;
+
+    if ( r->fd >= 0 ) close( r->fd );
+    free( r->request );
+    free( r->reply );
+    free( r->addrs );
+    free( r );
+}
+
+/**
+ */
+static void
+resolver_init() {
+    const struct nss_config *config = nss_config();
+
+    if ( config->resolver[0] == '\0' ) return;
+    if ( realpath(config->database, database) == NULL ) {
+        snprintf( database, sizeof(database), "%s", config->database );
+    }
+    if ( pthread_key_create(&key, resolver_destroy) != 0 ) return;
+    path = config->resolver;
+}
+
+/**
+ */
+static time_t
+resolver_now() {
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec;
+}
+
+/**
+ */
+static void
+resolver_close( struct resolver *r ) {
+    if ( r->fd >= 0 ) close( r->fd );
+    r->fd = -1;
+    r->retry = resolver_now() + RESOLVER_RETRY;
+}
+
+/** Send a request and read the reply, returns its length or -1
+ */
+static ssize_t
+resolver_exchange( struct resolver *r, size_t length, uint32_t count ) {
+    const struct resolver_header *header = (const struct resolver_header *)r->reply;
+    ssize_t n;
+
+    if ( send(r->fd, r->request, length, MSG_NOSIGNAL) != (ssize_t)length ) return -1;
+    if ( (n = recv(r->fd, r->reply, RESOLVER_PACKET, 0)) < (ssize_t)sizeof(*header) ) return -1;
+    if ( header->magic != RESOLVER_MAGIC || header->count != count ) return -1;
+    return n;
+}
+
+/** Ask one question, and check the answer fits in the reply
+ *
+ * Returns NULL if the daemon could not be asked.
+ */
+static const struct resolver_answer *
+resolver_ask( struct resolver *r, int op, int family, const void *key, size_t keylen ) {
+    struct resolver_header *header = (struct resolver_header *)r->request;
+    struct resolver_query *q = (struct resolver_query *)(header + 1);
+    const struct resolver_answer *a;
+    size_t length = sizeof(*header) + sizeof(*q) + keylen;
+    ssize_t n;
+
+    if ( length > RESOLVER_PACKET ) return NULL;
+    header->magic = RESOLVER_MAGIC;
+    header->count = 1;
+    q->op = op;
+    q->family = family;
+    q->length = keylen;
+    memcpy( q + 1, key, keylen );
+
+    if ( (n = resolver_exchange(r, length, 1)) < 0 ) return NULL;
+    a = (const struct resolver_answer *)(r->reply + sizeof(*header));
+    if ( (size_t)n < sizeof(*header) + sizeof(*a) ) return NULL;
+    if ( a->size > n - sizeof(*header) - sizeof(*a) ) return NULL;
+    if ( a->naddrs > a->size / sizeof(struct resolver_address) ) return NULL;
+    return a;
+}
+
+/** Make a cache entry of an answer, for the cache's fill functions
+ *
+ * The entry points into the reply.  Returns -1 for a malformed one.
+ */
+static int
+resolver_entry( struct resolver *r, const struct resolver_answer *a, struct cache_entry *e ) {
+    const struct resolver_address *ra = (const struct resolver_address *)(a + 1);
+    const char *names = (const char *)(ra + a->naddrs);
+    const char *end = (const char *)(a + 1) + a->size;
+    const char *n;
+    int i;
+
+    for ( i = 0, n = names ; i < a->nnames ; i++ ) {
+        const char *nul = (const char *)memchr( n, '\0', end - n );
+        if ( nul == NULL ) return -1;
+        n = nul + 1;
+    }
+    for ( i = 0 ; i < a->naddrs ; i++ ) {
+        r->addrs[i].family = ra[i].family;
+        memcpy( r->addrs[i].addr, ra[i].addr, sizeof(r->addrs[i].addr) );
+        memcpy( r->addrs[i].zone, ra[i].zone, sizeof(r->addrs[i].zone) );
+        r->addrs[i].zone[sizeof(r->addrs[i].zone) - 1] = '\0';
+    }
+
+    memset( e, 0, sizeof(*e) );
+    e->family = a->family;
+    e->found = 1;
+    e->naddrs = a->naddrs;
+    e->nnames = a->nnames;
+    e->expires = a->expires;
+    e->addrs = r->addrs;
+    e->names = names;
+    return 0;
+}
+
+/** Allocate the request, reply and address buffers, if not yet done
+ */
+static int
+resolver_buffers( struct resolver *r ) {
+    if ( r->request != NULL ) return 0;
+
+    r->request = (char *)malloc( RESOLVER_PACKET );
+    r->reply = (char *)malloc( RESOLVER_PACKET );
+    r->addrs = (struct cache_address *)
+        malloc( (RESOLVER_PACKET / sizeof(struct resolver_address)) * sizeof(*r->addrs) );
+    if ( r->request == NULL || r->reply == NULL || r->addrs == NULL ) {
+        free( r->request );
+        free( r->reply );
+        free( r->addrs );
+        r->request = r->reply = NULL;
+        r->addrs = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/** Connect, and make sure the daemon serves the db this process uses
+ */
+static int
+resolver_connect( struct resolver *r ) {
+    struct timeval timeout = { RESOLVER_TIMEOUT, 0 };
+    const struct resolver_answer *a;
+    struct sockaddr_un sun;
+
+    memset( &sun, 0, sizeof(sun) );
+    sun.sun_family = AF_UNIX;
+    if ( strlen(path) >= sizeof(sun.sun_path) ) return -1;
+    strcpy( sun.sun_path, path );
+
+    if ( (r->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0 ) return -1;
+    setsockopt( r->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+    setsockopt( r->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout) );
+    if ( connect(r->fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ) return -1;
+    if ( resolver_buffers(r) < 0 ) return -1;
+
+    if ( (a = resolver_ask(r, RESOLVER_DATABASE, 0, NULL, 0)) == NULL ) return -1;
+    if ( a->status != RESOLVER_FOUND || a->nnames != 1 ) return -1;
+    if ( strncmp((const char *)(a + 1), database, a->size) != 0 ) return -1;
+    return 0;
+}
+
+/** This thread's connection to the daemon, NULL to use the db
+ */
+static struct resolver *
+resolver() {
+    struct resolver *r;
+
+    pthread_once( &once, resolver_init );
+    if ( path == NULL ) return NULL;
+
+    r = (struct resolver *)pthread_getspecific( key );
+    if ( r == NULL ) {
+        if ( (r = (struct resolver *)calloc(1, sizeof(*r))) == NULL ) return NULL;
+        r->fd = -1;
+        r->pid = getpid();
+        if ( pthread_setspecific(key, r) != 0 ) {
+            resolver_destroy( r );
+            return NULL;
+        }
+    }
+
+    if ( r->pid != getpid() ) {
+        /* the parent's requests and replies must not cross ours */
+        if ( r->fd >= 0 ) close( r->fd );
+        r->fd = -1;
+        r->retry = 0;
+        r->pid = getpid();
+    }
+
+    if ( r->fd < 0 ) {
+        if ( resolver_now() < r->retry ) return NULL;
+        if ( resolver_connect(r) < 0 ) {
+            resolver_close( r );
+            return NULL;
+        }
+    }
+    return r;
+}
+
+/** Ask the daemon, once more on a new connection if it has restarted
+ */
+static const struct resolver_answer *
+resolver_query( struct resolver *r, int op, int family, const void *key, size_t keylen ) {
+    const struct resolver_answer *a;
+
+    if ( (a = resolver_ask(r, op, family, key, keylen)) != NULL ) return a;
+    resolver_close( r );
+    if ( resolver_connect(r) < 0 ) {
+        resolver_close( r );
+        return NULL;
+    }
+    r->retry = 0;
+    if ( (a = resolver_ask(r, op, family, key, keylen)) == NULL ) resolver_close( r );
+    return a;
+}
+
+/** Look up in the daemon's table, as cache_fetch does in the cache
+ *
+ * Returns 1 with the status of the lookup if the daemon answered, and
+ * 0 if the db has to be asked instead.
+ */
+int
+resolver_fetch( int op, int family, const void *key, size_t keylen,
+                cache_fill fill, void *arg, enum nss_status *status ) {
+    const struct resolver_answer *a;
+    struct cache_entry e;
+    struct resolver *r;
+
+    if ( (r = resolver()) == NULL ) return 0;
+    if ( (a = resolver_query(r, op, family, key, keylen)) == NULL ) return 0;
+
+    switch ( a->status ) {
+    case RESOLVER_NOTFOUND:
+        *status = NSS_STATUS_NOTFOUND;
+        return 1;
+    case RESOLVER_FOUND:
+        if ( resolver_entry(r, a, &e) < 0 ) {
+            resolver_close( r );
+            return 0;
+        }
+        *status = fill( &e, arg );
+        return 1;
+    }
+    return 0;
+}
+
+/** Read the next rows of the daemon's table for gethostent
+ *
+ * Returns the number of rows, 0 at the end of the table, or -1 if the
+ * daemon could not be asked.
+ */
+int
+resolver_enumerate( uint64_t *position, resolver_row row, void *arg ) {
+    const struct resolver_answer *a;
+    struct cache_entry e;
+    struct resolver *r;
+    const char *name;
+    int i;
+
+    if ( (r = resolver()) == NULL ) return -1;
+    a = resolver_query( r, RESOLVER_ENUMERATE, 0, position, sizeof(*position) );
+    if ( a == NULL ) return -1;
+
+    switch ( a->status ) {
+    case RESOLVER_NOTFOUND:
+        return 0;
+    case RESOLVER_FOUND:
+        if ( a->naddrs != a->nnames || resolver_entry(r, a, &e) < 0 ) break;
+        for ( i = 0, name = e.names ; i < e.naddrs ; i++, name += strlen(name) + 1 ) {
+            row( arg, e.addrs[i].family, e.addrs[i].addr, name );
+        }
+        *position = a->next;
+        return e.naddrs;
+    }
+    return -1;
+}
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
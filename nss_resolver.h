@@ -0,0 +1,58 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013-2024 Karl Redgate
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file nss_resolver.h
+ * \brief Client of hosts-resolverd in the NSS module
+ *
+ * Lookups go to hosts-resolverd when it is running and serving the
+ * configured db, and to the db itself when it is not.  Each thread
+ * keeps its own connection to the daemon.  A thread that could not
+ * reach it does not try again for RESOLVER_RETRY seconds, so a daemon
+ * that is not running costs a failed connect now and then.
+ */
+
+#ifndef _NSS_RESOLVER_H_
+#define _NSS_RESOLVER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <nss.h>
+
+#include "hosts_resolver.h"
+#include "nss_cache.h"
+
+#define RESOLVER_RETRY   5      /* seconds before connecting again */
+#define RESOLVER_TIMEOUT 1      /* seconds to wait for an answer */
+
+typedef void (*resolver_row)( void *arg, int family, const void *addr, const char *name );
+
+int resolver_fetch( int op, int family, const void *key, size_t keylen,
+                    cache_fill fill, void *arg, enum nss_status *status );
+int resolver_enumerate( uint64_t *position, resolver_row row, void *arg );
+
+#endif
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */
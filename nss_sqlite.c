@@ -24,6 +24,8 @@
 
 // #pragma GCC diagnostic ignored "-Wunused-but-set-variable"
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -36,333 +38,1777 @@
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sqlite3.h>
+
+#include "hosts.h"
+#include "hosts_db.h"
+#include "hosts_snapshot.h"
+#include "nss_cache.h"
+#include "nss_config.h"
+#include "hosts_stats.h"
+#include "nss_iface.h"
+#include "nss_resolver.h"
+
+/*
+ * by_name_aliases returns every address of the name, paired with each
+ * other name that shares that address, so addresses and aliases come
+ * from one pass.  enumerate pages through the table by id for
+ * gethostent.  The forward lookups take an optional zone, to answer
+ * "name%eth0" with only the addresses on that interface.
+ */
+struct queries {
+    char *by_name;
+    char *by_addr;
+    char *by_name_aliases;
+    char *enumerate;
+};
+
+/*
+ * Version 1 dbs only have the text address.
+ */
+static struct queries queries_v1 = {
+    "SELECT address, zone FROM host WHERE hostname = ?1 AND (?2 IS NULL OR zone = ?2)",
+    "SELECT hostname FROM host WHERE address  = ?1 ORDER BY id",
+    "SELECT h.address, a.hostname FROM host h"
+    "  LEFT JOIN host a ON a.address = h.address AND a.hostname != h.hostname"
+    " WHERE h.hostname = ?1 AND (?3 IS NULL OR h.zone = ?3) ORDER BY h.id, a.id",
+    "SELECT id, hostname, address FROM host WHERE id > ?1 ORDER BY id LIMIT ?2",
+};
+
+/*
+ * Version 2 dbs are searched by binary address and family, from the
+ * (hostname,family,addr) and (addr,hostname) indexes; from version 3
+ * zone is in the first of those, so these stay index only.
+ */
+static struct queries queries_v2 = {
+    "SELECT addr, zone FROM host WHERE hostname = ?1 AND (?2 IS NULL OR zone = ?2) ORDER BY id",
+    "SELECT hostname FROM host WHERE addr     = ?1 ORDER BY id",
+    "SELECT h.addr, a.hostname FROM host h"
+    "  LEFT JOIN host a ON a.addr = h.addr AND a.hostname != h.hostname"
+    " WHERE h.hostname = ?1 AND h.family = ?2 AND (?3 IS NULL OR h.zone = ?3)"
+    " ORDER BY h.id, a.id",
+    "SELECT id, hostname, addr FROM host WHERE id > ?1 ORDER BY id LIMIT ?2",
+};
+
+/*
+ * From version 8 a name is found by name_hash, ?4, and confirmed by
+ * name_key, ?1, from the integer (name_hash,name_key,family,addr,zone)
+ * index rather than by NOCASE comparisons down by_name.
+ */
+static struct queries queries_v8 = {
+    "SELECT addr, zone FROM host WHERE name_hash = ?4 AND name_key = ?1"
+    " AND (?2 IS NULL OR zone = ?2) ORDER BY id",
+    "SELECT hostname FROM host WHERE addr     = ?1 ORDER BY id",
+    "SELECT h.addr, a.hostname FROM host h"
+    "  LEFT JOIN host a ON a.addr = h.addr AND a.hostname != h.hostname"
+    " WHERE h.name_hash = ?4 AND h.name_key = ?1 AND h.family = ?2 AND (?3 IS NULL OR h.zone = ?3)"
+    " ORDER BY h.id, a.id",
+    "SELECT id, hostname, addr FROM host WHERE id > ?1 ORDER BY id LIMIT ?2",
+};
+
+/*
+ * From version 9 rows may expire, and those that have are skipped:
+ * ?5 (?2 of by_addr, ?3 of enumerate) is the time now.  The forward
+ * lookups return when each row (and alias) expires, and stay index
+ * only as by_hash carries expires.
+ */
+static struct queries queries_v9 = {
+    "SELECT addr, zone, expires FROM host WHERE name_hash = ?4 AND name_key = ?1"
+    " AND (?2 IS NULL OR zone = ?2) AND (expires IS NULL OR expires > ?5) ORDER BY id",
+    "SELECT hostname, expires FROM host WHERE addr = ?1"
+    " AND (expires IS NULL OR expires > ?2) ORDER BY id",
+    "SELECT h.addr, a.hostname, h.expires, a.expires FROM host h"
+    "  LEFT JOIN host a ON a.addr = h.addr AND a.hostname != h.hostname"
+    "   AND (a.expires IS NULL OR a.expires > ?5)"
+    " WHERE h.name_hash = ?4 AND h.name_key = ?1 AND h.family = ?2 AND (?3 IS NULL OR h.zone = ?3)"
+    " AND (h.expires IS NULL OR h.expires > ?5)"
+    " ORDER BY h.id, a.id",
+    "SELECT id, hostname, addr FROM host WHERE id > ?1"
+    " AND (expires IS NULL OR expires > ?3) ORDER BY id LIMIT ?2",
+};
+
+/*
+ * From version 4 the names of cluster nodes are in node_name, which
+ * triggers keep as node joined to host, so they are one probe of its
+ * (name,family,addr,zone) index.  These have the same columns and
+ * parameters as by_name and by_name_aliases.
+ */
+static char *node_by_name =
+    "SELECT addr, zone FROM node_name WHERE name = ?1 AND (?2 IS NULL OR zone = ?2)";
+static char *node_by_name_aliases =
+    "SELECT addr, NULL FROM node_name"
+    " WHERE name = ?1 AND family = ?2 AND (?3 IS NULL OR zone = ?3)";
+
+/*
+ * Each thread keeps its own connection to the hosts db with the lookup
+ * statements compiled once.  A connection inherited across fork() is
+ * abandoned, and one whose db file has been replaced is reopened.
+ *
+ * The thread also keeps its own mapping of the compiled snapshot,
+ * which answers lookups instead of the db while it is fresh.
+ */
+struct connection {
+    pid_t pid;
+    dev_t dev;
+    ino_t ino;
+    struct snapshot snap;
+    int version;
+    int fallback;               /* opened immutable, no -wal file yet */
+    sqlite3      *db;
+    sqlite3_stmt *by_name;
+    sqlite3_stmt *by_addr;
+    sqlite3_stmt *by_name_aliases;
+    sqlite3_stmt *enumerate;
+    sqlite3_stmt *node_by_name;
+    sqlite3_stmt *node_by_name_aliases;
+    unsigned int seed;
+};
+
+static pthread_key_t connection_key;
+static pthread_once_t connection_once = PTHREAD_ONCE_INIT;
+static pthread_key_t range_key;
+
+/*
+ * A writer holds the db only briefly in WAL mode, so sqlite waits up
+ * to busy_timeout (ms) for it.  A lookup still busy after that is
+ * started again after a random, growing pause until retry_budget (ms)
+ * of pauses is spent, so threads that collided once do not keep
+ * colliding in step.  Both are set in nss-sqlite.conf.
+ */
+static int retry_budget;
+
+static char dbfile[PATH_MAX];
+static char walfile[PATH_MAX + sizeof("-wal")];
+static char snapfile[PATH_MAX + sizeof(".snap")];
+
+/**
+ */
+static void
+connection_close( struct connection *c ) {
+    sqlite3_finalize( c->by_name );
+    sqlite3_finalize( c->by_addr );
+    sqlite3_finalize( c->by_name_aliases );
+    sqlite3_finalize( c->enumerate );
+    sqlite3_finalize( c->node_by_name );
+    sqlite3_finalize( c->node_by_name_aliases );
+    sqlite3_close( c->db );
+    c->by_name = NULL;
+    c->by_addr = NULL;
+    c->by_name_aliases = NULL;
+    c->enumerate = NULL;
+    c->node_by_name = NULL;
+    c->node_by_name_aliases = NULL;
+    c->db = NULL;
+}
+
+/** Thread exit cleanup for the per thread connection
+ */
+static void
+connection_destroy( void *arg ) {
+    struct connection *c = (struct connection *)arg;
+    if ( c->db != NULL && c->pid == getpid() ) {
+        connection_close( c );
+    }
+    snapshot_unmap( &c->snap );
+    free( c );
+}
+
+/** Module setup, done once
+ */
+static void
+connection_init() {
+    const struct nss_config *config = nss_config();
+
+    snprintf( dbfile, sizeof(dbfile), "%s", config->database );
+    snprintf( walfile, sizeof(walfile), "%s-wal", dbfile );
+    snprintf( snapfile, sizeof(snapfile), "%s.snap", dbfile );
+    retry_budget = config->retry_budget;
+    stats_init( config->stats );
+
+    pthread_key_create( &connection_key, connection_destroy );
+    pthread_key_create( &range_key, free );
+}
+
+/**
+ */
+static int
+connection_prepare( struct connection *c, const char *sql, sqlite3_stmt **stmt ) {
+    uint64_t start = stats_start();
+    int status;
+
+    status = sqlite3_prepare_v2( c->db, sql, -1, stmt, NULL );
+    stats_sqlite( STATS_PREPARE, STATS_TIME_PREPARE, start );
+    return status == SQLITE_OK ? 0 : -1;
+}
+
+/**
+ */
+static int
+connection_open( struct connection *c, struct stat *s ) {
+    struct queries *q;
+    uint64_t start = stats_start();
+    int status;
+
+    status = nss_config_open( &c->db, 0 );
+    stats_sqlite( STATS_OPEN, STATS_TIME_OPEN, start );
+    if ( status < 0 ) goto fail;
+    c->fallback = status;
+    if ( (c->version = hosts_schema_version(c->db)) < 0 ) goto fail;
+    q = (c->version >= 9) ? &queries_v9 : (c->version >= 8) ? &queries_v8 :
+        (c->version >= 2) ? &queries_v2 : &queries_v1;
+
+    if ( connection_prepare(c, q->by_name, &c->by_name) < 0 ) goto fail;
+    if ( connection_prepare(c, q->by_addr, &c->by_addr) < 0 ) goto fail;
+    if ( connection_prepare(c, q->by_name_aliases, &c->by_name_aliases) < 0 ) goto fail;
+    if ( connection_prepare(c, q->enumerate, &c->enumerate) < 0 ) goto fail;
+    if ( c->version >= 4 ) {
+        if ( connection_prepare(c, node_by_name, &c->node_by_name) < 0 ) goto fail;
+        if ( connection_prepare(c, node_by_name_aliases, &c->node_by_name_aliases) < 0 ) goto fail;
+    }
+    c->pid = getpid();
+    c->dev = s->st_dev;
+    c->ino = s->st_ino;
+    return 0;
+
+fail:
+    connection_close( c );
+    return -1;
+}
+
+/** Reset a statement after a lookup
+ *
+ * A statement that had to be re-prepared means the schema changed
+ * under us (hosts --migrate), so the connection is closed and the
+ * next lookup picks the queries for the new version.
+ */
+static void
+connection_done( struct connection *c, sqlite3_stmt *stmt ) {
+    sqlite3_reset( stmt );
+    sqlite3_clear_bindings( stmt );
+    if ( sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_REPREPARE, 0) > 0 ) {
+        connection_close( c );
+    }
+}
+
+/** Step a lookup, riding out a busy db
+ *
+ * Until the first row has been read the statement can be started
+ * again, so a busy one is, after a jittered pause.  Past the first
+ * row a busy is returned as it is.  A reader that cannot write the
+ * -shm file is told the db is read only while a writer rebuilds it,
+ * which is as passing as a busy and is treated as one.
+ */
+static int
+connection_step( struct connection *c, sqlite3_stmt *stmt, int rows ) {
+    long budget = retry_budget * 1000L;     /* microseconds */
+    long pause = 500;
+    struct timespec ts;
+    long jittered;
+    uint64_t start;
+    int status;
+
+    while ( 1 ) {
+        start = stats_start();
+        status = sqlite3_step( stmt );
+        stats_sqlite( STATS_STEP, STATS_TIME_STEP, start );
+        if ( status == SQLITE_READONLY ) {
+            int error = sqlite3_extended_errcode( c->db );
+
+            if ( error == SQLITE_READONLY_RECOVERY || error == SQLITE_READONLY_CANTINIT ) {
+                status = SQLITE_BUSY;
+            }
+        }
+        if ( status != SQLITE_BUSY && status != SQLITE_LOCKED ) break;
+        if ( rows > 0 || budget <= 0 ) break;
+
+        jittered = pause / 2 + rand_r(&c->seed) % (pause / 2 + 1);
+        if ( jittered > budget ) jittered = budget;
+        ts.tv_sec = 0;
+        ts.tv_nsec = jittered * 1000;
+        nanosleep( &ts, NULL );
+
+        budget -= jittered;
+        if ( pause < 16000 ) pause *= 2;
+        sqlite3_reset( stmt );
+    }
+    return status;
+}
+
+/** Map the snapshot if there is one compiled from this db file
+ */
+static struct snapshot *
+connection_snapshot( struct connection *c, struct stat *db ) {
+    struct stat s, wal;
+
+    if ( stat(snapfile, &s) < 0 ) {
+        snapshot_unmap( &c->snap );
+        return NULL;
+    }
+
+    if ( c->snap.base != NULL &&
+         (c->snap.dev != s.st_dev || c->snap.ino != s.st_ino ||
+          c->snap.mtime.tv_sec != s.st_mtim.tv_sec ||
+          c->snap.mtime.tv_nsec != s.st_mtim.tv_nsec) ) {
+        snapshot_unmap( &c->snap );
+    }
+
+    if ( c->snap.base == NULL ) {
+        if ( snapshot_map(&c->snap, snapfile, &s) < 0 ) return NULL;
+    }
+
+    if ( snapshot_fresh(&c->snap, dbfile, db, stat(walfile, &wal) < 0 ? NULL : &wal) == 0 ) {
+        return NULL;
+    }
+    return &c->snap;
+}
+
+/** Return this thread's connection, opening it if needed
+ *
+ * When snap is given and a fresh snapshot is mapped it is returned
+ * there and the db is not opened.  Otherwise the statements returned
+ * are reset and have no bindings, callers must reset and clear them
+ * again before returning.
+ */
+static struct connection *
+connection( struct snapshot **snap ) {
+    struct connection *c;
+    struct stat s;
+
+    pthread_once( &connection_once, connection_init );
+
+    c = (struct connection *)pthread_getspecific( connection_key );
+    if ( c == NULL ) {
+        c = (struct connection *)calloc( 1, sizeof(*c) );
+        if ( c == NULL ) return NULL;
+        c->seed = (unsigned int)(uintptr_t)c ^ (unsigned int)getpid();
+        if ( pthread_setspecific(connection_key, c) != 0 ) {
+            free( c );
+            return NULL;
+        }
+    }
+
+    if ( c->db != NULL && c->pid != getpid() ) {
+        /* the parent still owns this one, do not touch it */
+        c->db = NULL;
+        c->by_name = NULL;
+        c->by_addr = NULL;
+        c->by_name_aliases = NULL;
+        c->enumerate = NULL;
+        c->node_by_name = NULL;
+        c->node_by_name_aliases = NULL;
+    }
+
+    if ( stat(dbfile, &s) < 0 ) {
+        if ( c->db != NULL ) connection_close( c );
+        return NULL;
+    }
+
+    if ( snap != NULL ) {
+        *snap = connection_snapshot( c, &s );
+        if ( *snap != NULL ) {
+            stats_event( STATS_SNAPSHOT );
+            return c;
+        }
+    }
+
+    if ( c->db != NULL && (c->dev != s.st_dev || c->ino != s.st_ino ||
+                           (c->fallback && nss_config_reopen())) ) {
+        connection_close( c );
+    }
+
+    if ( c->db == NULL ) {
+        if ( connection_open(c, &s) < 0 ) return NULL;
+    }
+
+    return c;
+}
+
+/*
+ * glibc answers ERANGE by doubling the buffer and calling again, and
+ * there is no way to tell it how much is needed.  So each thread
+ * remembers the size the last lookup it could not fit needed, and the
+ * retries of that same lookup that are still too small are refused
+ * without being looked up again.  The first retry big enough is the
+ * last one.  A hint is only trusted for RANGE_HINT_MS, since the db
+ * may have changed since.
+ */
+#define RANGE_HINT_MS 1000
+
+struct range_hint {
+    int kind;
+    int family;
+    size_t need;
+    uint64_t when;              /* ms, CLOCK_MONOTONIC */
+    size_t keylen;
+    char key[NI_MAXHOST];
+};
+
+/**
+ */
+static uint64_t
+range_now() {
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Refuse a retry that is still too small, or note the lookup
+ *
+ * Returns 1, with ERANGE set, if buflen is known to be too small for
+ * this lookup.
+ */
+static int
+range_refuse( int kind, int family, const void *key, size_t keylen,
+              size_t buflen, int *errnop, int *h_errnop )
+{
+    struct range_hint *h = (struct range_hint *)pthread_getspecific( range_key );
+
+    if ( h == NULL ) {
+        if ( (h = (struct range_hint *)calloc(1, sizeof(*h))) == NULL ) return 0;
+        if ( pthread_setspecific(range_key, h) != 0 ) {
+            free( h );
+            return 0;
+        }
+    }
+
+    if ( buflen < h->need && h->kind == kind && h->family == family &&
+         h->keylen == keylen && memcmp(h->key, key, keylen) == 0 &&
+         range_now() - h->when < RANGE_HINT_MS ) {
+        *errnop = ERANGE;
+        *h_errnop = NETDB_INTERNAL;
+        return 1;
+    }
+
+    h->kind = (keylen <= sizeof(h->key)) ? kind : 0;
+    h->family = family;
+    h->keylen = keylen;
+    if ( h->kind != 0 ) memcpy( h->key, key, keylen );
+    h->need = 0;
+    return 0;
+}
+
+/** Note the size the current lookup needs, it did not fit
+ */
+static void
+range_need( size_t need ) {
+    struct range_hint *h = (struct range_hint *)pthread_getspecific( range_key );
+
+    if ( h == NULL ) return;
+    h->need = need;
+    h->when = range_now();
+}
+
+/*
+ * Packs a hostent with any number of addresses and names into the
+ * caller's buffer.  Addresses are laid down from the bottom of the
+ * buffer and names from the top, and the pointer arrays go in the gap
+ * between them once all rows have been seen.  The first name packed
+ * becomes h_name, the rest are the aliases.  Duplicates are dropped.
+ *
+ * Packing never stops part way: once the buffer is full the rest is
+ * only measured, so need ends up as the size the whole hostent takes
+ * (at most, duplicates seen after that point are counted again).
+ */
+struct packer {
+    char *buffer;
+    char *addrs;
+    char *names;
+    char *end;
+    int length;
+    int naddrs;
+    int nnames;
+    int full;
+    size_t need;
+    time_t expires;             /* of the first row packed to expire */
+};
+
+/** Keep the earlier of two expiry times, 0 being never
+ */
+static void
+expires_min( time_t *expires, time_t when ) {
+    if ( when > 0 && (*expires == 0 || when < *expires) ) *expires = when;
+}
+
+/**
+ */
+static void
+pack_init( struct packer *p, char *buffer, size_t buflen, int length ) {
+    uintptr_t pad = -(uintptr_t)buffer % __alignof__(char *);
+
+    p->need = pad;
+    p->full = (pad > buflen);
+    if ( p->full ) pad = buflen;
+    p->buffer = buffer + pad;
+    p->addrs = p->buffer;
+    p->end = buffer + buflen;
+    p->names = p->end;
+    p->length = length;
+    p->naddrs = 0;
+    p->nnames = 0;
+    p->expires = 0;
+}
+
+/**
+ */
+static void
+pack_address( struct packer *p, const void *addr ) {
+    char *a;
+
+    for ( a = p->buffer ; a < p->addrs ; a += p->length ) {
+        if ( memcmp(a, addr, p->length) == 0 ) return;
+    }
+    p->need += p->length;
+    p->naddrs++;
+    if ( p->full || p->names - p->addrs < p->length ) {
+        p->full = 1;
+        return;
+    }
+    memcpy( p->addrs, addr, p->length );
+    p->addrs += p->length;
+}
+
+/**
+ */
+static void
+pack_name( struct packer *p, const char *name ) {
+    size_t delta = strlen( name ) + 1;
+    char *n;
+
+    for ( n = p->names ; n < p->end ; n += strlen(n) + 1 ) {
+        if ( hosts_same_name(n, name) ) return;
+    }
+    p->need += delta;
+    p->nnames++;
+    if ( p->full || (size_t)(p->names - p->addrs) < delta ) {
+        p->full = 1;
+        return;
+    }
+    p->names -= delta;
+    memcpy( p->names, name, delta );
+}
+
+/** Pack a name found in the db
+ *
+ * A wildcard is a pattern, not a name, so it is never returned.
+ */
+static void
+pack_alias( struct packer *p, const char *name ) {
+    if ( hosts_wildcard(name) ) return;
+    pack_name( p, name );
+}
+
+/** Lay out the pointer arrays and fill in the hostent
+ *
+ * The names were packed downwards, so walking up from the lowest one
+ * visits them newest first.  The pointers are aligned after the
+ * addresses, which start aligned, so their pad is known even when
+ * nothing past the first overflow was written.  Returns -1, with need
+ * complete, if the hostent does not fit.
+ */
+static int
+pack_hostent( struct packer *p, struct hostent *result, int family ) {
+    uintptr_t pad = -(uintptr_t)(p->naddrs * p->length) % __alignof__(char *);
+    size_t delta = pad + sizeof(char *) * (p->naddrs + 1 + p->nnames);
+    char **pointers;
+    char *n;
+    int i;
+
+    p->need += delta;
+    if ( p->nnames < 1 ) return -1;
+    if ( p->full || (size_t)(p->names - p->addrs) < delta ) {
+        p->full = 1;
+        return -1;
+    }
+
+    pointers = (char **)(p->addrs + pad);
+
+    result->h_addrtype = family;
+    result->h_length = p->length;
+    result->h_addr_list = pointers;
+    for ( i = 0 ; i < p->naddrs ; i++ ) {
+        result->h_addr_list[i] = p->buffer + i * p->length;
+    }
+    result->h_addr_list[i] = NULL;
+
+    result->h_aliases = pointers + p->naddrs + 1;
+    result->h_aliases[p->nnames - 1] = NULL;
+    i = p->nnames - 1;
+    for ( n = p->names ; n < p->end ; n += strlen(n) + 1 ) {
+        if ( i == 0 ) {
+            result->h_name = n;
+        } else {
+            result->h_aliases[--i] = n;
+        }
+    }
+
+    return 0;
+}
+
+/** Split a "name%zone" lookup into the name and the zone
+ *
+ * The name is copied out to bare when it has a zone.  Returns NULL
+ * for a name too long to be in the db.
+ */
+static const char *
+split_zone( const char *name, char *bare, size_t size, const char **zone ) {
+    const char *percent = strchr( name, '%' );
+    size_t length;
+
+    *zone = NULL;
+    if ( percent == NULL ) return name;
+
+    length = percent - name;
+    if ( length >= size ) return NULL;
+    memcpy( bare, name, length );
+    bare[length] = '\0';
+    *zone = percent + 1;
+    return bare;
+}
+
+/** Does an address of the given zone answer a lookup for want?
+ */
+static int
+zone_matches( const char *zone, const char *want ) {
+    if ( want == NULL ) return 1;
+    return zone != NULL && strcasecmp( zone, want ) == 0;
+}
+
+/** Copy a snapshot record out as a hostent
+ *
+ * A forward lookup passes the name asked for so it stays h_name, and
+ * the zone if only the addresses on that interface are wanted.
+ */
+static enum nss_status
+snapshot_hostent( const struct snapshot *snap, const struct snapshot_record *r,
+                  const char *name, const char *zone, struct hostent *result,
+                  char *buffer, size_t buflen,
+                  int *errnop, int *h_errnop, time_t *expires )
+{
+    struct packer packer;
+    int i;
+
+    if ( r == NULL ) return NSS_STATUS_NOTFOUND;
+
+    pack_init( &packer, buffer, buflen, r->length );
+    if ( name != NULL ) pack_name( &packer, name );
+    for ( i = 0 ; i < r->nnames ; i++ ) {
+        pack_alias( &packer, snapshot_string(snap, r->names[i]) );
+    }
+    for ( i = 0 ; i < r->naddrs ; i++ ) {
+        if ( zone_matches(snapshot_zone(snap, r, i), zone) == 0 ) continue;
+        pack_address( &packer, snapshot_address(r, i) );
+    }
+    if ( packer.naddrs == 0 || packer.nnames == 0 ) return NSS_STATUS_NOTFOUND;
+    if ( pack_hostent(&packer, result, r->family) < 0 ) goto range_error;
+
+    *expires = r->expires;
+    return NSS_STATUS_SUCCESS;
+
+range_error:
+    range_need( packer.need );
+    *errnop = ERANGE;
+    *h_errnop = NETDB_INTERNAL;
+    return NSS_STATUS_TRYAGAIN;
+}
+
+/*
+ * Where a cached result is copied out to.
+ */
+struct fill {
+    const char *name;
+    struct hostent *result;
+    struct gaih_addrtuple **pat;
+    char *buffer;
+    size_t buflen;
+    int *errnop;
+    int *h_errnop;
+    time_t expires;             /* set by the fill */
+};
+
+/** Copy a cached result out as a hostent
+ */
+static enum nss_status
+fill_hostent( const struct cache_entry *e, void *arg ) {
+    struct fill *f = (struct fill *)arg;
+    struct packer packer;
+    const char *n;
+    int i;
+
+    pack_init( &packer, f->buffer, f->buflen, hosts_address_length(e->family) );
+    if ( f->name != NULL ) pack_name( &packer, f->name );
+    for ( i = 0, n = e->names ; i < e->nnames ; i++, n += strlen(n) + 1 ) {
+        pack_name( &packer, n );
+    }
+    for ( i = 0 ; i < e->naddrs ; i++ ) {
+        pack_address( &packer, e->addrs[i].addr );
+    }
+    if ( pack_hostent(&packer, f->result, e->family) < 0 ) goto range_error;
+
+    f->expires = e->expires;
+    return NSS_STATUS_SUCCESS;
+
+range_error:
+    range_need( packer.need );
+    *f->errnop = ERANGE;
+    *f->h_errnop = NETDB_INTERNAL;
+    return NSS_STATUS_TRYAGAIN;
+}
+
+/** The status of an answer copied out of hosts-resolverd or the cache
+ *
+ * A fill only fails for want of room, so errnop is ERANGE for any
+ * TRYAGAIN, whatever the caller left in it, as lookup_done expects.
+ */
+static enum nss_status
+fetched( enum nss_status status, int *errnop ) {
+    if ( status == NSS_STATUS_TRYAGAIN ) *errnop = ERANGE;
+    return status;
+}
+
+/** Is this a name node_name holds, <uuid>.node or peer<N>?
+ */
+static int
+node_name( const char *name ) {
+    size_t length = strlen( name );
+
+    if ( length > 5 && strcasecmp(name + length - 5, ".node") == 0 ) return 1;
+    if ( strncasecmp(name, "peer", 4) != 0 || name[4] == '\0' ) return 0;
+    for ( name += 4 ; *name != '\0' ; name++ ) {
+        if ( *name < '0' || *name > '9' ) return 0;
+    }
+    return 1;
+}
+
+/** Bind the name a forward query looks for
+ *
+ * From version 8 that is its key, and its hash as ?4 of a statement
+ * that has one (node_name is still searched by name).
+ */
+static int
+bind_name( struct connection *c, sqlite3_stmt *stmt, const char *name ) {
+    char key[NI_MAXHOST];
+
+    if ( c->version < 8 ) return sqlite3_bind_text( stmt, 1, name, -1, SQLITE_STATIC );
+    if ( hosts_name_key(name, key, sizeof(key)) < 0 ) return SQLITE_TOOBIG;
+    if ( sqlite3_bind_text(stmt, 1, key, -1, SQLITE_TRANSIENT) != SQLITE_OK ) return SQLITE_ERROR;
+    if ( sqlite3_bind_parameter_count(stmt) < 4 ) return SQLITE_OK;
+    return sqlite3_bind_int64( stmt, 4, hosts_name_hash(key) );
+}
+
+/** Bind the time now, that rows must not have expired by
+ *
+ * Only from version 9, and only to a statement that takes it (node_name
+ * rows never expire).
+ */
+static int
+bind_now( struct connection *c, sqlite3_stmt *stmt, int parameter ) {
+    if ( c->version < 9 ) return SQLITE_OK;
+    if ( sqlite3_bind_parameter_count(stmt) < parameter ) return SQLITE_OK;
+    return sqlite3_bind_int64( stmt, parameter, time(NULL) );
+}
+
+/** When the row read expires, 0 for never or a query without expires
+ */
+static time_t
+column_expires( sqlite3_stmt *stmt, int column ) {
+    if ( column >= sqlite3_column_count(stmt) ) return 0;
+    return (time_t)sqlite3_column_int64( stmt, column );
+}
+
+/** Run a forward query for a hostent, packing addresses and aliases
+ *
+ * rows counts the rows read, so a caller can tell a name with no
+ * address of this family from a name that is not there at all.
+ */
+static enum nss_status
+query_byname2( struct connection *c, sqlite3_stmt *stmt,
+               const char *name, const char *zone, int family,
+               struct packer *packer, int *rows, int *errnop )
+{
+    enum nss_status status = NSS_STATUS_NOTFOUND;
+    struct in6_addr addr;
+
+    if ( bind_name(c, stmt, name) != SQLITE_OK ) {
+        goto reset;
+    }
+    if ( c->version >= 2 && sqlite3_bind_int(stmt, 2, family) != SQLITE_OK ) {
+        goto reset;
+    }
+    if ( zone != NULL && sqlite3_bind_text(stmt, 3, zone, -1, SQLITE_STATIC) != SQLITE_OK ) {
+        goto reset;
+    }
+    if ( bind_now(c, stmt, 5) != SQLITE_OK ) {
+        goto reset;
+    }
+
+    while (1) {
+        const char *alias;
+        int lookup = connection_step( c, stmt, *rows );
+
+        if ( lookup == SQLITE_DONE ) break;
+        if ( lookup == SQLITE_BUSY || lookup == SQLITE_LOCKED ) {
+            status = NSS_STATUS_TRYAGAIN;
+            *errnop = EAGAIN;
+            goto reset;
+        }
+        if ( lookup != SQLITE_ROW ) goto reset;
+        (*rows)++;
+
+        if ( hosts_column_address(stmt, 0, &addr) != family ) continue;
+        pack_address( packer, &addr );
+        expires_min( &packer->expires, column_expires(stmt, 2) );
+
+        alias = (const char *)sqlite3_column_text( stmt, 1 );
+        if ( alias != NULL ) {
+            pack_alias( packer, alias );
+            expires_min( &packer->expires, column_expires(stmt, 3) );
+        }
+    }
+
+    if ( packer->naddrs > 0 ) status = NSS_STATUS_SUCCESS;
+
+reset:
+    connection_done( c, stmt );
+    return status;
+}
+
+/**
+ * The rows of query are returned as name, which differ when query is
+ * the wildcard answering it.  A node name is looked for in node_name
+ * first, and then in the host table in case a host really is called
+ * peer1.  Node names are not compiled into the snapshot.
+ */
+static enum nss_status
+lookup_byname2( const char *name, const char *query, const char *zone, int family,
+                struct hostent *result,
+                char *buffer, size_t buflen,
+                int *errnop, int *h_errnop, time_t *expires )
+{
+    enum nss_status status = NSS_STATUS_NOTFOUND;
+
+    struct packer packer;
+    int length;
+
+    struct connection *c;
+    struct snapshot *snap = NULL;
+    int node = node_name( query );
+    int rows = 0;
+
+    switch ( family ) {
+    case AF_INET6: length = sizeof(struct in6_addr); break;
+    case AF_INET:  length = sizeof(struct in_addr); break;
+    default:
+        *errnop = EAFNOSUPPORT;
+        *h_errnop = NO_RECOVERY;
+        return NSS_STATUS_UNAVAIL;
+    }
+
+    if ( (c = connection(node ? NULL : &snap)) == NULL ) return status;
+    if ( snap != NULL ) {
+        return snapshot_hostent( snap, snapshot_by_name(snap, query, family), name, zone,
+                                 result, buffer, buflen, errnop, h_errnop, expires );
+    }
+
+    pack_init( &packer, buffer, buflen, length );
+    pack_name( &packer, name );
+
+    if ( node && c->node_by_name_aliases != NULL ) {
+        status = query_byname2( c, c->node_by_name_aliases, query, zone, family,
+                                &packer, &rows, errnop );
+    }
+    if ( status == NSS_STATUS_NOTFOUND && rows == 0 && c->db != NULL ) {
+        status = query_byname2( c, c->by_name_aliases, query, zone, family,
+                                &packer, &rows, errnop );
+    }
+
+    if ( status == NSS_STATUS_SUCCESS ) {
+        if ( pack_hostent(&packer, result, family) < 0 ) goto range_error;
+        *expires = packer.expires;
+    }
+    return status;
+
+range_error:
+    range_need( packer.need );
+    *errnop = ERANGE;
+    *h_errnop = NETDB_INTERNAL;
+    return NSS_STATUS_TRYAGAIN;
+}
+
+/** Does query have an address of family, in zone if one is given?
+ *
+ * The addresses are only counted, into a packer with no buffer.
+ * Returns SUCCESS if it has, NOTFOUND if not and TRYAGAIN if the db
+ * is busy.
+ */
+static enum nss_status
+lookup_known( const char *query, const char *zone, int family, int *errnop )
+{
+    enum nss_status status = NSS_STATUS_NOTFOUND;
+
+    struct packer packer;
+
+    struct connection *c;
+    struct snapshot *snap = NULL;
+    const struct snapshot_record *r;
+    int node = node_name( query );
+    int rows = 0;
+    int i;
+
+    if ( (c = connection(node ? NULL : &snap)) == NULL ) return status;
+    if ( snap != NULL ) {
+        if ( (r = snapshot_by_name(snap, query, family)) == NULL ) return status;
+        for ( i = 0 ; i < r->naddrs ; i++ ) {
+            if ( zone_matches(snapshot_zone(snap, r, i), zone) ) return NSS_STATUS_SUCCESS;
+        }
+        return status;
+    }
+
+    pack_init( &packer, NULL, 0, hosts_address_length(family) );
+
+    if ( node && c->node_by_name_aliases != NULL ) {
+        status = query_byname2( c, c->node_by_name_aliases, query, zone, family,
+                                &packer, &rows, errnop );
+    }
+    if ( status == NSS_STATUS_NOTFOUND && rows == 0 && c->db != NULL ) {
+        status = query_byname2( c, c->by_name_aliases, query, zone, family,
+                                &packer, &rows, errnop );
+    }
+    return status;
+}
+
+/** Forward lookup of one family, falling back to wildcards
+ *
+ * A name with no address of any family is answered by the longest
+ * wildcard above it, "*.svc.cluster" for a.b.svc.cluster before
+ * "*.cluster", so gethostbyname2_r and gethostbyname4_r agree.  A name
+ * with only addresses of the other family is NO_DATA, the wildcard
+ * does not override it.  Each try is a probe of by_hash (or of the
+ * snapshot's name index) per family, so a miss costs two per label.
+ */
+static enum nss_status
+wildcard_byname2( const char *name, const char *zone, int family,
+                  struct hostent *result,
+                  char *buffer, size_t buflen,
+                  int *errnop, int *h_errnop, time_t *expires )
+{
+    const char *suffix = hosts_wildcard( name ) ? name + 2 : name;
+    const char *query = name;
+    int other = (family == AF_INET) ? AF_INET6 : AF_INET;
+    char wild[NI_MAXHOST];
+    enum nss_status status, known;
+
+    status = lookup_byname2( name, query, zone, family, result, buffer, buflen,
+                             errnop, h_errnop, expires );
+    while ( status == NSS_STATUS_NOTFOUND ) {
+        known = lookup_known( query, zone, other, errnop );
+        if ( known == NSS_STATUS_SUCCESS ) {
+            *h_errnop = NO_DATA;
+            break;
+        }
+        if ( known == NSS_STATUS_TRYAGAIN ) return known;
+        if ( hosts_wildcard_next(&suffix, wild, sizeof(wild)) == 0 ) {
+            *h_errnop = HOST_NOT_FOUND;
+            break;
+        }
+        query = wild;
+        status = lookup_byname2( name, query, zone, family, result, buffer, buflen,
+                                 errnop, h_errnop, expires );
+    }
+    return status;
+}
+
+/** Make sure the module is set up and start timing a lookup
+ */
+static uint64_t
+lookup_start() {
+    pthread_once( &connection_once, connection_init );
+    return stats_start();
+}
+
+/** Count the outcome of a lookup against its entry point
+ */
+static enum nss_status
+lookup_done( enum stats_entry entry, enum nss_status status, int *errnop, uint64_t start ) {
+    enum stats_outcome outcome;
+
+    switch ( status ) {
+    case NSS_STATUS_SUCCESS:  outcome = STATS_FOUND; break;
+    case NSS_STATUS_NOTFOUND: outcome = STATS_NOTFOUND; break;
+    case NSS_STATUS_TRYAGAIN:
+        outcome = (*errnop == ERANGE) ? STATS_ERANGE : STATS_TRYAGAIN;
+        break;
+    default:                  outcome = STATS_UNAVAIL; break;
+    }
+    stats_lookup( entry, outcome, start );
+    return status;
+}
 
-#include <sqlite3.h>
+/** Report how long an answer may be kept
+ *
+ * ttlp is left alone for an answer from rows that never expire, so
+ * the caller's default applies.
+ */
+static void
+answer_ttl( time_t expires, int32_t *ttlp ) {
+    time_t now;
+
+    if ( ttlp == NULL || expires == 0 ) return;
+    now = time( NULL );
+    if ( expires <= now ) {
+        *ttlp = 0;
+    } else if ( expires - now > INT32_MAX ) {
+        *ttlp = INT32_MAX;
+    } else {
+        *ttlp = (int32_t)(expires - now);
+    }
+}
 
-#include "hosts.h"
+/** Forward lookup of one family
+ *
+ * hosts-resolverd is asked first, if it is running, except for node
+ * names, which it does not hold.  Otherwise results, including misses,
+ * are cached until the db changes, under the name as asked for, zone
+ * and all.  An answer from rows that expire reports the time left in
+ * ttlp, and h_name is the canonical name.
+ */
+static enum nss_status
+cached_byname2( const char *name, int family,
+                struct hostent *result,
+                char *buffer, size_t buflen,
+                int *errnop, int *h_errnop,
+                int32_t *ttlp, char **canonp )
+{
+    struct fill fill = { name, result, NULL, buffer, buflen, errnop, h_errnop };
+    enum nss_status status;
+    uint64_t generation;
+    time_t expires = 0;
+    size_t length = strlen( name );
+    char bare[NI_MAXHOST];
+    const char *zone;
+
+    if ( range_refuse(CACHE_BYNAME, family, name, length, buflen, errnop, h_errnop) ) {
+        return NSS_STATUS_TRYAGAIN;
+    }
+    if ( (fill.name = split_zone(name, bare, sizeof(bare), &zone)) == NULL ) {
+        return NSS_STATUS_NOTFOUND;
+    }
 
-static char *by_name = "SELECT address  FROM host WHERE hostname = ?";
-static char *by_addr = "SELECT hostname FROM host WHERE address  = ?";
+    if ( node_name(fill.name) == 0 &&
+         resolver_fetch(RESOLVER_BYNAME, family, name, length, fill_hostent, &fill, &status) ) {
+        stats_event( STATS_RESOLVER );
+        status = fetched( status, errnop );
+        expires = fill.expires;
+        goto done;
+    }
 
-struct in6_data {
-    struct in6_addr address;
-    char *addresses[2];
-    char *aliases[1];
-    char hostname[80];
-};
+    if ( cache_fetch(CACHE_BYNAME, family, name, length, &generation,
+                     fill_hostent, &fill, &status) ) {
+        stats_event( STATS_CACHE_HIT );
+        status = fetched( status, errnop );
+        expires = fill.expires;
+        goto done;
+    }
+    stats_event( STATS_CACHE_MISS );
+
+    status = wildcard_byname2( fill.name, zone, family, result, buffer, buflen,
+                               errnop, h_errnop, &expires );
+
+    switch ( status ) {
+    case NSS_STATUS_SUCCESS:
+        cache_store_hostent( CACHE_BYNAME, family, name, length, generation, result, expires );
+        break;
+    case NSS_STATUS_NOTFOUND:
+        cache_store_hostent( CACHE_BYNAME, family, name, length, generation, NULL, 0 );
+        break;
+    default:
+        break;
+    }
+
+done:
+    if ( status == NSS_STATUS_SUCCESS ) {
+        answer_ttl( expires, ttlp );
+        if ( canonp != NULL ) *canonp = result->h_name;
+    }
+    return status;
+}
+
+/**
+ */
+enum nss_status
+_nss_sqlite_gethostbyname2_r( const char *name, int family, 
+                           struct hostent *result,
+                           char *buffer, size_t buflen,
+                           int *errnop, int *h_errnop )
+{
+    uint64_t start = lookup_start();
+    return lookup_done( STATS_BYNAME2,
+                        cached_byname2(name, family, result, buffer, buflen, errnop, h_errnop,
+                                       NULL, NULL),
+                        errnop, start );
+}
+
+/**
+ */
+enum nss_status
+_nss_sqlite_gethostbyname_r( const char *name, struct hostent *result,
+                          char *buffer, size_t buflen,
+                          int *errnop, int *h_errnop )
+{
+    uint64_t start = lookup_start();
+    return lookup_done( STATS_BYNAME,
+                        cached_byname2(name, AF_INET, result, buffer, buflen, errnop, h_errnop,
+                                       NULL, NULL),
+                        errnop, start );
+}
+
+/** Lookups for getaddrinfo and related functions
+ *
+ * ttlp is set for an answer whose rows expire, and canonp to h_name.
+ */
+enum nss_status
+_nss_sqlite_gethostbyname3_r( const char *name, int family, 
+                           struct hostent *result,
+                           char *buffer, size_t buflen,
+                           int *errnop, int *h_errnop,
+                           int32_t *ttlp, char **canonp )
+{
+    uint64_t start = lookup_start();
+    return lookup_done( STATS_BYNAME3,
+                        cached_byname2(name, family, result, buffer, buflen, errnop, h_errnop,
+                                       ttlp, canonp),
+                        errnop, start );
+}
 
-struct in4_data {
-    struct in6_addr address;
-    char *addresses[2];
-    char *aliases[1];
-    char hostname[80];
+/*
+ * The gaih_addrtuple chain being built for gethostbyname4_r.  Tuples
+ * already chained in by the caller are filled before new ones are
+ * carved out of the buffer, as nss_files does.  As with the packer,
+ * once the buffer is full the rest of the chain is only measured.
+ */
+struct tuples {
+    struct gaih_addrtuple **pat;
+    struct gaih_addrtuple **tailp;
+    char *h_name;
+    char *buffer;
+    char *bufp;
+    size_t length;
+    int full;
+    size_t need;
+    int count;                  /* of the tuples filled in */
+    time_t expires;             /* of the first row added to expire */
 };
 
 /**
  */
-static size_t
-strlcpy(char *dst, const char *src, size_t siz) {
-    char *d = dst;
-    const char *s = src;
-    size_t n = siz;
+static void
+tuples_init( struct tuples *t, struct gaih_addrtuple **pat,
+             const char *name, char *buffer, size_t buflen ) {
+    size_t delta = strlen( name ) + 1;
+
+    t->pat = t->tailp = pat;
+    t->buffer = buffer;
+    t->expires = 0;
+    t->count = 0;
+    t->need = delta;
+    t->full = (buflen < delta);
+    if ( t->full ) return;
+    t->h_name = memcpy( buffer, name, delta );
+    t->bufp = buffer + delta;
+    t->length = buflen - delta;
+}
 
-    /* Copy as many bytes as will fit */
-    if (n != 0) {
-        while (--n != 0) {
-            if ((*d++ = *s++) == '\0') break;
+/**
+ */
+static void
+tuples_add( struct tuples *t, int family, const void *addr, const char *zone ) {
+    struct gaih_addrtuple *tuple;
+
+    if ( t->full || *t->tailp == NULL ) {
+        uintptr_t pad = -(uintptr_t)(t->buffer + t->need) % __alignof__(struct gaih_addrtuple);
+        size_t delta = pad + sizeof(struct gaih_addrtuple);
+
+        t->need += delta;
+        if ( t->full || t->length < delta ) {
+            t->full = 1;
+            return;
         }
+        *t->tailp = (struct gaih_addrtuple *)(t->bufp + pad);
+        (*t->tailp)->next = NULL;
+        t->bufp += delta; t->length -= delta;
     }
-    /* Not enough room in dst, add NUL and traverse rest of src */
-    if (n == 0) {
-        if (siz != 0) *d = '\0';                /* NUL-terminate dst */
-        while (*s++) ;
+
+    tuple = *t->tailp;
+    tuple->name = (t->tailp == t->pat) ? t->h_name : NULL;
+    tuple->family = family;
+    memset( tuple->addr, 0, sizeof(tuple->addr) );
+    memcpy( tuple->addr, addr,
+            family == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr) );
+    tuple->scopeid = (family == AF_INET6) ? iface_index( zone ) : 0;
+    t->tailp = &tuple->next;
+    t->count++;
+}
+
+/** Add the addresses of a snapshot record in zone (or any) to the chain
+ */
+static int
+tuples_add_record( struct tuples *t, const struct snapshot *snap,
+                   const struct snapshot_record *r, const char *zone ) {
+    int added = 0;
+    int i;
+
+    if ( r == NULL ) return 0;
+    for ( i = 0 ; i < r->naddrs ; i++ ) {
+        const char *z = snapshot_zone( snap, r, i );
+
+        if ( zone_matches(z, zone) == 0 ) continue;
+        tuples_add( t, r->family, snapshot_address(r, i), z );
+        added++;
     }
-    return(s - src - 1);        /* count does not include NUL */
+    if ( added > 0 ) expires_min( &t->expires, r->expires );
+    return added;
 }
 
-/**
+/** Copy a cached result out as a tuple chain
  */
 static enum nss_status
-populate( sqlite3_stmt *stmt,
-          struct hostent *result, char *buffer, size_t length,
-          int *errnop )
-{
-    const char *hostname;
-    const char *address;
+fill_tuples( const struct cache_entry *e, void *arg ) {
+    struct fill *f = (struct fill *)arg;
+    struct tuples tuples;
+    int i;
+
+    tuples_init( &tuples, f->pat, f->name, f->buffer, f->buflen );
+    for ( i = 0 ; i < e->naddrs ; i++ ) {
+        tuples_add( &tuples, e->addrs[i].family, e->addrs[i].addr, e->addrs[i].zone );
+    }
+    if ( tuples.full ) goto range_error;
+    f->expires = e->expires;
+    return NSS_STATUS_SUCCESS;
 
-    int delta;
-    char *bufp;
-    struct in6_addr *inet6_addr;
-    struct in_addr  *inet_addr;
+range_error:
+    range_need( tuples.need );
+    *f->errnop = ERANGE;
+    *f->h_errnop = NETDB_INTERNAL;
+    return NSS_STATUS_TRYAGAIN;
+}
 
-    if ( stmt == NULL ) {
-        return NSS_STATUS_NOTFOUND;
+/** Run a forward query, adding every address to the tuple chain
+ */
+static enum nss_status
+query_byname4( struct connection *c, sqlite3_stmt *stmt,
+               const char *name, const char *zone,
+               struct tuples *tuples, int *rows, int *errnop )
+{
+    enum nss_status status = NSS_STATUS_NOTFOUND;
+
+    if ( bind_name(c, stmt, name) != SQLITE_OK ) {
+        goto reset;
+    }
+    if ( zone != NULL && sqlite3_bind_text(stmt, 2, zone, -1, SQLITE_STATIC) != SQLITE_OK ) {
+        goto reset;
+    }
+    if ( bind_now(c, stmt, 5) != SQLITE_OK ) {
+        goto reset;
     }
 
-    memset( result, 0, sizeof(*result) );
+    while (1) {
+        struct in6_addr addr;
+        const char *interface;
+        int family;
+        int lookup = connection_step( c, stmt, *rows );
 
-    hostname = (const char *)sqlite3_column_text( stmt, 0 );
-    address = (const char *)sqlite3_column_text( stmt, 1 );
+        if ( lookup == SQLITE_DONE ) break;
+        if ( lookup == SQLITE_BUSY || lookup == SQLITE_LOCKED ) {
+            status = NSS_STATUS_TRYAGAIN;
+            *errnop = EAGAIN;
+            goto reset;
+        }
+        if ( lookup != SQLITE_ROW ) goto reset;
+        (*rows)++;
 
-    bufp = buffer;
+        if ( (family = hosts_column_address(stmt, 0, &addr)) == 0 ) continue;
 
-    if ( inet_pton(AF_INET6, address, buffer) > 0 ) {
-        inet6_addr = (struct in6_addr *)bufp;
-        delta = sizeof(struct in6_addr);
-        result->h_addrtype = AF_INET6;
-        result->h_length = sizeof(struct in6_addr);
+        interface = (const char *)sqlite3_column_text( stmt, 1 );
+        tuples_add( tuples, family, &addr, interface );
+        expires_min( &tuples->expires, column_expires(stmt, 2) );
+        status = NSS_STATUS_SUCCESS;
     }
 
-    if ( inet_pton(AF_INET, address, buffer) > 0 ) {
-        inet_addr = (struct in_addr *)bufp;
-        delta = sizeof(struct in_addr);
-        result->h_addrtype = AF_INET;
-        result->h_length = sizeof(struct in_addr);
-    }
+reset:
+    connection_done( c, stmt );
+    return status;
+}
+
+/**
+ * The rows of query are returned as name, and node names are looked
+ * for, as in lookup_byname2.  naddrs is set to the number of tuples
+ * filled in, which may be fewer than the caller chained in.
+ */
+static enum nss_status
+lookup_byname4( const char *name, const char *query, const char *zone,
+                struct gaih_addrtuple **pat,
+                char *buffer, size_t buflen,
+                int *errnop, int *h_errnop, time_t *expires, int *naddrs )
+{
+    enum nss_status status = NSS_STATUS_NOTFOUND;
 
-    if ( length < delta ) goto range_error;
-    bufp += delta; length -= delta;
+    struct tuples tuples;
 
-    result->h_addr_list = (char **)bufp;
-    delta = sizeof(char*) * 2;
-    if ( length < delta ) goto range_error;
-    bufp += delta; length -= delta;
+    struct connection *c;
+    struct snapshot *snap = NULL;
+    int node = node_name( query );
+    int rows = 0;
 
-    result->h_addr_list[0] = buffer;
-    result->h_addr_list[1] = 0;
+    tuples_init( &tuples, pat, name, buffer, buflen );
 
-    result->h_name = bufp;
-    delta = strlcpy( result->h_name, hostname, length );
-    if ( length < delta ) goto range_error;
-    bufp += delta; length -= delta;
+    if ( (c = connection(node ? NULL : &snap)) == NULL ) goto notfound;
+    if ( snap != NULL ) {
+        int found;
 
-    result->h_aliases = (char **)bufp;
-    result->h_aliases[0] = 0;
+        found = tuples_add_record( &tuples, snap, snapshot_by_name(snap, query, AF_INET), zone );
+        found += tuples_add_record( &tuples, snap, snapshot_by_name(snap, query, AF_INET6), zone );
+        if ( found > 0 ) status = NSS_STATUS_SUCCESS;
+        goto notfound;
+    }
 
-    return NSS_STATUS_SUCCESS;
+    if ( node && c->node_by_name != NULL ) {
+        status = query_byname4( c, c->node_by_name, query, zone, &tuples, &rows, errnop );
+    }
+    if ( status == NSS_STATUS_NOTFOUND && rows == 0 && c->db != NULL ) {
+        status = query_byname4( c, c->by_name, query, zone, &tuples, &rows, errnop );
+    }
+
+notfound:
+    if ( status == NSS_STATUS_SUCCESS && tuples.full ) goto range_error;
+    if ( status == NSS_STATUS_NOTFOUND ) *h_errnop = HOST_NOT_FOUND;
+    *expires = tuples.expires;
+    *naddrs = tuples.count;
+    return status;
 
 range_error:
+    range_need( tuples.need );
     *errnop = ERANGE;
+    *h_errnop = NETDB_INTERNAL;
     return NSS_STATUS_TRYAGAIN;
 }
 
 /**
+ * As wildcard_byname2, for all families at once.
  */
-enum nss_status
-_nss_sqlite_gethostbyname2_r( const char *name, int family, 
-                           struct hostent *result,
-                           char *buffer, size_t buflen,
-                           int *errnop, int *h_errnop )
+static enum nss_status
+wildcard_byname4( const char *name, const char *zone, struct gaih_addrtuple **pat,
+                  char *buffer, size_t buflen,
+                  int *errnop, int *h_errnop, time_t *expires, int *naddrs )
 {
-    enum nss_status status = NSS_STATUS_NOTFOUND;
-
-    struct in6_data *data6 = (struct in6_data *)buffer;
-    struct in4_data *data4 = (struct in4_data *)buffer;
+    const char *suffix = hosts_wildcard( name ) ? name + 2 : name;
+    char wild[NI_MAXHOST];
+    enum nss_status status;
 
-    sqlite3      *db = NULL;
-    sqlite3_stmt *stmt = NULL;
-
-    if ( sqlite3_open(HOSTSDB, &db) != SQLITE_OK ) goto close;
-    if ( sqlite3_prepare(db, by_name, strlen(by_name), &stmt, NULL) != SQLITE_OK ) {
-        goto close;
+    status = lookup_byname4( name, name, zone, pat, buffer, buflen, errnop, h_errnop, expires, naddrs );
+    while ( status == NSS_STATUS_NOTFOUND && hosts_wildcard_next(&suffix, wild, sizeof(wild)) ) {
+        status = lookup_byname4( name, wild, zone, pat, buffer, buflen, errnop, h_errnop, expires, naddrs );
     }
+    return status;
+}
 
-    if ( sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ) {
-        goto finalize;
+/**
+ * As cached_byname2, hosts-resolverd first and then the cache.
+ */
+static enum nss_status
+cached_byname4( const char *name, struct gaih_addrtuple **pat,
+                char *buffer, size_t buflen,
+                int *errnop, int *h_errnop, int32_t *ttlp )
+{
+    struct fill fill = { name, NULL, pat, buffer, buflen, errnop, h_errnop };
+    enum nss_status status;
+    uint64_t generation;
+    time_t expires = 0;
+    int naddrs = 0;
+    char bare[NI_MAXHOST];
+    const char *zone;
+
+    if ( range_refuse(CACHE_BYNAME4, 0, name, strlen(name), buflen, errnop, h_errnop) ) {
+        return NSS_STATUS_TRYAGAIN;
+    }
+    if ( (fill.name = split_zone(name, bare, sizeof(bare), &zone)) == NULL ) {
+        *h_errnop = HOST_NOT_FOUND;
+        return NSS_STATUS_NOTFOUND;
     }
 
-    while (1) {
-        size_t delta;
+    if ( node_name(fill.name) == 0 &&
+         resolver_fetch(RESOLVER_BYNAME, 0, name, strlen(name), fill_tuples, &fill, &status) ) {
+        stats_event( STATS_RESOLVER );
+        status = fetched( status, errnop );
+        if ( status == NSS_STATUS_NOTFOUND ) *h_errnop = HOST_NOT_FOUND;
+        expires = fill.expires;
+        goto done;
+    }
 
-        const char *address;
-        int lookup = sqlite3_step( stmt );
+    if ( cache_fetch(CACHE_BYNAME4, 0, name, strlen(name), &generation,
+                     fill_tuples, &fill, &status) ) {
+        stats_event( STATS_CACHE_HIT );
+        status = fetched( status, errnop );
+        if ( status == NSS_STATUS_NOTFOUND ) *h_errnop = HOST_NOT_FOUND;
+        expires = fill.expires;
+        goto done;
+    }
+    stats_event( STATS_CACHE_MISS );
 
-        if ( lookup == SQLITE_DONE ) goto finalize;
-        if ( lookup == SQLITE_BUSY ) {
-            status = NSS_STATUS_TRYAGAIN;
-            goto finalize;
-        }
-        if ( lookup != SQLITE_ROW ) goto finalize;
-
-        address = (const char *)sqlite3_column_text( stmt, 0 );
-
-        switch ( family ) {
-        case AF_INET6:
-            if ( inet_pton(AF_INET6, address, buffer) < 1 ) continue;
-            delta = sizeof(struct in6_addr);
-            result->h_addrtype = AF_INET6;
-            result->h_addr_list = data6->addresses;
-            result->h_aliases = data6->aliases;
-            result->h_name = data6->hostname;
-            break;
-        case AF_INET:
-            if ( inet_pton(AF_INET, address, buffer) < 1 ) continue;
-            delta = sizeof(struct in_addr);
-            result->h_addrtype = AF_INET;
-            result->h_addr_list = data4->addresses;
-            result->h_aliases = data4->aliases;
-            result->h_name = data4->hostname;
-            break;
-        }
-        result->h_length = delta;
-        result->h_addr_list[0] = buffer;
-        result->h_addr_list[1] = NULL;
-        result->h_aliases[0] = NULL;
-        strcpy( result->h_name, name );
+    status = wildcard_byname4( fill.name, zone, pat, buffer, buflen,
+                               errnop, h_errnop, &expires, &naddrs );
 
-        status = NSS_STATUS_SUCCESS;
+    switch ( status ) {
+    case NSS_STATUS_SUCCESS:
+        cache_store_tuples( name, generation, *pat, naddrs, expires );
+        break;
+    case NSS_STATUS_NOTFOUND:
+        cache_store_tuples( name, generation, NULL, 0, 0 );
+        break;
+    default:
         break;
     }
 
-finalize:
-    sqlite3_finalize( stmt );
-close:
-    sqlite3_close( db );
+done:
+    if ( status == NSS_STATUS_SUCCESS ) answer_ttl( expires, ttlp );
     return status;
 }
 
-/**
- */
-enum nss_status
-_nss_sqlite_gethostbyname_r( const char *name, struct hostent *result,
-                          char *buffer, size_t buflen,
-                          int *errnop, int *h_errnop )
-{
-    return _nss_sqlite_gethostbyname2_r( name, AF_INET, result, buffer, buflen, errnop, h_errnop );
-}
-
-/** Lookups for getaddrinfo and related functions
+/** Lookups for getaddrinfo of all families at once
+ *
+ * Builds the gaih_addrtuple chain for every IPv4 and IPv6 row of
+ * the name from a single by_name query.  An IPv6 row with a zone
+ * gets the index of that interface as its scopeid, and "name%zone"
+ * returns only the rows in that zone.  ttlp is set as for
+ * gethostbyname3_r.
  */
 enum nss_status
-_nss_sqlite_gethostbyname3_r( const char *name, int family, 
-                           struct hostent *result,
+_nss_sqlite_gethostbyname4_r( const char *name, struct gaih_addrtuple **pat,
                            char *buffer, size_t buflen,
-                           int *errnop, int *h_errnop,
-                           int32_t *ttlp, char **canonp )
+                           int *errnop, int *h_errnop, int32_t *ttlp )
 {
-    return _nss_sqlite_gethostbyname2_r( name, family, result, buffer, buflen, errnop, h_errnop );
+    uint64_t start = lookup_start();
+    return lookup_done( STATS_BYNAME4,
+                        cached_byname4(name, pat, buffer, buflen, errnop, h_errnop, ttlp),
+                        errnop, start );
 }
 
 /**
  */
-enum nss_status
-_nss_sqlite_gethostbyaddr_r( const char *address, socklen_t len, int family,
-                          struct hostent *result,
-                          char *buffer, size_t buflen,
-                          int *errnop, int *h_errnop )
+static enum nss_status
+lookup_byaddr( const char *address, socklen_t len, int family,
+               struct hostent *result,
+               char *buffer, size_t buflen,
+               int *errnop, int *h_errnop, time_t *expires )
 {
     enum nss_status status = NSS_STATUS_NOTFOUND;
 
     char addrbuf[128];
     const char *addr;
 
-    struct in6_data *data6 = (struct in6_data *)buffer;
-    struct in4_data *data4 = (struct in4_data *)buffer;
+    struct packer packer;
 
-    sqlite3      *db = NULL;
-    sqlite3_stmt *stmt = NULL;
+    struct connection *c;
+    struct snapshot *snap;
+    sqlite3_stmt *stmt;
+    int rows = 0;
 
-    if ( sqlite3_open(HOSTSDB, &db) != SQLITE_OK ) goto close;
-    if ( sqlite3_prepare(db, by_addr, strlen(by_addr), &stmt, NULL) != SQLITE_OK ) {
-        goto close;
+    if ( (family != AF_INET6 || len != sizeof(struct in6_addr)) &&
+         (family != AF_INET  || len != sizeof(struct in_addr)) ) {
+        *errnop = EAFNOSUPPORT;
+        *h_errnop = NO_RECOVERY;
+        return NSS_STATUS_UNAVAIL;
     }
 
-    addr = inet_ntop( family, address, addrbuf, sizeof(addrbuf) );
-
-    if ( addr == NULL ) {
-        /* return error */
+    if ( (c = connection(&snap)) == NULL ) return status;
+    if ( snap != NULL ) {
+        return snapshot_hostent( snap, snapshot_by_addr(snap, address, family), NULL, NULL,
+                                 result, buffer, buflen, errnop, h_errnop, expires );
     }
 
-    if ( sqlite3_bind_text(stmt, 1, addr, -1, SQLITE_STATIC) != SQLITE_OK ) {
-        goto finalize;
+    pack_init( &packer, buffer, buflen, len );
+    pack_address( &packer, address );
+
+    stmt = c->by_addr;
+
+    if ( c->version >= 2 ) {
+        if ( sqlite3_bind_blob(stmt, 1, address, len, SQLITE_STATIC) != SQLITE_OK ) {
+            goto reset;
+        }
+    } else {
+        addr = inet_ntop( family, address, addrbuf, sizeof(addrbuf) );
+        if ( addr == NULL ) goto reset;
+        if ( sqlite3_bind_text(stmt, 1, addr, -1, SQLITE_STATIC) != SQLITE_OK ) {
+            goto reset;
+        }
+    }
+    if ( bind_now(c, stmt, 2) != SQLITE_OK ) {
+        goto reset;
     }
 
     while (1) {
-        size_t delta;
-
         const char *hostname;
-        int lookup = sqlite3_step( stmt );
+        int lookup = connection_step( c, stmt, rows );
 
-        if ( lookup == SQLITE_DONE ) goto finalize;
-        if ( lookup == SQLITE_BUSY ) {
+        if ( lookup == SQLITE_DONE ) break;
+        if ( lookup == SQLITE_BUSY || lookup == SQLITE_LOCKED ) {
             status = NSS_STATUS_TRYAGAIN;
-            goto finalize;
+            *errnop = EAGAIN;
+            goto reset;
         }
-        if ( lookup != SQLITE_ROW ) goto finalize;
+        if ( lookup != SQLITE_ROW ) goto reset;
+        rows++;
 
         hostname = (const char *)sqlite3_column_text( stmt, 0 );
+        if ( hostname == NULL ) continue;
+        pack_alias( &packer, hostname );
+        expires_min( &packer.expires, column_expires(stmt, 1) );
+    }
+    connection_done( c, stmt );
 
-        switch ( family ) {
-        case AF_INET6:
-            if ( inet_pton(AF_INET6, addr, buffer) < 1 ) continue;
-            delta = sizeof(struct in6_addr);
-            result->h_addrtype = AF_INET6;
-            result->h_addr_list = data6->addresses;
-            result->h_aliases = data6->aliases;
-            result->h_name = data6->hostname;
-            break;
-        case AF_INET:
-            if ( inet_pton(AF_INET, addr, buffer) < 1 ) continue;
-            delta = sizeof(struct in_addr);
-            result->h_addrtype = AF_INET;
-            result->h_addr_list = data4->addresses;
-            result->h_aliases = data4->aliases;
-            result->h_name = data4->hostname;
-            break;
-        }
-        result->h_length = delta;
-        result->h_addr_list[0] = buffer;
-        result->h_addr_list[1] = NULL;
-        result->h_aliases[0] = NULL;
-        strcpy( result->h_name, hostname );
-
+    if ( packer.nnames > 0 ) {
+        if ( pack_hostent(&packer, result, family) < 0 ) goto range_error;
+        *expires = packer.expires;
         status = NSS_STATUS_SUCCESS;
-        break;
     }
+    return status;
 
-finalize:
-    sqlite3_finalize( stmt );
-close:
-    sqlite3_close( db );
+reset:
+    connection_done( c, stmt );
     return status;
+
+range_error:
+    range_need( packer.need );
+    *errnop = ERANGE;
+    *h_errnop = NETDB_INTERNAL;
+    return NSS_STATUS_TRYAGAIN;
 }
 
-static sqlite3      *gethostent_db = NULL;
-static sqlite3_stmt *gethostent_stmt = NULL;
-static char *gethostent_sql = "SELECT hostname,address FROM host";
+/**
+ * As cached_byname2, hosts-resolverd first and then the cache.
+ */
+static enum nss_status
+cached_byaddr( const char *address, socklen_t len, int family,
+               struct hostent *result,
+               char *buffer, size_t buflen,
+               int *errnop, int *h_errnop )
+{
+    struct fill fill = { NULL, result, NULL, buffer, buflen, errnop, h_errnop };
+    enum nss_status status;
+    uint64_t generation;
+    time_t expires = 0;
+
+    if ( range_refuse(CACHE_BYADDR, family, address, len, buflen, errnop, h_errnop) ) {
+        return NSS_STATUS_TRYAGAIN;
+    }
+    if ( resolver_fetch(RESOLVER_BYADDR, family, address, len, fill_hostent, &fill, &status) ) {
+        stats_event( STATS_RESOLVER );
+        return fetched( status, errnop );
+    }
+
+    if ( cache_fetch(CACHE_BYADDR, family, address, len, &generation,
+                     fill_hostent, &fill, &status) ) {
+        stats_event( STATS_CACHE_HIT );
+        return fetched( status, errnop );
+    }
+    stats_event( STATS_CACHE_MISS );
+
+    status = lookup_byaddr( address, len, family, result, buffer, buflen,
+                            errnop, h_errnop, &expires );
 
-static int
-prepare_hostent() {
-    if ( gethostent_stmt != NULL ) {
-        sqlite3_finalize( gethostent_stmt );
+    switch ( status ) {
+    case NSS_STATUS_SUCCESS:
+        cache_store_hostent( CACHE_BYADDR, family, address, len, generation, result, expires );
+        break;
+    case NSS_STATUS_NOTFOUND:
+        cache_store_hostent( CACHE_BYADDR, family, address, len, generation, NULL, 0 );
+        break;
+    default:
+        break;
     }
-    return sqlite3_prepare(gethostent_db, gethostent_sql, strlen(gethostent_sql), &gethostent_stmt, NULL);
+    return status;
 }
 
-/** Prepare for gethostent
+/** Reverse lookup
  *
- * mmap the current netmgr host table file and reset the current
- * index so gethostent will start at the beginning.
+ * Every name mapped to the address is returned, the first one added
+ * is h_name and the rest are aliases.  Results, including misses, are
+ * cached until the db changes.
  */
 enum nss_status
-_nss_sqlite_sethostent( int persist ) {
+_nss_sqlite_gethostbyaddr_r( const char *address, socklen_t len, int family,
+                          struct hostent *result,
+                          char *buffer, size_t buflen,
+                          int *errnop, int *h_errnop )
+{
+    uint64_t start = lookup_start();
+    return lookup_done( STATS_BYADDR,
+                        cached_byaddr(address, len, family, result, buffer, buflen, errnop, h_errnop),
+                        errnop, start );
+}
+
+/*
+ * The gethostent cursor.  glibc keeps one enumeration per process and
+ * may step it from any thread, so there is one cursor, behind a lock.
+ * Rows are read CURSOR_BATCH at a time by id, each batch in its own
+ * short read transaction on the calling thread's connection, so a
+ * long walk never holds the db open against writers or checkpoints.
+ * A walk that starts with hosts-resolverd running reads it from the
+ * daemon instead, to the end.
+ */
+#define CURSOR_BATCH RESOLVER_ROWS
+
+#define CURSOR_UNDECIDED 0
+#define CURSOR_RESOLVER  1
+#define CURSOR_DB        2
+
+struct cursor_row {
+    int family;
+    unsigned char addr[16];
+    char name[NI_MAXHOST];
+};
+
+struct cursor {
+    pthread_mutex_t lock;
+    int source;                 /* CURSOR_RESOLVER or _DB once started */
+    sqlite3_int64 last;         /* id of the last row read */
+    uint64_t position;          /* in the daemon's table */
+    int count;                  /* rows in the batch */
+    int next;                   /* next row of the batch to return */
+    int done;
+    struct cursor_row rows[CURSOR_BATCH];
+};
+
+static struct cursor cursor = { PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ */
+static void
+cursor_add( void *arg, int family, const void *addr, const char *name ) {
+    struct cursor *k = (struct cursor *)arg;
+    struct cursor_row *r = &k->rows[k->count];
+
+    if ( k->count == CURSOR_BATCH ) return;
+    r->family = family;
+    memcpy( r->addr, addr, sizeof(r->addr) );
+    snprintf( r->name, sizeof(r->name), "%s", name );
+    k->count++;
+}
+
+/** Read the next batch of rows from hosts-resolverd
+ *
+ * Called with the cursor locked.  Returns -1 if it could not be asked.
+ */
+static int
+cursor_resolve( struct cursor *k ) {
+    int rows;
+
+    k->count = 0;
+    k->next = 0;
+    if ( (rows = resolver_enumerate(&k->position, cursor_add, k)) < 0 ) return -1;
+    if ( rows == 0 ) k->done = 1;
+    return 0;
+}
+
+/** Read the next batch of rows into the cursor
+ *
+ * Called with the cursor locked.  Returns -1 if the db could not be
+ * read, and the cursor is left where it was.
+ */
+static int
+cursor_fill( struct cursor *k ) {
+    struct connection *c;
+    sqlite3_stmt *stmt;
+    sqlite3_int64 last = k->last;
+    int rows = 0, count = 0;
+    int lookup;
 
-    if ( gethostent_db == NULL ) {
-        if ( sqlite3_open(HOSTSDB, &gethostent_db) != SQLITE_OK ) {
-            sqlite3_close( gethostent_db );
-            gethostent_db = NULL;
-            /* not sure if this is a reasonable return here */
-            return NSS_STATUS_TRYAGAIN;
+    if ( k->source != CURSOR_DB ) {
+        if ( cursor_resolve(k) == 0 ) {
+            k->source = CURSOR_RESOLVER;
+            return 0;
         }
+        if ( k->source == CURSOR_RESOLVER ) return -1;
+        k->source = CURSOR_DB;
     }
 
-    if ( prepare_hostent() != SQLITE_OK ) {
-        sqlite3_close( gethostent_db );
-        gethostent_db = NULL;
-        /* not sure if this is a reasonable return here */
-        return NSS_STATUS_TRYAGAIN;
+    if ( (c = connection(NULL)) == NULL ) return -1;
+    stmt = c->enumerate;
+
+    if ( sqlite3_bind_int64(stmt, 1, k->last) != SQLITE_OK ||
+         sqlite3_bind_int(stmt, 2, CURSOR_BATCH) != SQLITE_OK ||
+         bind_now(c, stmt, 3) != SQLITE_OK ) {
+        connection_done( c, stmt );
+        return -1;
+    }
+
+    while ( (lookup = connection_step(c, stmt, rows)) == SQLITE_ROW ) {
+        struct cursor_row *r = &k->rows[count];
+        const char *name = (const char *)sqlite3_column_text( stmt, 1 );
+
+        rows++;
+        last = sqlite3_column_int64( stmt, 0 );
+        if ( name == NULL ) continue;
+        if ( (r->family = hosts_column_address(stmt, 2, r->addr)) == 0 ) continue;
+        snprintf( r->name, sizeof(r->name), "%s", name );
+        count++;
     }
+    connection_done( c, stmt );
+    if ( lookup != SQLITE_DONE ) return -1;
+
+    k->last = last;
+    k->count = count;
+    k->next = 0;
+    if ( rows < CURSOR_BATCH ) k->done = 1;
+    return 0;
+}
+
+/**
+ * Called with the cursor locked.
+ */
+static void
+cursor_rewind( struct cursor *k ) {
+    k->source = CURSOR_UNDECIDED;
+    k->last = 0;
+    k->position = 0;
+    k->count = 0;
+    k->next = 0;
+    k->done = 0;
+}
+
+/** Copy a cursor row out as a hostent
+ */
+static enum nss_status
+populate( const struct cursor_row *r, struct hostent *result,
+          char *buffer, size_t buflen, int *errnop, int *h_errnop )
+{
+    struct packer packer;
+
+    pack_init( &packer, buffer, buflen, hosts_address_length(r->family) );
+    pack_name( &packer, r->name );
+    pack_address( &packer, r->addr );
+    if ( pack_hostent(&packer, result, r->family) < 0 ) goto range_error;
+    return NSS_STATUS_SUCCESS;
+
+range_error:
+    *errnop = ERANGE;
+    *h_errnop = NETDB_INTERNAL;
+    return NSS_STATUS_TRYAGAIN;
+}
 
+/** Prepare for gethostent
+ *
+ * Rewind the cursor so gethostent will start at the beginning.
+ */
+enum nss_status
+_nss_sqlite_sethostent( int persist ) {
+    pthread_mutex_lock( &cursor.lock );
+    cursor_rewind( &cursor );
+    pthread_mutex_unlock( &cursor.lock );
     return NSS_STATUS_SUCCESS;
 }
 
@@ -370,49 +1816,47 @@ _nss_sqlite_sethostent( int persist ) {
  */
 enum nss_status
 _nss_sqlite_endhostent() {
-    if ( gethostent_stmt != NULL ) {
-        sqlite3_finalize( gethostent_stmt );
-        gethostent_stmt = NULL;
-    }
-    if ( gethostent_db != NULL ) {
-        sqlite3_close( gethostent_db );
-        gethostent_db = NULL;
-    }
+    pthread_mutex_lock( &cursor.lock );
+    cursor_rewind( &cursor );
+    pthread_mutex_unlock( &cursor.lock );
     return NSS_STATUS_SUCCESS;
 }
 
 /** Return next hostent in the current iterator
  *
- * This is normally called after a sethostent(), but this is written to
- * handle ill-behaved apps also by checking if it needs to be called and
- * calling before returning the first entry.
+ * This is normally called after a sethostent(), but a walk started
+ * without one begins at the first row.  A buffer too small for the
+ * row returns ERANGE and the same row is returned on the next call.
  */
 enum nss_status
 _nss_sqlite_gethostent_r( struct hostent *result, char *buffer, size_t buflen,
                        int *errnop, int *h_errnop )
 {
-    int lookup;
+    enum nss_status status = NSS_STATUS_NOTFOUND;
+    uint64_t start = lookup_start();
 
-    if ( gethostent_stmt == NULL ) {
-        _nss_sqlite_sethostent( 0 );
-    }
+    pthread_mutex_lock( &cursor.lock );
 
-    lookup = sqlite3_step( gethostent_stmt );
+    while ( cursor.next == cursor.count && cursor.done == 0 ) {
+        if ( cursor_fill(&cursor) < 0 ) {
+            status = NSS_STATUS_TRYAGAIN;
+            *errnop = EAGAIN;
+            *h_errnop = TRY_AGAIN;
+            goto unlock;
+        }
+    }
 
-    switch ( lookup ) {
-    case SQLITE_ROW:
-        populate( gethostent_stmt, result, buffer, buflen, errnop );
-        return NSS_STATUS_SUCCESS;
-    case SQLITE_BUSY:
-        return NSS_STATUS_TRYAGAIN;
-    case SQLITE_DONE:
-        /* do something else?? */
-        /* for now fall thru and treat like failure */
-        break;
+    if ( cursor.next == cursor.count ) {
+        *h_errnop = HOST_NOT_FOUND;
+        goto unlock;
     }
 
-    _nss_sqlite_endhostent();
-    return NSS_STATUS_NOTFOUND;
+    status = populate( &cursor.rows[cursor.next], result, buffer, buflen, errnop, h_errnop );
+    if ( status == NSS_STATUS_SUCCESS ) cursor.next++;
+
+unlock:
+    pthread_mutex_unlock( &cursor.lock );
+    return lookup_done( STATS_HOSTENT, status, errnop, start );
 }
 
 /*
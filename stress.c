@@ -0,0 +1,366 @@
+
+/*
+ * The MIT License (MIT)
+ * 
+ * Copyright (c) 2013-2024 Karl Redgate
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/** \file stress.c
+ * \brief Mixed reader/writer stress test of the NSS module
+ *
+ * Writer processes add and delete hosts through libhosts, committing
+ * as fast as they can, while reader threads resolve a fixed set of
+ * hosts through the NSS module.  Every one of those lookups must
+ * succeed: a TRYAGAIN, or a miss, fails the test.
+ *
+ * Usage: hosts_stress [--seconds N] [--readers N] [--writers N] [--as user] [module]
+ * with HOSTSDB naming a db created from hosts.sql.  With --as the
+ * readers run as that user, as most lookups do, while the writers
+ * stay root; the db must be readable by the user but its directory
+ * need not be writable.
+ *
+ * hosts_stress --resolve name [module] instead prints what the module
+ * answers for name, for each family and for both at once, for the
+ * test target to check.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pwd.h>
+#include <grp.h>
+#include <nss.h>
+#include <pthread.h>
+
+#include "hosts.h"
+
+#define STABLE_HOSTS 256
+#define CHURN_BATCH  20
+
+typedef enum nss_status (*byname2_fn)( const char *, int, struct hostent *,
+                                       char *, size_t, int *, int * );
+typedef enum nss_status (*byaddr_fn)( const void *, socklen_t, int, struct hostent *,
+                                      char *, size_t, int *, int * );
+typedef enum nss_status (*byname4_fn)( const char *, struct gaih_addrtuple **,
+                                       char *, size_t, int *, int *, int32_t * );
+
+static byname2_fn byname2;
+static byaddr_fn byaddr;
+static volatile sig_atomic_t running = 1;
+
+struct reader {
+    pthread_t thread;
+    unsigned int seed;
+    long lookups;
+    long tryagain;
+    long notfound;
+    long wrong;
+};
+
+/**
+ */
+static void
+stable_host( int i, char *name, size_t length, struct in_addr *addr ) {
+    snprintf( name, length, "stable%d", i );
+    addr->s_addr = htonl( 0x0a640000 | i );      /* 10.100.0.i */
+}
+
+/** Resolve the stable hosts, forward and back, until told to stop
+ */
+static void *
+reader( void *arg ) {
+    struct reader *r = (struct reader *)arg;
+    char buffer[1024];
+    char name[32];
+    struct hostent result;
+    struct in_addr addr;
+    enum nss_status status;
+    int errnop, h_errnop;
+
+    while ( running ) {
+        stable_host( rand_r(&r->seed) % STABLE_HOSTS, name, sizeof(name), &addr );
+
+        if ( r->lookups & 1 ) {
+            status = byaddr( &addr, sizeof(addr), AF_INET, &result,
+                             buffer, sizeof(buffer), &errnop, &h_errnop );
+        } else {
+            status = byname2( name, AF_INET, &result,
+                              buffer, sizeof(buffer), &errnop, &h_errnop );
+        }
+        r->lookups++;
+
+        switch ( status ) {
+        case NSS_STATUS_SUCCESS:
+            if ( strcasecmp(result.h_name, name) != 0 ||
+                 memcmp(result.h_addr_list[0], &addr, sizeof(addr)) != 0 ) {
+                r->wrong++;
+            }
+            break;
+        case NSS_STATUS_TRYAGAIN:
+            r->tryagain++;
+            break;
+        default:
+            r->notfound++;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/** Add and remove batches of hosts until the deadline
+ *
+ * Returns non-zero if any write failed.
+ */
+static int
+writer( int id, time_t deadline ) {
+    Hosts_handle *h;
+    char name[32], address[32];         /* as wide as the ints snprintf is given */
+    long commits = 0, failures = 0;
+    int round = 0, i;
+
+    if ( (h = Hosts_open(NULL)) == NULL ) return 1;
+
+    while ( time(NULL) < deadline ) {
+        if ( Hosts_begin(h) < 0 ) {
+            failures++;
+            continue;
+        }
+        for ( i = 0 ; i < CHURN_BATCH ; i++ ) {
+            snprintf( name, sizeof(name), "churn%d-%d", id, i );
+            snprintf( address, sizeof(address), "10.%d.%d.%d", 101 + id, round % 256, i );
+            if ( Hosts_add(h, name, address, NULL) < 0 ) failures++;
+        }
+        if ( Hosts_commit(h) < 0 ) failures++;
+
+        for ( i = 0 ; i < CHURN_BATCH ; i++ ) {
+            snprintf( name, sizeof(name), "churn%d-%d", id, i );
+            snprintf( address, sizeof(address), "10.%d.%d.%d", 101 + id, round % 256, i );
+            if ( Hosts_delete(h, name, address, NULL) < 0 ) failures++;
+        }
+        commits += 1 + CHURN_BATCH;
+        round++;
+    }
+
+    Hosts_close( h );
+    printf( "writer %d: %ld commits, %ld failures\n", id, commits, failures );
+    fflush( stdout );
+    return failures ? 1 : 0;
+}
+
+/**
+ */
+static int
+seed() {
+    Hosts_handle *h;
+    char name[32], address[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    int i;
+
+    if ( (h = Hosts_open(NULL)) == NULL ) return -1;
+    Hosts_begin( h );
+    for ( i = 0 ; i < STABLE_HOSTS ; i++ ) {
+        stable_host( i, name, sizeof(name), &addr );
+        inet_ntop( AF_INET, &addr, address, sizeof(address) );
+        if ( Hosts_add(h, name, address, NULL) < 0 ) {
+            Hosts_rollback( h );
+            Hosts_close( h );
+            return -1;
+        }
+    }
+    i = Hosts_commit( h );
+    Hosts_close( h );
+    return i;
+}
+
+/** Print the addresses the module has for name, one line per lookup
+ *
+ * Each line is the family looked up, inet, inet6 or all, followed by
+ * the addresses found or by notfound.
+ */
+static int
+resolve( void *handle, const char *name ) {
+    static const int families[] = { AF_INET, AF_INET6 };
+    byname4_fn byname4 = (byname4_fn)dlsym( handle, "_nss_sqlite_gethostbyname4_r" );
+    struct gaih_addrtuple *pat, *t;
+    struct hostent result;
+    char buffer[1024], address[INET6_ADDRSTRLEN];
+    int errnop, h_errnop, i, j;
+    int32_t ttl;
+
+    if ( byname4 == NULL ) return 1;
+    for ( i = 0 ; i < 2 ; i++ ) {
+        printf( "%s", families[i] == AF_INET ? "inet" : "inet6" );
+        if ( byname2(name, families[i], &result, buffer, sizeof(buffer),
+                     &errnop, &h_errnop) != NSS_STATUS_SUCCESS ) {
+            printf( " notfound\n" );
+            continue;
+        }
+        for ( j = 0 ; result.h_addr_list[j] != NULL ; j++ ) {
+            inet_ntop( families[i], result.h_addr_list[j], address, sizeof(address) );
+            printf( " %s", address );
+        }
+        printf( "\n" );
+    }
+
+    pat = NULL;
+    printf( "all" );
+    if ( byname4(name, &pat, buffer, sizeof(buffer), &errnop, &h_errnop, &ttl) != NSS_STATUS_SUCCESS ) {
+        printf( " notfound\n" );
+        return 0;
+    }
+    for ( t = pat ; t != NULL ; t = t->next ) {
+        inet_ntop( t->family, t->addr, address, sizeof(address) );
+        printf( " %s", address );
+    }
+    printf( "\n" );
+    return 0;
+}
+
+/** Become another user, for the lookups
+ */
+static int
+become( const char *user ) {
+    struct passwd *pw = getpwnam( user );
+
+    if ( pw == NULL ) return -1;
+    if ( setgroups(0, NULL) < 0 ) return -1;
+    if ( setgid(pw->pw_gid) < 0 ) return -1;
+    return setuid( pw->pw_uid );
+}
+
+static void
+usage() {
+    fprintf( stderr, "Usage: hosts_stress [--seconds N] [--readers N] [--writers N] [--as user] [module]\n" );
+    fprintf( stderr, "       hosts_stress --resolve name [module]\n" );
+    exit( EINVAL );
+}
+
+static struct option options[] = {
+    { "seconds", required_argument, NULL, 's' },
+    { "readers", required_argument, NULL, 'r' },
+    { "writers", required_argument, NULL, 'w' },
+    { "as",      required_argument, NULL, 'u' },
+    { "resolve", required_argument, NULL, 'n' },
+    { 0, 0, 0, 0 },
+};
+
+int
+main( int argc, char **argv ) {
+    char *module = "./libnss_sqlite.so";
+    char *user = NULL, *name = NULL;
+    int seconds = 5, nreaders = 4, nwriters = 2;
+    struct reader *readers;
+    struct reader total = { 0 };
+    time_t deadline;
+    void *handle;
+    pid_t *writers;
+    int c, i, status, failed = 0;
+
+    while ( (c = getopt_long(argc, argv, "", options, NULL)) != -1 ) {
+        switch ( c ) {
+        case 's': seconds = atoi( optarg ); break;
+        case 'r': nreaders = atoi( optarg ); break;
+        case 'w': nwriters = atoi( optarg ); break;
+        case 'u': user = optarg; break;
+        case 'n': name = optarg; break;
+        default: usage();
+        }
+    }
+    if ( optind < argc ) module = argv[optind];
+
+    if ( (handle = dlopen(module, RTLD_NOW)) == NULL ) {
+        fprintf( stderr, "%s\n", dlerror() );
+        return 1;
+    }
+    byname2 = (byname2_fn)dlsym( handle, "_nss_sqlite_gethostbyname2_r" );
+    byaddr = (byaddr_fn)dlsym( handle, "_nss_sqlite_gethostbyaddr_r" );
+    if ( byname2 == NULL || byaddr == NULL ) {
+        fprintf( stderr, "%s is not the sqlite NSS module\n", module );
+        return 1;
+    }
+    if ( name != NULL ) return resolve( handle, name );
+
+    if ( seed() < 0 ) {
+        fprintf( stderr, "could not add the stable hosts\n" );
+        return 1;
+    }
+
+    /* writers are forked before any reader thread exists */
+    deadline = time( NULL ) + seconds;
+    writers = calloc( nwriters, sizeof(*writers) );
+    for ( i = 0 ; i < nwriters ; i++ ) {
+        if ( (writers[i] = fork()) == 0 ) {
+            _exit( writer(i, deadline) );
+        }
+    }
+
+    if ( user != NULL && become(user) < 0 ) {
+        fprintf( stderr, "could not become %s\n", user );
+        return 1;
+    }
+
+    readers = calloc( nreaders, sizeof(*readers) );
+    for ( i = 0 ; i < nreaders ; i++ ) {
+        readers[i].seed = i + 1;
+        pthread_create( &readers[i].thread, NULL, reader, &readers[i] );
+    }
+
+    for ( i = 0 ; i < nwriters ; i++ ) {
+        if ( waitpid(writers[i], &status, 0) < 0 ||
+             !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+            failed = 1;
+        }
+    }
+    while ( time(NULL) < deadline ) sleep( 1 );
+    running = 0;
+
+    for ( i = 0 ; i < nreaders ; i++ ) {
+        pthread_join( readers[i].thread, NULL );
+        total.lookups += readers[i].lookups;
+        total.tryagain += readers[i].tryagain;
+        total.notfound += readers[i].notfound;
+        total.wrong += readers[i].wrong;
+    }
+
+    printf( "%ld lookups in %d seconds: %ld tryagain, %ld not found, %ld wrong\n",
+            total.lookups, seconds, total.tryagain, total.notfound, total.wrong );
+
+    if ( total.tryagain || total.notfound || total.wrong ) failed = 1;
+    if ( failed ) printf( "FAILED\n" );
+    return failed;
+}
+
+/*
+ * vim:autoindent
+ * vim:expandtab
+ */